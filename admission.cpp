@@ -0,0 +1,91 @@
+#include "cube.h"
+#include "admission.h"
+
+VAR(connectburst, 0, 5, 1000); // connects one address can make at once, 0 disables the limits
+VAR(connectrate, 1, 12, 6000); // and then per minute
+VAR(subnetburst, 1, 20, 10000); // the same for a /24
+VAR(subnetrate, 1, 60, 60000);
+VAR(floodconnects, 1, 30, 10000); // connects a second that count as a flood
+VAR(floodtime, 1, 30, 3600); // seconds
+VAR(floodnewrate, 0, 2, 1000); // connects a second from unverified addresses during a flood
+
+#define ADMIT_BITS 12
+#define ADMIT_SLOTS (1<<ADMIT_BITS)
+#define ADMIT_PROBES 4
+
+struct admitentry {
+	uint key;
+	bool used, verified;
+	float tokens;
+	int64_t last;
+};
+
+static admitentry ipslots[ADMIT_SLOTS], subnetslots[ADMIT_SLOTS];
+static int64_t floodsecond = 0, floodend = 0, newsecond = 0;
+static int floodcount = 0, newcount = 0;
+static int admitted = 0, rejectedip = 0, rejectedsubnet = 0, rejectedflood = 0, floods = 0;
+
+extern int64_t totalmillis;
+
+// the entry for key, or the least recently seen slot in its probe window reset for it
+static admitentry &lookup(admitentry *slots, uint key, int burst) {
+	uint h = (key * 2654435769U) >> (32 - ADMIT_BITS);
+	admitentry *oldest = NULL;
+	loopi(ADMIT_PROBES) {
+		admitentry &e = slots[(h + i) & (ADMIT_SLOTS - 1)];
+		if(e.used && e.key == key) return e;
+		if(!oldest || !e.used || (oldest->used && e.last < oldest->last)) oldest = &e;
+	}
+	oldest->key = key;
+	oldest->used = true;
+	oldest->verified = false;
+	oldest->tokens = burst;
+	oldest->last = totalmillis;
+	return *oldest;
+}
+
+static bool take(admitentry &e, int burst, int perminute) {
+	e.tokens = min(float(burst), e.tokens + (totalmillis - e.last) * perminute / 60000.0f);
+	e.last = totalmillis;
+	if(e.tokens < 1) return false;
+	e.tokens -= 1;
+	return true;
+}
+
+bool admitconnect(uint ip) {
+	if(!connectburst) { admitted++; return true; }
+	ip = endianswap32(ip);
+	int64_t second = totalmillis / 1000;
+	if(second != floodsecond) { floodsecond = second; floodcount = 0; }
+	if(++floodcount > floodconnects) {
+		if(totalmillis >= floodend) {
+			floods++;
+			conoutf("connect flood: over %d connects a second, limiting new addresses for %d seconds", floodconnects, floodtime);
+		}
+		floodend = totalmillis + floodtime * 1000;
+	}
+
+	admitentry &host = lookup(ipslots, ip, connectburst);
+	if(!take(host, connectburst, connectrate)) { rejectedip++; return false; }
+	if(!host.verified) {
+		admitentry &subnet = lookup(subnetslots, ip & 0xFFFFFF00, subnetburst);
+		if(!take(subnet, subnetburst, subnetrate)) { rejectedsubnet++; return false; }
+		if(totalmillis < floodend) {
+			if(second != newsecond) { newsecond = second; newcount = 0; }
+			if(newcount >= floodnewrate) { rejectedflood++; return false; }
+			newcount++;
+		}
+	}
+	admitted++;
+	return true;
+}
+
+void admitverified(uint ip) {
+	if(connectburst) lookup(ipslots, endianswap32(ip), connectburst).verified = true;
+}
+
+ICOMMAND(admissionstats, "", (), {
+	defformatstring(s)("%d admitted, %d over the address limit, %d over the subnet limit, %d refused in a flood, %d floods%s",
+		admitted, rejectedip, rejectedsubnet, rejectedflood, floods, totalmillis < floodend ? " (flood mode)" : "");
+	result(s);
+});
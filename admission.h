@@ -0,0 +1,15 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+// rate limits new connections before they get a client slot: a token bucket per source
+// address and one per /24, kept in fixed-size tables where new addresses push out the
+// least recently seen. when connects across all addresses exceed floodconnects a second,
+// the server goes into flood mode for floodtime seconds and addresses that never finished
+// a connect share a small global budget. spoofed sources never get this far: enet's
+// connect/verify/ack handshake has already proven the address by then.
+
+// ip in network order, as in ENetAddress
+bool admitconnect(uint ip);
+void admitverified(uint ip); // the client got through SV_CONNECT
+
+#endif /* ADMISSION_H_ */
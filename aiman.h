@@ -163,6 +163,7 @@ namespace aiman {
         if(owner) owner->bots.add(ci);
         ci->state.skill = skill <= 0 ? rnd(50) + 51 : clamp(skill, 1, 101);
 		clients.add(ci);
+		statuschanged();
 		ci->state.lasttimeplayed = lastmillis;
 
 		//vampi: pick best bot name
@@ -203,6 +204,7 @@ namespace aiman {
         clientinfo *owner = (clientinfo *)getclientinfo(ci->ownernum);
         if(owner) owner->bots.removeobj(ci);
         clients.removeobj(ci);
+        statuschanged();
         DELETEP(bots[cn]);
 		dorefresh = true;
 	}
@@ -0,0 +1,230 @@
+#include "cube.h"
+#include "banlog.h"
+#ifndef WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// file: magic, version, then records of op ('+' or '-'), kind, match\0 and, for '+', reason\0
+#define BANLOG_MAGIC "FROGBANS"
+#define BANLOG_VERSION 1
+#define BANLOG_COMPACTMIN 1024
+
+struct banwriter {
+	string path, tmppath;
+	FILE *f;
+	vector<uchar> pending;
+	bool replace, quit;
+#ifndef WIN32
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+
+	banwriter() : f(NULL), replace(false), quit(false) {}
+
+	void sync(FILE *file) {
+		fflush(file);
+#ifndef WIN32
+		fdatasync(fileno(file));
+#endif
+	}
+
+	// called without the lock; buf is owned by the caller
+	void write(const uchar *buf, int len, bool rewrite) {
+		if(rewrite) {
+			if(f) { fclose(f); f = NULL; }
+			FILE *t = fopen(tmppath, "wb");
+			if(!t) { conoutf("could not write %s", tmppath); return; }
+			fwrite(buf, 1, len, t);
+			sync(t);
+			fclose(t);
+#ifdef WIN32
+			::remove(path);
+#endif
+			if(rename(tmppath, path) < 0) conoutf("could not replace %s", path);
+			return;
+		}
+		if(!f && !(f = fopen(path, "ab"))) { conoutf("could not append to %s", path); return; }
+		fwrite(buf, 1, len, f);
+		sync(f);
+	}
+
+#ifndef WIN32
+	static void *run(void *arg) {
+		banwriter *w = (banwriter *)arg;
+		vector<uchar> buf;
+		pthread_mutex_lock(&w->lock);
+		for(;;) {
+			while(w->pending.empty() && !w->quit) pthread_cond_wait(&w->cond, &w->lock);
+			if(w->pending.empty()) break;
+			buf.move(w->pending);
+			bool rewrite = w->replace;
+			w->replace = false;
+			pthread_mutex_unlock(&w->lock);
+			w->write(buf.getbuf(), buf.length(), rewrite);
+			buf.setsize(0);
+			pthread_mutex_lock(&w->lock);
+		}
+		pthread_mutex_unlock(&w->lock);
+		return NULL;
+	}
+#endif
+};
+
+banlog::banlog() : records(0), live(0), dump(NULL), snapshotting(false), writer(NULL) {
+	filename[0] = 0;
+}
+
+banlog::~banlog() {
+	close();
+}
+
+static void putheader(vector<uchar> &buf) {
+	buf.put((const uchar *)BANLOG_MAGIC, 8);
+	int version = BANLOG_VERSION;
+	lilswap(&version, 1);
+	buf.put((const uchar *)&version, sizeof(version));
+}
+
+int banlog::open(const char *name, applyfn apply, dumpfn dumpcb) {
+	close();
+	copystring(filename, name);
+	dump = dumpcb;
+	records = live = 0;
+
+	int size = 0;
+	uchar *data = mapfile(filename, &size);
+	bool valid = false, clean = true;
+	if(data) {
+		int version = 0;
+		if(size >= 8 + (int)sizeof(version)) {
+			memcpy(&version, data + 8, sizeof(version));
+			lilswap(&version, 1);
+		}
+		valid = size >= 8 + (int)sizeof(version) && !memcmp(data, BANLOG_MAGIC, 8) && version == BANLOG_VERSION;
+		if(!valid) conoutf("%s is not a ban log, starting a new one", filename);
+	}
+	if(valid) {
+		const char *p = (const char *)data + 12, *end = (const char *)data + size;
+		while(p < end) {
+			if(end - p < 3 || (p[0] != '+' && p[0] != '-') || uchar(p[1]) >= BANLOG_NUMKINDS) { clean = false; break; }
+			bool add = p[0] == '+';
+			int kind = p[1];
+			const char *match = p + 2, *mend = (const char *)memchr(match, 0, end - match);
+			if(!mend) { clean = false; break; }
+			const char *reason = "", *rend = mend;
+			if(add) {
+				reason = mend + 1;
+				if(reason >= end || !(rend = (const char *)memchr(reason, 0, end - reason))) { clean = false; break; }
+			}
+			p = rend + 1;
+			apply(kind, match, reason, add);
+			records++;
+			live += add ? 1 : -1;
+		}
+		if(!clean) conoutf("ignoring a torn record at the end of %s", filename);
+	}
+	unmapfile(data, size);
+
+	writer = new banwriter;
+	const char *found = findfile(filename, "wb");
+	copystring(writer->path, found);
+	formatstring(writer->tmppath)("%s.tmp", writer->path);
+#ifndef WIN32
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	if(pthread_create(&writer->thread, NULL, banwriter::run, writer)) {
+		conoutf("could not start the ban log writer, writing synchronously");
+		pthread_mutex_destroy(&writer->lock);
+		pthread_cond_destroy(&writer->cond);
+		writer->quit = true;
+	}
+#endif
+
+	if(!valid || !clean) compact();
+	else maybecompact();
+	return live;
+}
+
+void banlog::putrecord(vector<uchar> &buf, int op, int kind, const char *match, const char *reason) {
+	buf.add(op);
+	buf.add(kind);
+	buf.put((const uchar *)match, strlen(match) + 1);
+	if(op == '+') {
+		if(!reason) reason = "";
+		buf.put((const uchar *)reason, strlen(reason) + 1);
+	}
+}
+
+void banlog::queue(vector<uchar> &buf, bool replace) {
+	if(!writer) return;
+#ifndef WIN32
+	if(!writer->quit) {
+		pthread_mutex_lock(&writer->lock);
+		if(replace) { writer->pending.setsize(0); writer->replace = true; }
+		writer->pending.put(buf.getbuf(), buf.length());
+		pthread_cond_signal(&writer->cond);
+		pthread_mutex_unlock(&writer->lock);
+		return;
+	}
+#endif
+	writer->write(buf.getbuf(), buf.length(), replace);
+}
+
+void banlog::add(int kind, const char *match, const char *reason) {
+	if(snapshotting) { putrecord(snapshot, '+', kind, match, reason); live++; return; }
+	if(!writer) return;
+	vector<uchar> buf;
+	putrecord(buf, '+', kind, match, reason);
+	queue(buf, false);
+	records++;
+	live++;
+}
+
+void banlog::remove(int kind, const char *match) {
+	if(!writer) return;
+	vector<uchar> buf;
+	putrecord(buf, '-', kind, match, NULL);
+	queue(buf, false);
+	records++;
+	live--;
+	maybecompact();
+}
+
+void banlog::maybecompact() {
+	if(records > BANLOG_COMPACTMIN && records > 2*live) compact();
+}
+
+// snapshots the live entries on this thread; the writer swaps it in for the old file
+void banlog::compact() {
+	if(!writer) return;
+	snapshot.setsize(0);
+	putheader(snapshot);
+	live = 0;
+	if(dump) {
+		snapshotting = true;
+		dump(*this);
+		snapshotting = false;
+	}
+	records = live;
+	queue(snapshot, true);
+	snapshot.setsize(0);
+}
+
+void banlog::close() {
+	if(!writer) return;
+#ifndef WIN32
+	if(!writer->quit) {
+		pthread_mutex_lock(&writer->lock);
+		writer->quit = true;
+		pthread_cond_signal(&writer->cond);
+		pthread_mutex_unlock(&writer->lock);
+		pthread_join(writer->thread, NULL);
+		pthread_mutex_destroy(&writer->lock);
+		pthread_cond_destroy(&writer->cond);
+	}
+#endif
+	if(writer->f) fclose(writer->f);
+	DELETEP(writer);
+}
@@ -0,0 +1,37 @@
+#ifndef BANLOG_H_
+#define BANLOG_H_
+
+// append-only record log for bans and notices. the file is loaded through mmap at
+// startup; each change is one appended record, written and synced by a writer
+// thread so the game loop never waits on the disk. when removals pile up the log is
+// rewritten from a snapshot of the live entries.
+enum { BANLOG_BAN = 0, BANLOG_BLACKLIST, BANLOG_WHITELIST, BANLOG_NUMKINDS };
+
+struct banlog {
+	typedef void (*applyfn)(int kind, const char *match, const char *reason, bool add);
+	typedef void (*dumpfn)(banlog &log);
+
+	string filename;
+	int records, live; // records in the file, entries they add up to
+	dumpfn dump;
+	vector<uchar> snapshot;
+	bool snapshotting;
+	struct banwriter *writer;
+
+	banlog();
+	~banlog();
+
+	// replays the file through apply, then starts the writer. returns the number of live entries
+	int open(const char *name, applyfn apply, dumpfn dump);
+	void add(int kind, const char *match, const char *reason = NULL);
+	void remove(int kind, const char *match);
+	void compact();
+	void close(); // flushes and joins the writer
+
+private:
+	void putrecord(vector<uchar> &buf, int op, int kind, const char *match, const char *reason);
+	void queue(vector<uchar> &buf, bool replace);
+	void maybecompact();
+};
+
+#endif /* BANLOG_H_ */
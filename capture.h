@@ -819,7 +819,11 @@ struct captureclientmode : clientmode
             baseinfo &b = bases[i];
             if(b.enemy[0])
             {
-                if(!b.owners || !b.enemies) b.occupy(b.enemy, OCCUPYBONUS*(b.enemies ? 1 : -1) + OCCUPYPOINTS*(b.enemies ? b.enemies : -(1+b.owners))*t);
+                if(!b.owners || !b.enemies)
+                {
+                    int captured = b.occupy(b.enemy, OCCUPYBONUS*(b.enemies ? 1 : -1) + OCCUPYPOINTS*(b.enemies ? b.enemies : -(1+b.owners))*t);
+                    if(captured >= 0) logevent(GE_BASE, NULL, i, captured, captured ? b.owner : b.enemy);
+                }
                 sendbaseinfo(i);
             }
             else if(b.owner[0])
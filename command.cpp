@@ -131,6 +131,8 @@ COMMAND(push, "ss");
 COMMAND(pop, "s");
 COMMAND(resetvar, "s");
 
+static void forgetscript(const char *p);
+
 void aliasa(const char *name, char *action) {
 	ident *b = idents->access(name);
 
@@ -144,6 +146,7 @@ void aliasa(const char *name, char *action) {
 		conoutf(CON_ERROR, "cannot redefine builtin %s with an alias", name);
 		delete[]action;
 	} else {
+		forgetscript(b->action);
 		if(b->action != b->isexecuting)
 			delete[]b->action;
 		b->action = action;
@@ -449,23 +452,31 @@ char *parseexp(const char *&p, int right)	// parse any nested set of () or []
 	return s;
 }
 
+static char *identvalue(ident *id) {
+	switch (id->type) {
+	  case ID_VAR:{
+			  defformatstring(t) ("%d", *id->storage.i);
+			  return newstring(t);
+		  }
+	  case ID_FVAR:
+		  return newstring(floatstr(*id->storage.f));
+	  case ID_SVAR:
+		  return newstring(*id->storage.s);
+	  case ID_ALIAS:
+		  return newstring(id->action);
+	}
+	return NULL;
+}
+
 char *lookup(char *n)			// find value of ident referenced with $ in exp
 {
 	ident *id = idents->access(n + 1);
+	char *val = id ? identvalue(id) : NULL;
 
-	if(id)
-		switch (id->type) {
-		  case ID_VAR:{
-				  defformatstring(t) ("%d", *id->storage.i);
-				  return exchangestr(n, t);
-			  }
-		  case ID_FVAR:
-			  return exchangestr(n, floatstr(*id->storage.f));
-		  case ID_SVAR:
-			  return exchangestr(n, *id->storage.s);
-		  case ID_ALIAS:
-			  return exchangestr(n, id->action);
-		}
+	if(val) {
+		delete[]n;
+		return val;
+	}
 	defformatstring(str) ("echo Unknown alias lookup: %s", n + 1);
 	execute(str);
 	return n;
@@ -548,16 +559,416 @@ static inline bool isinteger(char *c) {
 
 char *commandret = NULL;
 
-char *executeret(const char *p)	// all evaluation happens here, recursively
-{
-	const int MAXWORDS = 25;	// limit, remove
+// script budgets: executeguarded() runs text from players and IRC under a limit on
+// statements and on milliseconds. when one runs out scriptabort is set, and every
+// executeret() and loop unwinds without running anything more. nesting is limited
+// for all scripts, since a runaway recursion would otherwise overflow the stack.
+VAR(scriptdepth, 16, 1000, 100000);
+VAR(scriptsteps, 0, 1000000, INT_MAX);	// statements per guarded run, 0 for no limit
+VAR(scriptmillis, 0, 50, 10000);	// guarded script time per server tick
+VAR(scriptquota, 0, 2000, 60000);	// guarded script time per source per minute
+
+#define SCRIPTCLOCKSTEPS 256	// statements between looks at the clock
+
+static bool scriptabort = false;
+static int scriptnest = 0, scriptguard = 0, scriptstepsleft = 0, scriptclock = 0;
+static int64_t scriptdeadline = 0;
+static const char *scriptalias = NULL;	// innermost running alias, for the report
+static string scriptwhy;
+
+static void stopscript(const char *why) {
+	if(scriptabort)
+		return;
+	scriptabort = true;
+	if(scriptalias)
+		formatstring(scriptwhy) ("%s in alias %s", why, scriptalias);
+	else
+		copystring(scriptwhy, why);
+}
 
-	char *w[MAXWORDS];
+// counts one statement of a guarded run
+static bool scriptstep() {
+	if(scriptsteps && --scriptstepsleft < 0) {
+		defformatstring(why) ("script ran more than %d statements", scriptsteps);
+		stopscript(why);
+	} else if(++scriptclock >= SCRIPTCLOCKSTEPS) {
+		scriptclock = 0;
+		if(get_ticks() >= scriptdeadline)
+			stopscript("script ran out of time");
+	}
+	return !scriptabort;
+}
 
-	char *retval = NULL;
+#define SCRIPTSTEP (!scriptabort && (!scriptguard || scriptstep()))
+
+#define MAXWORDS 25
+
+// runs one statement whose words are already evaluated. returns true if it took over w
+static bool callstatement(char **w, int numargs, int infix, ident *id, char *&retval) {
+	char *c = w[0];
 
 #define setretval(v) { char *rv = v; if(rv) retval = rv; }
-	for(bool cont = true; cont;)	// for each ; seperated statement
+	if(infix) {
+		switch (infix) {
+		  case '=':
+			  aliasa(c, numargs > 2 ? w[2] : newstring(""));
+			  w[2] = NULL;
+			  break;
+		}
+	} else {
+		if(!id) {
+			if(!isinteger(c)) {
+				defformatstring(str) ("echo Unknown command %s", c);
+				execute(str);
+			}
+			setretval(newstring(c));
+		} else
+			switch (id->type) {
+			  case ID_CCOMMAND:
+			  case ID_COMMAND:	// game defined commands
+				  {
+					  void *v[MAXWORDS];
+
+					  union {
+						  int i;
+						  float f;
+					  } nstor[MAXWORDS];
+
+					  int n = 0, wn = 0;
+
+					  char *cargs = NULL;
+
+					  if(id->type == ID_CCOMMAND)
+						  v[n++] = id->self;
+					  for(const char *a = id->narg; *a; a++, n++)
+						  switch (*a) {
+							case 's':
+								v[n] = w[++wn];
+								break;
+							case 'i':
+								nstor[n].i = parseint(w[++wn]);
+								v[n] = &nstor[n].i;
+								break;
+							case 'f':
+								nstor[n].f = atof(w[++wn]);
+								v[n] = &nstor[n].f;
+								break;
+							case 'V':
+								v[n++] = w + 1;
+								nstor[n].i = numargs - 1;
+								v[n] = &nstor[n].i;
+								break;
+							case 'C':
+								if(!cargs)
+									cargs = conc(w + 1, numargs - 1, true);
+								v[n] = cargs;
+								break;	// all args
+							case 'R':
+								if(!cargs)
+									cargs = conc(w + 1 + n, numargs - 1 - n, true);
+								v[n] = cargs;
+								break;	// rest of args
+							default:
+								fatal("builtin declared with illegal type");
+						  }
+					  switch (n) {
+						case 0:
+							((void (__cdecl *) ()) id->fun) ();
+							break;
+						case 1:
+							((void (__cdecl *) (void *)) id->fun) (v[0]);
+							break;
+						case 2:
+							((void (__cdecl *) (void *, void *)) id->fun) (v[0], v[1]);
+							break;
+						case 3:
+							((void (__cdecl *) (void *, void *, void *)) id->fun) (v[0], v[1], v[2]);
+							break;
+						case 4:
+							((void (__cdecl *) (void *, void *, void *, void *)) id->fun) (v[0], v[1], v[2], v[3]);
+							break;
+						case 5:
+							((void (__cdecl *) (void *, void *, void *, void *, void *)) id->fun) (v[0], v[1], v[2],
+																								   v[3], v[4]);
+							break;
+						case 6:
+							((void (__cdecl *) (void *, void *, void *, void *, void *, void *)) id->fun) (v[0],
+																										   v[1],
+																										   v[2],
+																										   v[3],
+																										   v[4],
+																										   v[5]);
+							break;
+						case 7:
+							((void (__cdecl *) (void *, void *, void *, void *, void *, void *, void *)) id->
+							 fun) (v[0], v[1], v[2], v[3], v[4], v[5], v[6]);
+							break;
+						case 8:
+							((void (__cdecl *) (void *, void *, void *, void *, void *, void *, void *, void *))
+							 id->fun) (v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+							break;
+						default:
+							fatal("builtin declared with too many args (use V?)");
+					  }
+					  if(cargs)
+						  delete[]cargs;
+					  setretval(commandret);
+					  commandret = NULL;
+					  break;
+				  }
+
+			  case ID_VAR:	// game defined variables 
+				  if(numargs <= 1) {
+					  if(id->flags & IDF_HEX && id->maxval == 0xFFFFFF)
+						  conoutf("%s = 0x%.6X (%d, %d, %d)", c, *id->storage.i, (*id->storage.i >> 16) & 0xFF,
+								  (*id->storage.i >> 8) & 0xFF, *id->storage.i & 0xFF);
+					  else
+						  conoutf(id->flags & IDF_HEX ? "%s = 0x%X" : "%s = %d", c, *id->storage.i);	// var with no value just prints its current value
+				  } else if(id->flags & IDF_READONLY)
+					  conoutf(CON_ERROR, "variable %s is read-only", id->name);
+				  else {
+					  OVERRIDEVAR(break, id->overrideval.i = *id->storage.i,,)
+					  int i1 = parseint(w[1]);
+
+					  if(id->flags & IDF_HEX && numargs > 2) {
+						  i1 <<= 16;
+						  i1 |= parseint(w[2]) << 8;
+						  i1 |= parseint(w[3]);
+					  }
+					  if(i1 < id->minval || i1 > id->maxval) {
+						  i1 = i1 < id->minval ? id->minval : id->maxval;	// clamp to valid range
+						  conoutf(CON_ERROR,
+								  id->flags & IDF_HEX ?
+								  (id->minval <=
+								   255 ? "valid range for %s is %d..0x%X" : "valid range for %s is 0x%X..0x%X") :
+								  "valid range for %s is %d..%d", id->name, id->minval, id->maxval);
+					  }
+					  *id->storage.i = i1;
+					  id->changed();	// call trigger function if available
+				  }
+				  break;
+
+			  case ID_FVAR:
+				  if(numargs <= 1)
+					  conoutf("%s = %s", c, floatstr(*id->storage.f));
+				  else if(id->flags & IDF_READONLY)
+					  conoutf(CON_ERROR, "variable %s is read-only", id->name);
+				  else {
+					  OVERRIDEVAR(break, id->overrideval.f = *id->storage.f,,);
+					  float f1 = atof(w[1]);
+
+					  if(f1 < id->minvalf || f1 > id->maxvalf) {
+						  f1 = f1 < id->minvalf ? id->minvalf : id->maxvalf;	// clamp to valid range
+						  conoutf(CON_ERROR, "valid range for %s is %s..%s", id->name, floatstr(id->minvalf),
+								  floatstr(id->maxvalf));
+					  }
+					  *id->storage.f = f1;
+					  id->changed();
+				  }
+				  break;
+
+			  case ID_SVAR:
+				  if(numargs <= 1)
+					  conoutf(strchr(*id->storage.s, '"') ? "%s = [%s]" : "%s = \"%s\"", c, *id->storage.s);
+				  else if(id->flags & IDF_READONLY)
+					  conoutf(CON_ERROR, "variable %s is read-only", id->name);
+				  else {
+					  OVERRIDEVAR(break, id->overrideval.s =
+								  *id->storage.s, delete[]id->overrideval.s, delete[] * id->storage.s);
+					  *id->storage.s = newstring(w[1]);
+					  id->changed();
+				  }
+				  break;
+
+			  case ID_ALIAS:	// alias, also used as functions and (global) variables
+				  {
+					  delete[]w[0];
+					  static vector < ident * >argids;
+
+					  for(int i = 1; i < numargs; i++) {
+						  if(i > argids.length()) {
+							  defformatstring(argname) ("arg%d", i);
+							  argids.add(newident(argname));
+						  }
+						  pushident(*argids[i - 1], w[i]);	// set any arguments as (global) arg values so functions can access them
+					  }
+					  _numargs = numargs - 1;
+					  bool wasoverriding = overrideidents;
+
+					  if(id->override != NO_OVERRIDE)
+						  overrideidents = true;
+					  char *wasexecuting = id->isexecuting;
+
+					  const char *wasalias = scriptalias;
+
+					  id->isexecuting = id->action;
+					  scriptalias = id->name;
+					  setretval(executeret(id->action));
+					  scriptalias = wasalias;
+					  if(id->isexecuting != id->action && id->isexecuting != wasexecuting)
+						  delete[]id->isexecuting;
+					  id->isexecuting = wasexecuting;
+					  overrideidents = wasoverriding;
+					  for(int i = 1; i < numargs; i++)
+						  popident(*argids[i - 1]);
+					  return true;
+				  }
+			}
+	}
+	return false;
+}
+
+// script profiler: with scriptprofile set every command and alias call is timed. self
+// time leaves out the calls made from inside it, and total time counts a recursive alias
+// once. the time of each chain of calls is also kept folded, the way flamegraph.pl reads it
+VAR(scriptprofile, 0, 0, 1);
+
+struct profframe {
+	scriptprofentry *prof;
+	int64_t start, children;
+	int pathlen;
+};
+
+static hashtable < const char *, scriptprofentry > scriptprofs;
+static hashtable < const char *, int64_t > scriptstacks;
+static vector < profframe > profframes;
+static vector < char >profpath;
+
+#define MAXPROFPATH 512	// deeper frames are charged to the stack as it was at this length
+
+static int64_t profclock() {
+	timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// a recursive alias would add a key per depth: direct recursion is folded into the caller's
+// frame, and anything else stops growing the path at MAXPROFPATH
+static void profenter(ident *id) {
+	scriptprofentry *prof = scriptprofs.access(id->name);
+
+	if(!prof) {
+		scriptprofentry init = { id->name, 0, 0, 0, 0 };
+		prof = &scriptprofs.access(id->name, init);
+	}
+	prof->active++;
+	bool recursed = profframes.length() && profframes.last().prof == prof;
+	profframe &f = profframes.add();
+
+	f.prof = prof;
+	f.children = 0;
+	f.pathlen = profpath.length();
+	if(!recursed && f.pathlen < MAXPROFPATH) {
+		if(f.pathlen)
+			profpath.add(';');
+		profpath.put(id->name, strlen(id->name));
+	}
+	f.start = profclock();
+}
+
+static void profleave() {
+	int64_t elapsed = profclock() - profframes.last().start;
+
+	profframe f = profframes.pop();
+	scriptprofentry *prof = f.prof;
+
+	prof->calls++;
+	prof->self += elapsed - f.children;
+	if(!--prof->active)
+		prof->total += elapsed;
+	if(profframes.length())
+		profframes.last().children += elapsed;
+
+	profpath.add('\0');
+	int64_t *t = scriptstacks.access(profpath.getbuf());
+
+	if(!t)
+		t = &scriptstacks.access(newstring(profpath.getbuf()), 0);
+	*t += elapsed - f.children;
+	profpath.setsize(f.pathlen);
+}
+
+static inline bool runstatement(char **w, int numargs, int infix, ident *id, char *&retval) {
+	if(!scriptprofile || !id || (id->type != ID_COMMAND && id->type != ID_CCOMMAND && id->type != ID_ALIAS))
+		return callstatement(w, numargs, infix, id, retval);
+	profenter(id);
+	bool tookw = callstatement(w, numargs, infix, id, retval);
+
+	profleave();
+	return tookw;
+}
+
+static int sortprofs(const scriptprofentry *x, const scriptprofentry *y) {
+	if(x->self != y->self)
+		return x->self > y->self ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+void getscriptprofile(vector < scriptprofentry > &out) {
+	enumerate(scriptprofs, scriptprofentry, p, if(p.calls) out.add(p));
+	out.sort(sortprofs);
+}
+
+void getscriptstacks(vector < char >&out) {
+	enumeratekt(scriptstacks, const char *, path, int64_t, t, {
+		if(!t) continue;
+		defformatstring(line) (" %lld\n", (long long)t);
+		out.put(path, strlen(path));
+		out.put(line, strlen(line));
+	});
+}
+
+void resetscriptprofile() {
+	if(profframes.length()) {	// calls in progress still point into the tables
+		enumerate(scriptprofs, scriptprofentry, p, p.calls = 0; p.self = p.total = 0);
+		enumerate(scriptstacks, int64_t, t, t = 0);
+		return;
+	}
+	enumeratekt(scriptstacks, const char *, path, int64_t, t, { (void)t; delete[](char *)path; });
+	scriptstacks.clear();
+	scriptprofs.clear();
+}
+
+// profilescript [n]: the n most expensive commands and aliases, by self time
+ICOMMAND(profilescript, "i", (int *n), {
+	vector < scriptprofentry > profs;
+	getscriptprofile(profs);
+	if(profs.empty()) {
+		conoutf(scriptprofile ? "no script calls profiled yet" : "script profiling is off, set scriptprofile 1");
+		return;
+	}
+	conoutf("%8s %10s %10s  %s", "calls", "self ms", "total ms", "name");
+	loopv(profs) {
+		if(i >= (*n > 0 ? *n : 20))
+			break;
+		scriptprofentry &p = profs[i];
+		conoutf("%8d %10.3f %10.3f  %s", p.calls, p.self / 1000.0, p.total / 1000.0, p.name);
+	}
+});
+
+ICOMMAND(resetprofile, "", (), resetscriptprofile());
+
+// profilestacks file: writes the folded stacks, in microseconds, for flamegraph.pl
+ICOMMAND(profilestacks, "s", (char *name), {
+	vector < char >buf;
+	getscriptstacks(buf);
+	stream *f = openfile(path(name, true), "w");
+	if(!f) {
+		conoutf(CON_ERROR, "could not write %s", name);
+		return;
+	}
+	f->write(buf.getbuf(), buf.length());
+	delete f;
+	conoutf("wrote %d bytes of script stacks to %s", buf.length(), name);
+});
+
+static char *interpret(const char *p)	// parses and runs as it goes, for what compilescript() leaves alone
+{
+	char *w[MAXWORDS];
+
+	char *retval = NULL;
+	for(bool cont = true; cont && SCRIPTSTEP;)	// for each ; seperated statement
 	{
 		int numargs = MAXWORDS, infix = 0;
 
@@ -583,217 +994,405 @@ char *executeret(const char *p)	// all evaluation happens here, recursively
 
 		DELETEA(retval);
 
-		if(infix) {
-			switch (infix) {
-			  case '=':
-				  aliasa(c, numargs > 2 ? w[2] : newstring(""));
-				  w[2] = NULL;
-				  break;
+		ident *id = infix ? NULL : idents->access(c);
+
+		if(!runstatement(w, numargs, infix, id, retval))
+			loopj(numargs) if(w[j])
+				delete[]w[j];
+	}
+	return retval;
+}
+
+// compiled scripts: a text is split once into statements of ready words, () expressions
+// compiled along with it, and each statement's command ident looked up on first use.
+// compiled texts are cached by content. texts with @ macros, which expand to whatever
+// the alias holds when the [] is reached, or with unbalanced brackets go to interpret().
+enum { CW_LITERAL, CW_LOOKUP, CW_EXP };
+
+struct cscript;
+
+struct cword {
+	int type;
+	char *s;       // literal text, or $name
+	ident *id;     // CW_LOOKUP, once found
+	cscript *exp;  // CW_EXP
+};
+
+struct cstatement {
+	int infix;
+	bool literalcmd; // first word is fixed, so id can be kept
+	ident *id;
+	vector<cword> words;
+};
+
+struct cscript {
+	int refs;
+	char *src;       // cache key, NULL for nested expressions
+	bool interpret;  // couldn't be compiled
+	vector<cstatement *> statements;
+
+	cscript() : refs(1), src(NULL), interpret(false) {}
+	~cscript();
+};
+
+static void releasescript(cscript *s) {
+	if(!--s->refs) delete s;
+}
+
+cscript::~cscript() {
+	loopv(statements) {
+		loopvj(statements[i]->words) {
+			cword &w = statements[i]->words[j];
+			DELETEA(w.s);
+			if(w.exp) releasescript(w.exp);
+		}
+		delete statements[i];
+	}
+	DELETEA(src);
+}
+
+// the same scan as parseexp(), keeping the text instead of expanding it
+static bool scanexp(const char *&p, int right, vector<char> &buf) {
+	int left = *p++;
+
+	for(int brak = 1; brak;) {
+		int c = *p++;
+
+		switch (c) {
+		  case '\r':
+			  continue;
+		  case '\"':
+			  {
+				  buf.add(c);
+				  const char *end = parsestring(p);
+
+				  buf.put(p, end - p);
+				  p = end;
+				  if(*p == '\"')
+					  buf.add(*p++);
+				  continue;
+			  }
+		  case '/':
+			  if(*p == '/') {
+				  p += strcspn(p, "\n\0");
+				  continue;
+			  }
+			  break;
+		  case '\0':
+			  return false;
+		}
+		if(c == left)
+			brak++;
+		else if(c == right)
+			brak--;
+		buf.add(c);
+	}
+	buf.pop();
+	return true;
+}
+
+static cscript *compilescript(const char *p);
+
+// the same as parseword(). returns false at the end of the statement, sets error on bad input
+static bool compileword(const char *&p, int arg, int &infix, cword &w, bool &error) {
+	w.s = NULL;
+	w.id = NULL;
+	w.exp = NULL;
+	for(;;) {
+		p += strspn(p, " \t\r");
+		if(p[0] != '/' || p[1] != '/')
+			break;
+		p += strcspn(p, "\n\0");
+	}
+	if(*p == '\"') {
+		p++;
+		const char *end = parsestring(p);
+
+		w.type = CW_LITERAL;
+		w.s = newstring(end - p);
+		w.s[escapestring(w.s, p, end)] = '\0';
+		p = end;
+		if(*p == '\"')
+			p++;
+		return true;
+	}
+	if(*p == '(' || *p == '[') {
+		vector<char> buf;
+
+		if(!scanexp(p, *p == '(' ? ')' : ']', buf)) {
+			error = true;
+			return false;
+		}
+		buf.add(0);
+		if(p[-1] == ')') {
+			w.type = CW_EXP;
+			w.exp = compilescript(buf.getbuf());
+			if(!w.exp) {
+				error = true;
+				return false;
 			}
 		} else {
-			ident *id = idents->access(c);
-
-			if(!id) {
-				if(!isinteger(c)) {
-					defformatstring(str) ("echo Unknown command %s", c);
-					execute(str);
-				}
-				setretval(newstring(c));
-			} else
-				switch (id->type) {
-				  case ID_CCOMMAND:
-				  case ID_COMMAND:	// game defined commands
-					  {
-						  void *v[MAXWORDS];
-
-						  union {
-							  int i;
-							  float f;
-						  } nstor[MAXWORDS];
-
-						  int n = 0, wn = 0;
-
-						  char *cargs = NULL;
-
-						  if(id->type == ID_CCOMMAND)
-							  v[n++] = id->self;
-						  for(const char *a = id->narg; *a; a++, n++)
-							  switch (*a) {
-								case 's':
-									v[n] = w[++wn];
-									break;
-								case 'i':
-									nstor[n].i = parseint(w[++wn]);
-									v[n] = &nstor[n].i;
-									break;
-								case 'f':
-									nstor[n].f = atof(w[++wn]);
-									v[n] = &nstor[n].f;
-									break;
-								case 'V':
-									v[n++] = w + 1;
-									nstor[n].i = numargs - 1;
-									v[n] = &nstor[n].i;
-									break;
-								case 'C':
-									if(!cargs)
-										cargs = conc(w + 1, numargs - 1, true);
-									v[n] = cargs;
-									break;	// all args
-								case 'R':
-									if(!cargs)
-										cargs = conc(w + 1 + n, numargs - 1 - n, true);
-									v[n] = cargs;
-									break;	// rest of args
-								default:
-									fatal("builtin declared with illegal type");
-							  }
-						  switch (n) {
-							case 0:
-								((void (__cdecl *) ()) id->fun) ();
-								break;
-							case 1:
-								((void (__cdecl *) (void *)) id->fun) (v[0]);
-								break;
-							case 2:
-								((void (__cdecl *) (void *, void *)) id->fun) (v[0], v[1]);
-								break;
-							case 3:
-								((void (__cdecl *) (void *, void *, void *)) id->fun) (v[0], v[1], v[2]);
-								break;
-							case 4:
-								((void (__cdecl *) (void *, void *, void *, void *)) id->fun) (v[0], v[1], v[2], v[3]);
-								break;
-							case 5:
-								((void (__cdecl *) (void *, void *, void *, void *, void *)) id->fun) (v[0], v[1], v[2],
-																									   v[3], v[4]);
-								break;
-							case 6:
-								((void (__cdecl *) (void *, void *, void *, void *, void *, void *)) id->fun) (v[0],
-																											   v[1],
-																											   v[2],
-																											   v[3],
-																											   v[4],
-																											   v[5]);
-								break;
-							case 7:
-								((void (__cdecl *) (void *, void *, void *, void *, void *, void *, void *)) id->
-								 fun) (v[0], v[1], v[2], v[3], v[4], v[5], v[6]);
-								break;
-							case 8:
-								((void (__cdecl *) (void *, void *, void *, void *, void *, void *, void *, void *))
-								 id->fun) (v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
-								break;
-							default:
-								fatal("builtin declared with too many args (use V?)");
-						  }
-						  if(cargs)
-							  delete[]cargs;
-						  setretval(commandret);
-						  commandret = NULL;
-						  break;
-					  }
+			w.type = CW_LITERAL;
+			w.s = newstring(buf.getbuf());
+		}
+		return true;
+	}
+	const char *word = p;
 
-				  case ID_VAR:	// game defined variables 
-					  if(numargs <= 1) {
-						  if(id->flags & IDF_HEX && id->maxval == 0xFFFFFF)
-							  conoutf("%s = 0x%.6X (%d, %d, %d)", c, *id->storage.i, (*id->storage.i >> 16) & 0xFF,
-									  (*id->storage.i >> 8) & 0xFF, *id->storage.i & 0xFF);
-						  else
-							  conoutf(id->flags & IDF_HEX ? "%s = 0x%X" : "%s = %d", c, *id->storage.i);	// var with no value just prints its current value
-					  } else if(id->flags & IDF_READONLY)
-						  conoutf(CON_ERROR, "variable %s is read-only", id->name);
-					  else {
-						  OVERRIDEVAR(break, id->overrideval.i = *id->storage.i,,)
-						  int i1 = parseint(w[1]);
-
-						  if(id->flags & IDF_HEX && numargs > 2) {
-							  i1 <<= 16;
-							  i1 |= parseint(w[2]) << 8;
-							  i1 |= parseint(w[3]);
-						  }
-						  if(i1 < id->minval || i1 > id->maxval) {
-							  i1 = i1 < id->minval ? id->minval : id->maxval;	// clamp to valid range
-							  conoutf(CON_ERROR,
-									  id->flags & IDF_HEX ?
-									  (id->minval <=
-									   255 ? "valid range for %s is %d..0x%X" : "valid range for %s is 0x%X..0x%X") :
-									  "valid range for %s is %d..%d", id->name, id->minval, id->maxval);
-						  }
-						  *id->storage.i = i1;
-						  id->changed();	// call trigger function if available
-					  }
-					  break;
+	for(;;) {
+		p += strcspn(p, "/; \t\r\n\0");
+		if(p[0] != '/' || p[1] == '/')
+			break;
+		else if(p[1] == '\0') {
+			p++;
+			break;
+		}
+		p += 2;
+	}
+	if(p - word == 0)
+		return false;
+	if(arg == 1 && p - word == 1 && *word == '=')
+		infix = *word;
+	w.type = *word == '$' ? CW_LOOKUP : CW_LITERAL;
+	w.s = newstring(word, p - word);
+	return true;
+}
 
-				  case ID_FVAR:
-					  if(numargs <= 1)
-						  conoutf("%s = %s", c, floatstr(*id->storage.f));
-					  else if(id->flags & IDF_READONLY)
-						  conoutf(CON_ERROR, "variable %s is read-only", id->name);
-					  else {
-						  OVERRIDEVAR(break, id->overrideval.f = *id->storage.f,,);
-						  float f1 = atof(w[1]);
-
-						  if(f1 < id->minvalf || f1 > id->maxvalf) {
-							  f1 = f1 < id->minvalf ? id->minvalf : id->maxvalf;	// clamp to valid range
-							  conoutf(CON_ERROR, "valid range for %s is %s..%s", id->name, floatstr(id->minvalf),
-									  floatstr(id->maxvalf));
-						  }
-						  *id->storage.f = f1;
-						  id->changed();
-					  }
-					  break;
+static cscript *compilescript(const char *p) {
+	if(strchr(p, '@'))
+		return NULL;
+	cscript *s = new cscript;
 
-				  case ID_SVAR:
-					  if(numargs <= 1)
-						  conoutf(strchr(*id->storage.s, '"') ? "%s = [%s]" : "%s = \"%s\"", c, *id->storage.s);
-					  else if(id->flags & IDF_READONLY)
-						  conoutf(CON_ERROR, "variable %s is read-only", id->name);
-					  else {
-						  OVERRIDEVAR(break, id->overrideval.s =
-									  *id->storage.s, delete[]id->overrideval.s, delete[] * id->storage.s);
-						  *id->storage.s = newstring(w[1]);
-						  id->changed();
-					  }
+	for(bool cont = true; cont;) {
+		cstatement *st = new cstatement;
+
+		st->infix = 0;
+		st->id = NULL;
+		bool error = false;
+
+		loopi(MAXWORDS) {
+			cword w;
+
+			if(!compileword(p, i, st->infix, w, error))
+				break;
+			st->words.add(w);
+		}
+		st->literalcmd = st->words.length() && st->words[0].type == CW_LITERAL;
+		s->statements.add(st);
+		if(error) {
+			releasescript(s);
+			return NULL;
+		}
+		p += strcspn(p, ";\n\0");
+		cont = *p++ != 0;
+		if(st->words.empty()) {
+			s->statements.pop();
+			delete st;
+		}
+	}
+	return s;
+}
+
+static char *runscript(cscript *s) {
+	char *w[MAXWORDS];
+
+	char *retval = NULL;
+
+	loopv(s->statements) {
+		if(!SCRIPTSTEP)
+			break;
+		cstatement &st = *s->statements[i];
+		int numargs = st.words.length();
+
+		loopj(MAXWORDS) w[j] = (char *) "";
+		loopj(numargs) {
+			cword &cw = st.words[j];
+
+			switch (cw.type) {
+			  case CW_LITERAL:
+				  w[j] = newstring(cw.s);
+				  break;
+			  case CW_LOOKUP:
+				  if(!cw.id)
+					  cw.id = idents->access(cw.s + 1);
+				  if(!cw.id || !(w[j] = identvalue(cw.id)))
+					  w[j] = lookup(newstring(cw.s));
+				  break;
+			  case CW_EXP:
+				  {
+					  char *ret = runscript(cw.exp);
+
+					  w[j] = ret ? ret : newstring("");
 					  break;
+				  }
+			}
+		}
+		if(!*w[0]) {
+			loopj(numargs) delete[]w[j];
+			continue;			// empty statement
+		}
 
-				  case ID_ALIAS:	// alias, also used as functions and (global) variables
-					  {
-						  delete[]w[0];
-						  static vector < ident * >argids;
-
-						  for(int i = 1; i < numargs; i++) {
-							  if(i > argids.length()) {
-								  defformatstring(argname) ("arg%d", i);
-								  argids.add(newident(argname));
-							  }
-							  pushident(*argids[i - 1], w[i]);	// set any arguments as (global) arg values so functions can access them
-						  }
-						  _numargs = numargs - 1;
-						  bool wasoverriding = overrideidents;
-
-						  if(id->override != NO_OVERRIDE)
-							  overrideidents = true;
-						  char *wasexecuting = id->isexecuting;
-
-						  id->isexecuting = id->action;
-						  setretval(executeret(id->action));
-						  if(id->isexecuting != id->action && id->isexecuting != wasexecuting)
-							  delete[]id->isexecuting;
-						  id->isexecuting = wasexecuting;
-						  overrideidents = wasoverriding;
-						  for(int i = 1; i < numargs; i++)
-							  popident(*argids[i - 1]);
-						  continue;
-					  }
-				}
+		DELETEA(retval);
+
+		ident *id = NULL;
+
+		if(!st.infix) {
+			if(st.literalcmd) {
+				if(!st.id)
+					st.id = idents->access(w[0]);
+				id = st.id;
+			} else
+				id = idents->access(w[0]);
 		}
-		loopj(numargs) if(w[j])
-			delete[]w[j];
+		if(!runstatement(w, numargs, st.infix, id, retval))
+			loopj(numargs) if(w[j])
+				delete[]w[j];
 	}
 	return retval;
 }
 
+#define SCRIPTCACHEMAX (1<<20)	// bytes of source
+#define SCRIPTCACHETEXT (1<<14)	// longer texts (whole cfg files) are compiled for one run
+
+static hashtable < const char *, cscript * >scriptcache;
+static int scriptcachesize = 0;
+
+static void clearscriptcache() {
+	enumerate(scriptcache, cscript *, s, releasescript(s));
+	scriptcache.clear();
+	scriptcachesize = 0;
+}
+
+// called when an alias drops its text, so redefined aliases don't pile up
+static void forgetscript(const char *p) {
+	cscript **s = scriptcache.access(p);
+
+	if(!s)
+		return;
+	cscript *old = *s;
+
+	scriptcachesize -= strlen(old->src) + 1;
+	scriptcache.remove(old->src);
+	releasescript(old);
+}
+
+static cscript *getscript(const char *p) {
+	cscript **found = scriptcache.access(p);
+
+	if(found) {
+		(*found)->refs++;
+		return *found;
+	}
+	cscript *s = compilescript(p);
+
+	if(!s) {
+		s = new cscript;
+		s->interpret = true;
+	}
+	int len = strlen(p) + 1;
+
+	if(len > SCRIPTCACHETEXT)
+		return s;
+	if(scriptcachesize + len > SCRIPTCACHEMAX)
+		clearscriptcache();
+	s->src = newstring(p);
+	scriptcache[s->src] = s;
+	scriptcachesize += len;
+	s->refs++;
+	return s;
+}
+
+char *executeret(const char *p)	// all evaluation happens here, recursively
+{
+	if(scriptabort)
+		return NULL;
+	if(scriptnest >= scriptdepth) {
+		defformatstring(why) ("script nested more than %d deep", scriptdepth);
+		stopscript(why);
+		if(!scriptguard)
+			conoutf(CON_ERROR, "%s", scriptwhy);
+		return NULL;
+	}
+	scriptnest++;
+	cscript *s = getscript(p);
+
+	char *ret = s->interpret ? interpret(p) : runscript(s);
+
+	releasescript(s);
+	if(scriptabort)
+		DELETEA(ret);
+	if(!--scriptnest && !scriptguard)
+		scriptabort = false;
+	return ret;
+}
+
+struct scriptuse {
+	string source;
+	int64_t start;				// of the current minute
+	int millis;
+};
+
+static vector < scriptuse > scriptuses;
+static int64_t scripttick = -1;
+static int scripttickmillis = 0;
+
+static scriptuse &getscriptuse(const char *source, int64_t now) {
+	loopvrev(scriptuses) if(now - scriptuses[i].start >= 60000)
+		scriptuses.remove(i);
+	loopv(scriptuses) if(!strcmp(scriptuses[i].source, source))
+		return scriptuses[i];
+	scriptuse &u = scriptuses.add();
+
+	copystring(u.source, source);
+	u.start = now;
+	u.millis = 0;
+	return u;
+}
+
+const char *executeguarded(const char *p, const char *source) {
+	if(scriptguard) {			// already inside a guarded run, which pays for this
+		execute(p);
+		return scriptabort ? scriptwhy : NULL;
+	}
+	int64_t now = get_ticks();
+
+	if(scripttick != totalmillis) {
+		scripttick = totalmillis;
+		scripttickmillis = 0;
+	}
+	int64_t budget = scriptmillis ? scriptmillis - scripttickmillis : INT_MAX;
+
+	if(budget <= 0)
+		return "the server is busy running scripts, try again";
+	scriptuse *u = NULL;
+
+	if(scriptquota) {
+		u = &getscriptuse(source, now);
+		int left = scriptquota - u->millis;
+
+		if(left <= 0) {
+			formatstring(scriptwhy) ("script quota used up, try again in %d seconds", int (60 - (now - u->start) / 1000));
+			return scriptwhy;
+		}
+		budget = min(budget, int64_t(left));
+	}
+	scriptguard++;
+	scriptstepsleft = scriptsteps;
+	scriptclock = 0;
+	scriptdeadline = now + budget;
+	execute(p);
+	scriptguard--;
+	int used = int (get_ticks() - now);
+
+	scripttickmillis += used;
+	if(u)
+		u->millis += used;	// nested runs don't add sources, so u is still valid
+	const char *why = scriptabort ? scriptwhy : NULL;
+
+	scriptabort = false;
+	return why;
+}
+
 int execute(const char *p) {
 	char *ret = executeret(p);
 
@@ -852,7 +1451,8 @@ ICOMMAND(if, "sss", (char *cond, char *t, char *f), commandret =
 ICOMMAND(?, "sss", (char *cond, char *t, char *f), result(cond[0] && (!isinteger(cond) || parseint(cond)) ? t : f));
 ICOMMAND(loop, "sis", (char *var, int *n, char *body), {
 		 if(*n <= 0) return; ident * id = newident(var); if(id->type != ID_ALIAS) return; loopi(*n) {
-		 if(i) sprintf(id->action, "%d", i);
+		 if(i) {
+		 if(scriptabort) break; sprintf(id->action, "%d", i);}
 		 else
 		 pushident(*id, newstring("0", 16)); execute(body);}
 		 popident(*id);}
@@ -995,6 +1595,8 @@ void looplist(const char *var, const char *list, const char *body, bool search)
 			intret(n - 1);
 			break;
 		}
+		if(scriptabort)
+			break;
 	}
 	if(n)
 		popident(*id);
@@ -1010,7 +1612,10 @@ ICOMMAND(loopfiles, "ssss", (char *var, char *dir, char *ext, char *body), {
 		 redundant = true; break;}
 		 if(redundant) {
 		 delete[]file; continue;}
-		 if(i) aliasa(id->name, file);
+		 if(i) {
+		 if(scriptabort) {
+		 delete[]file; continue;}
+		 aliasa(id->name, file);}
 		 else
 		 pushident(*id, file); execute(body);}
 		 if(files.length())popident(*id);}
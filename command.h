@@ -201,6 +201,16 @@ extern ident *getident(const char *name);
 extern bool addcommand(const char *name, void (*fun)(), const char *narg);
 extern int execute(const char *p);
 extern char *executeret(const char *p);
+extern const char *executeguarded(const char *p, const char *source);
+
+struct scriptprofentry {
+	const char *name;
+	int calls, active;
+	int64_t self, total; // microseconds
+};
+extern void getscriptprofile(vector<scriptprofentry> &out); // most self time first
+extern void getscriptstacks(vector<char> &out); // folded, one "a;b;c microseconds" line per chain
+extern void resetscriptprofile();
 extern bool execfile(const char *cfgfile, bool msg = true);
 extern void alias(const char *name, const char *action);
 extern const char *getalias(const char *name);
@@ -1,2 +1 @@
 LDFLAGS+=-lrt
-LDFLAGS+=-lGeoIP
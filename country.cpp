@@ -0,0 +1,222 @@
+#include "cube.h"
+#include "country.h"
+#include <sys/stat.h>
+
+// file: header, uint starts[n], uint ends[n], ushort index[n], countryrec[numcountries]
+#define COUNTRY_MAGIC "FROGGEO1"
+#define COUNTRY_VERSION 1
+
+struct countryheader {
+	char magic[8];
+	int version, numranges, numcountries;
+};
+
+struct countryrec {
+	char code[4];
+	char name[60];
+};
+
+struct countrytable {
+	uchar *data;
+	int size, numranges, numcountries;
+	const uint *starts, *ends;
+	const ushort *index;
+	const countryrec *countries;
+};
+
+static countrytable table = { NULL, 0, 0, 0, NULL, NULL, NULL, NULL };
+
+static const countryrec *findcountry(uint ip) {
+	int n = table.numranges;
+	if(!n || ip < table.starts[0]) return NULL;
+	// branchless lower bound: the last start <= ip
+	const uint *base = table.starts;
+	while(n > 1) {
+		int half = n / 2;
+		base = base[half] <= ip ? base + half : base;
+		n -= half;
+	}
+	int i = base - table.starts;
+	return ip <= table.ends[i] ? &table.countries[table.index[i]] : NULL;
+}
+
+const char *countryname(uint ip) {
+	const countryrec *c = findcountry(ip);
+	return c ? c->name : NULL;
+}
+
+bool countriesloaded() {
+	return table.data != NULL;
+}
+
+const char *countrycode(uint ip) {
+	const countryrec *c = findcountry(ip);
+	return c ? c->code : NULL;
+}
+
+static bool parseaddr(const char *s, uint &ip) {
+	int a, b, c, d;
+	if(sscanf(s, "%d.%d.%d.%d", &a, &b, &c, &d) == 4) {
+		ip = (uint(a) << 24) | (uint(b) << 16) | (uint(c) << 8) | uint(d);
+		return true;
+	}
+	char *end;
+	ip = strtoul(s, &end, 10);
+	return end > s;
+}
+
+// splits a csv line in place, dropping the quotes
+static int splitcsv(char *line, char **fields, int maxfields) {
+	int n = 0;
+	char *p = line;
+	while(n < maxfields) {
+		while(*p == ' ' || *p == '\t') p++;
+		if(*p == '"') {
+			fields[n++] = ++p;
+			while(*p && *p != '"') p++;
+			if(*p) *p++ = 0;
+			while(*p && *p != ',') p++;
+		} else {
+			fields[n++] = p;
+			while(*p && *p != ',') p++;
+		}
+		if(*p != ',') { *p = 0; break; }
+		*p++ = 0;
+	}
+	return n;
+}
+
+struct countryrange {
+	uint start, end;
+	int country;
+};
+
+static int rangecmp(const countryrange *a, const countryrange *b) {
+	return a->start < b->start ? -1 : (a->start > b->start ? 1 : 0);
+}
+
+static bool compilecsv(const char *csv, const char *db) {
+	int len = 0;
+	char *buf = loadfile(csv, &len);
+	if(!buf) { conoutf("could not read %s", csv); return false; }
+	vector<countryrange> ranges;
+	vector<countryrec> countries;
+	hashtable<int, int> codes; // up to 3 chars of the code
+	int bad = 0;
+	for(char *line = buf, *next; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if(next) *next++ = 0;
+		char *nl = strchr(line, '\r');
+		if(nl) *nl = 0;
+		if(!*line || *line == '#') continue;
+		char *f[6];
+		int n = splitcsv(line, f, 6);
+		uint start, end;
+		const char *code, *name;
+		if(n >= 6) { code = f[4]; name = f[5]; if(!parseaddr(f[2], start) || !parseaddr(f[3], end)) { bad++; continue; } }
+		else if(n >= 3) { code = f[2]; name = n > 3 ? f[3] : f[2]; if(!parseaddr(f[0], start) || !parseaddr(f[1], end)) { bad++; continue; } }
+		else { bad++; continue; }
+		if(end < start || !code[0]) { bad++; continue; }
+		int key = 0;
+		for(int k = 0; k < 3 && code[k]; k++) key |= uchar(code[k]) << (8*k);
+		int *idx = codes.access(key);
+		if(!idx) {
+			if(countries.length() >= 0xFFFF) { bad++; continue; }
+			countryrec &c = countries.add();
+			memset(&c, 0, sizeof(c));
+			copystring(c.code, code, sizeof(c.code));
+			copystring(c.name, name, sizeof(c.name));
+			idx = &codes.access(key, countries.length() - 1);
+		}
+		countryrange &r = ranges.add();
+		r.start = start;
+		r.end = end;
+		r.country = *idx;
+	}
+	ranges.sort(rangecmp);
+	// drop overlaps, merge neighbours of the same country
+	vector<countryrange> merged;
+	loopv(ranges) {
+		countryrange &r = ranges[i];
+		if(merged.length()) {
+			countryrange &last = merged.last();
+			if(r.start <= last.end) { if(r.end > last.end) bad++; continue; }
+			if(r.country == last.country && r.start == last.end + 1) { last.end = r.end; continue; }
+		}
+		merged.add(r);
+	}
+	if(bad) conoutf("%s: skipped %d bad or overlapping ranges", csv, bad);
+
+	vector<uchar> out;
+	countryheader hdr;
+	memcpy(hdr.magic, COUNTRY_MAGIC, 8);
+	hdr.version = COUNTRY_VERSION;
+	hdr.numranges = merged.length();
+	hdr.numcountries = countries.length();
+	out.put((const uchar *)&hdr, sizeof(hdr));
+	loopv(merged) out.put((const uchar *)&merged[i].start, sizeof(uint));
+	loopv(merged) out.put((const uchar *)&merged[i].end, sizeof(uint));
+	loopv(merged) { ushort idx = merged[i].country; out.put((const uchar *)&idx, sizeof(idx)); }
+	out.put((const uchar *)countries.getbuf(), countries.length() * sizeof(countryrec));
+	delete[] buf;
+
+	// the old table may be mapped here or by other servers, so it is replaced, never rewritten
+	defformatstring(tmp)("%s.tmp", db);
+	stream *f = openfile(tmp, "wb");
+	if(!f) { conoutf("could not write %s", tmp); return false; }
+	bool ok = f->write(out.getbuf(), out.length()) == out.length();
+	delete f;
+	if(!ok) conoutf("could not write %s", tmp);
+	else if(!(ok = replacefile(tmp, db))) conoutf("could not replace %s", db);
+	else conoutf("compiled %s: %d ranges, %d countries", csv, merged.length(), countries.length());
+	return ok;
+}
+
+static bool maptable(const char *db, countrytable &t) {
+	t.data = mapfile(db, &t.size);
+	if(!t.data) return false;
+	const countryheader *hdr = (const countryheader *)t.data;
+	bool ok = t.size >= (int)sizeof(countryheader) && !memcmp(hdr->magic, COUNTRY_MAGIC, 8) && hdr->version == COUNTRY_VERSION
+		&& hdr->numranges >= 0 && hdr->numcountries >= 0
+		&& t.size == (int)(sizeof(countryheader) + hdr->numranges * (2*sizeof(uint) + sizeof(ushort)) + hdr->numcountries * sizeof(countryrec));
+	if(ok) {
+		t.numranges = hdr->numranges;
+		t.numcountries = hdr->numcountries;
+		t.starts = (const uint *)(t.data + sizeof(countryheader));
+		t.ends = t.starts + t.numranges;
+		t.index = (const ushort *)(t.ends + t.numranges);
+		t.countries = (const countryrec *)(t.index + t.numranges);
+		loopi(t.numranges) if(t.index[i] >= t.numcountries) { ok = false; break; }
+	}
+	if(!ok) { conoutf("%s is not a country table", db); unmapfile(t.data, t.size); t.data = NULL; }
+	return ok;
+}
+
+static time_t modtime(const char *file) {
+	const char *found = findfile(file, "rb");
+	struct stat st;
+	return found && !stat(found, &st) ? st.st_mtime : 0;
+}
+
+bool loadcountries(const char *file) {
+	countrytable t = { NULL, 0, 0, 0, NULL, NULL, NULL, NULL };
+	if(file[0]) {
+		defformatstring(db)("%s.db", file);
+		int len = strlen(file);
+		bool prebuilt = len > 3 && !strcmp(file + len - 3, ".db");
+		if(prebuilt) copystring(db, file);
+		else if(modtime(db) < modtime(file) && !compilecsv(file, db)) return false;
+		if(!maptable(db, t)) return false;
+	}
+	// clients keep a copy of their country, so the old table can go at once
+	unmapfile(table.data, table.size);
+	table = t;
+	return true;
+}
+
+SVARF(countryfile, "", loadcountries(countryfile));
+ICOMMAND(ipcountry, "s", (char *ip), {
+	uint addr;
+	const char *name = parseaddr(ip, addr) ? countryname(addr) : NULL;
+	result(name ? name : "");
+});
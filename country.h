@@ -0,0 +1,16 @@
+#ifndef COUNTRY_H_
+#define COUNTRY_H_
+
+// ip to country, from a range file in the GeoIP country csv layout:
+//   "1.0.0.0","1.0.0.255","16777216","16777471","AU","Australia"
+// (or just start,end,code[,name] with dotted or numeric addresses). the csv is compiled
+// once into a sorted table next to it (file.db) which is then mapped read-only, so
+// servers on one host share its pages. set countryfile to load or reload it.
+
+// ip in host order. NULL when the address is in no range or no table is loaded
+const char *countryname(uint ip);
+const char *countrycode(uint ip);
+bool loadcountries(const char *file);
+bool countriesloaded();
+
+#endif /* COUNTRY_H_ */
@@ -103,8 +103,10 @@ namespace tiger
 
     void hash(const uchar *str, int length, hashval &val)
     {
-        static bool init = false;
-        if(!init) { gensboxes(); init = true; }
+        // a local static initializer runs exactly once even when several threads hash at
+        // once (auth challenges are made on the workers); gensboxes() must never run twice
+        static const bool init = (gensboxes(), true);
+        (void)init;
 
         uchar temp[64];
 
@@ -434,6 +436,9 @@ struct gfield : gfint
 
     template<int X_DIGITS, int Y_DIGITS> gfield &mul(const bigint<X_DIGITS> &x, const bigint<Y_DIGITS> &y)
     {
+#if GF_BITS==192
+        if(x.len <= 192/BI_DIGIT_BITS && y.len <= 192/BI_DIGIT_BITS) return mul192(x, y);
+#endif
         bigint<X_DIGITS+Y_DIGITS> result;
         result.mul(x, y);
         reduce(result);
@@ -441,6 +446,83 @@ struct gfield : gfint
     }
     template<int Y_DIGITS> gfield &mul(const bigint<Y_DIGITS> &y) { return mul(*this, y); }
 
+#if GF_BITS==192
+    /* Field elements as six 32 bit words: the product needs a quarter of the
+     * multiplies of the 16 bit digits, and P-192 reduces with word additions,
+     * since 2^192 = 2^64 + 1 (mod P).
+     */
+    template<int X_DIGITS> static void towords(const bigint<X_DIGITS> &x, uint *w)
+    {
+        memset(w, 0, 6*sizeof(uint));
+        loopi(x.len) w[i/2] |= uint(x.digits[i]) << (BI_DIGIT_BITS*(i&1));
+    }
+
+    template<int X_DIGITS, int Y_DIGITS> gfield &mul192(const bigint<X_DIGITS> &x, const bigint<Y_DIGITS> &y)
+    {
+        uint a[6], b[6], c[12];
+        towords(x, a);
+        towords(y, b);
+        memset(c, 0, sizeof(c));
+        loopi(6)
+        {
+            unsigned long long carry = 0;
+            loopj(6)
+            {
+                carry += (unsigned long long)a[i] * b[j] + c[i+j];
+                c[i+j] = uint(carry);
+                carry >>= 32;
+            }
+            c[i+6] = uint(carry);
+        }
+
+        // T + (0,A3,A3) + (A4,A4,0) + (A5,A5,A5), with Ak the 64 bit halves c[2k], c[2k+1]
+        unsigned long long sum[6] =
+        {
+            (unsigned long long)c[0] + c[6] + c[10],
+            (unsigned long long)c[1] + c[7] + c[11],
+            (unsigned long long)c[2] + c[6] + c[8] + c[10],
+            (unsigned long long)c[3] + c[7] + c[9] + c[11],
+            (unsigned long long)c[4] + c[8] + c[10],
+            (unsigned long long)c[5] + c[9] + c[11]
+        };
+        uint w[6];
+        for(;;)
+        {
+            unsigned long long carry = 0;
+            loopi(6)
+            {
+                carry += sum[i];
+                w[i] = uint(carry);
+                carry >>= 32;
+            }
+            uint over = uint(carry);
+            if(!over) break;
+            // fold the overflow back in once more: 2^192 = 2^64 + 1
+            loopi(6) sum[i] = w[i];
+            sum[0] += over;
+            sum[2] += over;
+        }
+        static const uint p[6] = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+        for(;;)
+        {
+            int i = 5;
+            while(i > 0 && w[i] == p[i]) i--;
+            if(w[i] < p[i]) break;
+            unsigned long long borrow = 0;
+            loopj(6)
+            {
+                unsigned long long d = (unsigned long long)w[j] - p[j] - borrow;
+                w[j] = uint(d);
+                borrow = (d >> 32) & 1;
+            }
+        }
+        loopi(192/BI_DIGIT_BITS) digits[i] = digit(w[i/2] >> (BI_DIGIT_BITS*(i&1)));
+        len = 192/BI_DIGIT_BITS;
+        shrink();
+        return *this;
+    }
+#endif
+
     template<int RESULT_DIGITS> void reduce(const bigint<RESULT_DIGITS> &result)
     {
 #if GF_BITS==192
@@ -647,6 +729,15 @@ struct ecjacobian
         y.sub(f, x).sub(x).mul(b).sub(e.mul(a).mul(d)).div2();
     }
 
+    #define EC_WINDOW 4
+    #define EC_WINDOWS ((GF_DIGITS+1)*BI_DIGIT_BITS/EC_WINDOW)
+
+    template<int Q_DIGITS> static int window(const bigint<Q_DIGITS> &q, int i)
+    {
+        int bit = i*EC_WINDOW, d = bit/BI_DIGIT_BITS;
+        return d < q.len ? (q.digits[d] >> (bit%BI_DIGIT_BITS)) & ((1<<EC_WINDOW)-1) : 0;
+    }
+
     template<int Q_DIGITS> void mul(const ecjacobian &p, const bigint<Q_DIGITS> q)
     {
         *this = origin;
@@ -658,6 +749,45 @@ struct ecjacobian
     }
     template<int Q_DIGITS> void mul(const bigint<Q_DIGITS> q) { ecjacobian tmp(*this); mul(tmp, q); }
 
+    /* Multiples of the base point: basetable[i][j] = j * 2^(4i) * base, normalized so that
+     * add() takes its cheaper z=1 path. A base multiplication is then one add per window
+     * and no doublings. Built on first use; the static initializer makes that safe from
+     * the worker threads.
+     */
+    static const ecjacobian *buildbasetable()
+    {
+        ecjacobian *t = new ecjacobian[EC_WINDOWS<<EC_WINDOW];
+        ecjacobian p(base);
+        loopi(EC_WINDOWS)
+        {
+            ecjacobian *row = &t[i<<EC_WINDOW];
+            row[0] = origin;
+            row[1] = p;
+            for(int j = 2; j < (1<<EC_WINDOW); j++) { row[j] = row[j-1]; row[j].add(p); row[j].normalize(); }
+            loopj(EC_WINDOW) p.mul2();
+            p.normalize();
+        }
+        return t;
+    }
+
+    static const ecjacobian *basetable()
+    {
+        static const ecjacobian *table = buildbasetable();
+        return table;
+    }
+
+    template<int Q_DIGITS> void mulbase(const bigint<Q_DIGITS> q)
+    {
+        if(q.numbits() > EC_WINDOWS*EC_WINDOW) { mul(base, q); return; }
+        const ecjacobian *table = basetable();
+        *this = origin;
+        for(int i = 0, n = (q.numbits()+EC_WINDOW-1)/EC_WINDOW; i < n; i++)
+        {
+            int w = window(q, i);
+            if(w) add(table[(i<<EC_WINDOW) + w]);
+        }
+    }
+
     void normalize()
     {
         if(z.iszero() || z.isone()) return;
@@ -746,8 +876,8 @@ void genprivkey(const char *seed, vector<char> &privstr, vector<char> &pubstr)
     privkey.printdigits(privstr);
     privstr.add('\0');
 
-    ecjacobian c(ecjacobian::base);
-    c.mul(privkey);
+    ecjacobian c;
+    c.mulbase(privkey);
     c.normalize();
     c.print(pubstr);
     pubstr.add('\0');
@@ -795,9 +925,9 @@ void freepubkey(void *pubkey)
 void *genchallenge(void *pubkey, const void *seed, int seedlen, vector<char> &challengestr)
 {
     tiger::hashval hash;
-    tiger::hash((const uchar *)seed, sizeof(seed), hash);
+    tiger::hash((const uchar *)seed, seedlen, hash);
     gfint challenge;
-    memcpy(challenge.digits, hash.bytes, sizeof(challenge.digits));
+    memcpy(challenge.digits, hash.bytes, sizeof(hash.bytes));
     challenge.len = 8*sizeof(hash.bytes)/BI_DIGIT_BITS;
     challenge.shrink();
 
@@ -805,8 +935,8 @@ void *genchallenge(void *pubkey, const void *seed, int seedlen, vector<char> &ch
     answer.mul(challenge);
     answer.normalize();
 
-    ecjacobian secret(ecjacobian::base);
-    secret.mul(challenge);
+    ecjacobian secret;
+    secret.mulbase(challenge);
     secret.normalize();
 
     secret.print(challengestr);
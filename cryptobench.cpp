@@ -0,0 +1,61 @@
+// throughput of the auth crypto: make bench, or ./cryptobench [rounds] [-v]
+// -v prints every key, challenge and answer, to diff the output of two builds
+#include "cube.h"
+#include "crypto.h"
+#include <sys/time.h>
+
+static double now() {
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv) {
+	int rounds = 200;
+	bool verbose = false;
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-v")) verbose = true;
+		else rounds = max(atoi(argv[i]), 1);
+	}
+
+	vector<char *> privkeys, pubkeys;
+	double start = now();
+	loopi(rounds) {
+		defformatstring(seed)("frogmod %d", i);
+		vector<char> priv, pub;
+		genprivkey(seed, priv, pub);
+		privkeys.add(newstring(priv.getbuf()));
+		pubkeys.add(newstring(pub.getbuf()));
+		if(verbose) printf("key %s %s\n", priv.getbuf(), pub.getbuf());
+	}
+	double keygen = now() - start;
+
+	int good = 0;
+	double gen = 0, answer = 0, check = 0;
+	loopi(rounds) {
+		void *pubkey = parsepubkey(pubkeys[i]);
+		uint seed[3] = { uint(i), uint(i*7919), 0xF706 };
+		vector<char> challenge, ans;
+		double t = now();
+		void *correct = genchallenge(pubkey, seed, sizeof(seed), challenge);
+		gen += now() - t;
+		t = now();
+		answerchallenge(privkeys[i], challenge.getbuf(), ans);
+		answer += now() - t;
+		t = now();
+		if(checkchallenge(ans.getbuf(), correct)) good++;
+		check += now() - t;
+		if(verbose) printf("challenge %s %s\n", challenge.getbuf(), ans.getbuf());
+		freechallenge(correct);
+		freepubkey(pubkey);
+	}
+
+	printf("%d rounds, %d answers correct\n", rounds, good);
+	printf("genprivkey      %8.1f/s\n", rounds / keygen);
+	printf("genchallenge    %8.1f/s\n", rounds / gen);
+	printf("answerchallenge %8.1f/s\n", rounds / answer);
+	printf("checkchallenge  %8.1f/s\n", rounds / check);
+	privkeys.deletecontentsa();
+	pubkeys.deletecontentsa();
+	return good == rounds ? EXIT_SUCCESS : EXIT_FAILURE;
+}
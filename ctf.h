@@ -194,6 +194,7 @@ struct ctfclientmode : clientmode
         {
             ivec o(vec(ci->state.o).mul(DMF));
             sendf(-1, 1, "ri6", SV_DROPFLAG, ci->clientnum, i, o.x, o.y, o.z);
+            logevent(GE_FLAG, ci, NULL, 0, i, GF_DROP);
             dropflag(i, o.tovec().div(DMF), lastmillis);
         }
     }
@@ -224,6 +225,7 @@ struct ctfclientmode : clientmode
         ci->state.flags++;
         int team = ctfteamflag(ci->team), score = addscore(team, 1);
         sendf(-1, 1, "ri6", SV_SCOREFLAG, ci->clientnum, relay, goal, team, score);
+        logevent(GE_FLAG, ci, NULL, 0, relay >= 0 ? relay : goal, GF_SCORE);
         if(score >= FLAGLIMIT) startintermission();
     }
 
@@ -238,6 +240,7 @@ struct ctfclientmode : clientmode
             loopvj(flags) if(flags[j].owner==ci->clientnum) return;
             ownflag(i, ci->clientnum);
             sendf(-1, 1, "ri3", SV_TAKEFLAG, ci->clientnum, i);
+            logevent(GE_FLAG, ci, NULL, 0, i, GF_TAKE);
         }
         else if(m_protect)
         {
@@ -247,6 +250,7 @@ struct ctfclientmode : clientmode
         {
             returnflag(i);
             sendf(-1, 1, "ri3", SV_RETURNFLAG, ci->clientnum, i);
+            logevent(GE_FLAG, ci, NULL, 0, i, GF_RETURN);
         }
         else
         {
@@ -264,6 +268,7 @@ struct ctfclientmode : clientmode
             {
                 returnflag(i, m_protect ? lastmillis : 0);
                 sendf(-1, 1, "ri4", SV_RESETFLAG, i, f.team, addscore(f.team, m_protect ? -1 : 0));
+                logevent(GE_FLAG, NULL, NULL, 0, i, GF_RESET);
             }
             if(f.invistime && lastmillis - f.invistime >= INVISFLAGTIME)
             {
@@ -13,6 +13,15 @@
 
 namespace IRC {
 
+#define MAXCOALESCE 400 // longest text low priority lines are joined up to
+#define MAXPENDING 4096 // bytes in the socket buffer before we stop feeding it
+
+static long long nowmillis() {
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec*1000LL + tv.tv_usec/1000;
+}
+
 static void irc_readcb(struct bufferevent *buf, void *arg) {
 	Server *s = (Server *)arg;
 	if(s->state < Server::Connected) return;
@@ -20,7 +29,13 @@ static void irc_readcb(struct bufferevent *buf, void *arg) {
 }
 
 static void irc_writecb(struct bufferevent *buf, void *arg) {
-	return;
+	Server *s = (Server *)arg;
+	if(s->queued()) s->flush(); // the socket drained
+}
+
+static void irc_sendcb(int fd, short type, void *arg) {
+	Server *s = (Server *)arg;
+	s->flush();
 }
 
 static void irc_eventcb(struct bufferevent *buf, short what, void *arg) {
@@ -39,6 +54,7 @@ static void irc_eventcb(struct bufferevent *buf, short what, void *arg) {
 
 		DEBUGF(bufferevent_free(s->buf));
 		s->buf = NULL;
+		s->clearqueue();
 
 		if(s->state == Server::Quitting) {
 			if(s->client->server_quit_cb) s->client->server_quit_cb(s);
@@ -80,6 +96,15 @@ void Server::init() {
 	DEBUGF(evbuf = evbuffer_new());
 	buf = NULL;
 	DEBUGF(reconnect_event = evtimer_new(client->base, irc_reconnectcb, this));
+	DEBUGF(send_event = evtimer_new(client->base, irc_sendcb, this));
+	tokens = client->burst;
+	lastrefill = nowmillis();
+	sent = coalesced = dropped = 0;
+}
+
+Server::~Server() {
+	clearqueue();
+	DEBUGF(event_free(send_event));
 }
 
 bool Server::connect(const char *h, const char *n, int p, const char *alias_) {
@@ -93,6 +118,7 @@ bool Server::connect(const char *h, const char *n, int p, const char *alias_) {
 
 void Server::quit(const char *msg, int quitsecs) {
 	if(state >= Connected && state != Quitting) {
+		clearqueue();
 		if(msg) DEBUGF(bufferevent_write_printf(buf, "QUIT :%s\r\n", msg))
 		else DEBUGF(bufferevent_write_printf(buf, "QUIT\r\n"))
 		bufferevent_flush(buf, EV_WRITE, BEV_FLUSH);
@@ -309,7 +335,10 @@ void Server::speak(const char *fmt, ...) {
 
 void Server::vspeak(const char *fmt, va_list ap) {
 	for(unsigned int i = 0; i < channels.size(); i++) {
-		channels[i]->vspeak(fmt, ap);
+		va_list aq;
+		va_copy(aq, ap);
+		channels[i]->vspeak(fmt, aq);
+		va_end(aq);
 	}
 }
 
@@ -322,7 +351,10 @@ void Server::speak(int verbosity_, const char *fmt, ...) {
 
 void Server::vspeak(int verbosity_, const char *fmt, va_list ap) {
 	for(unsigned int i = 0; i < channels.size(); i++) {
-		channels[i]->vspeak(verbosity_, fmt, ap);
+		va_list aq;
+		va_copy(aq, ap);
+		channels[i]->vspeak(verbosity_, fmt, aq);
+		va_end(aq);
 	}
 }
 
@@ -333,28 +365,97 @@ void Server::speakto(const char *who, const char *fmt, ...) {
 	va_end(ap);
 }
 
-void Server::vspeakto(const char *to, const char *fmt, va_list ap) {
+void Server::vspeakto(const char *to, const char *fmt, va_list ap, int priority) {
 	evbuffer *evb;
 	DEBUGF(evb = evbuffer_new());
 	DEBUGF(evbuffer_add_vprintf(evb, fmt, ap));
 	DEBUGF(evbuffer_add_printf(evb, "\r\n")); // force last line... evbuffer_readln...
-	bspeakto(to, evb);
+	bspeakto(to, evb, priority);
 	DEBUGF(evbuffer_free(evb));
 }
 
-void Server::bspeakto(const char *to, evbuffer *evb) {
+void Server::bspeakto(const char *to, evbuffer *evb, int priority) {
 	if(state != Active) return;
 
 	char *l;
 	while((l = evbuffer_readln_nul(evb, NULL, EVBUFFER_EOL_ANY))) { // split string into separate lines
-		if(strlen(l) < 1) continue;
-		evbuffer *msgb;
-		DEBUGF(msgb = evbuffer_new());
-		DEBUGF(evbuffer_add_printf(msgb, "PRIVMSG %s :%s\r\n", to, l));
-		DEBUGF(bufferevent_write_buffer(buf, msgb));
-		DEBUGF(evbuffer_free(msgb));
+		if(*l) enqueue(to, l, priority);
 		free(l);
 	}
+	flush();
+}
+
+void Server::enqueue(const char *to, const char *line, int priority) {
+	std::vector <Message *> &q = queue[priority];
+	Message *last = NULL;
+	for(int i = q.size() - 1; i >= 0; i--) if(!strcmp(q[i]->to, to)) { last = q[i]; break; }
+	if(last && !strcmp(last->text, line)) {
+		last->repeats++;
+		coalesced++;
+		return;
+	}
+	int ll, nl = strlen(line);
+	if(priority == PriorityLow && last && last->repeats == 1 && (ll = strlen(last->text)) + 3 + nl <= MAXCOALESCE) {
+		last->text = (char *)realloc(last->text, ll + 3 + nl + 1);
+		sprintf(last->text + ll, " | %s", line);
+		coalesced++;
+		return;
+	}
+	if(queued() >= client->queuelimit) {
+		for(int p = NumPriorities - 1; p > PriorityHigh; p--) { // replies are never dropped
+			if(p < priority || queue[p].empty()) continue;
+			delete queue[p][0];
+			queue[p].erase(queue[p].begin());
+			dropped++;
+			break;
+		}
+		if(queued() >= client->queuelimit && priority != PriorityHigh) { dropped++; return; } // nothing older could make room
+	}
+	q.push_back(new Message(to, line));
+}
+
+void Server::flush() {
+	if(state != Active || !buf) return;
+	long long now = nowmillis();
+	tokens += double(now - lastrefill) / (client->linemillis > 0 ? client->linemillis : 1);
+	if(tokens > client->burst) tokens = client->burst;
+	lastrefill = now;
+	for(int p = 0; p < NumPriorities; p++) {
+		std::vector <Message *> &q = queue[p];
+		while(!q.empty()) {
+			if(tokens < 1) {
+				timeval tv;
+				long long wait = (long long)((1 - tokens) * client->linemillis) + 1;
+				tv.tv_sec = wait / 1000;
+				tv.tv_usec = (wait % 1000) * 1000;
+				DEBUGF(evtimer_add(send_event, &tv));
+				return;
+			}
+			if(evbuffer_get_length(bufferevent_get_output(buf)) >= MAXPENDING) return; // irc_writecb calls us again
+			Message *m = q[0];
+			q.erase(q.begin());
+			if(m->repeats > 1) DEBUGF(bufferevent_write_printf(buf, "PRIVMSG %s :%s (x%d)\r\n", m->to, m->text, m->repeats))
+			else DEBUGF(bufferevent_write_printf(buf, "PRIVMSG %s :%s\r\n", m->to, m->text));
+			delete m;
+			tokens--;
+			sent++;
+		}
+	}
+}
+
+void Server::clearqueue() {
+	for(int p = 0; p < NumPriorities; p++) {
+		for(unsigned int i = 0; i < queue[p].size(); i++) delete queue[p][i];
+		queue[p].clear();
+	}
+	if(send_event) DEBUGF(event_del(send_event));
+}
+
+int Server::queued(int priority) {
+	if(priority >= 0) return queue[priority].size();
+	int n = 0;
+	for(int p = 0; p < NumPriorities; p++) n += queue[p].size();
+	return n;
 }
 
 void Server::changenick(char *old, char *nick) {
@@ -442,7 +543,7 @@ void Channel::speak(int verbosity_, const char *fmt, ...) {
 void Channel::vspeak(int verbosity_, const char *fmt, va_list ap) {
 	if(verbosity_ > verbosity) return;
 
-	vspeak(fmt, ap);
+	server->vspeakto(name, fmt, ap, verbosity_ > 0 ? Server::PriorityLow : Server::PriorityNormal); // game chatter
 }
 
 void Source::reply(const char *fmt, ...) {
@@ -458,10 +559,10 @@ void Source::vreply(const char *fmt, va_list ap) {
 		DEBUGF(evb = evbuffer_new());
 		DEBUGF(evbuffer_add_printf(evb, "%s: ", peer->nick));
 		DEBUGF(evbuffer_add_vprintf(evb, fmt, ap));
-		server->bspeakto(channel->name, evb);
+		server->bspeakto(channel->name, evb, Server::PriorityHigh);
 		DEBUGF(evbuffer_free(evb));
 	} else {
-		server->vspeakto(peer->nick, fmt, ap);
+		server->vspeakto(peer->nick, fmt, ap, Server::PriorityHigh);
 	}
 }
 
@@ -477,10 +578,10 @@ void Source::vspeak(const char *fmt, va_list ap) {
 		evbuffer *evb;
 		DEBUGF(evb = evbuffer_new());
 		DEBUGF(evbuffer_add_vprintf(evb, fmt, ap));
-		server->bspeakto(channel->name, evb);
+		server->bspeakto(channel->name, evb, Server::PriorityHigh);
 		DEBUGF(evbuffer_free(evb));
 	} else {
-		server->vspeakto(peer->nick, fmt, ap);
+		server->vspeakto(peer->nick, fmt, ap, Server::PriorityHigh);
 	}
 }
 
@@ -508,7 +609,10 @@ void Client::speak(const char *fmt, ...) {
 
 void Client::vspeak(const char *fmt, va_list ap) {
 	for(unsigned int i = 0; i < servers.size(); i++) {
-		servers[i]->vspeak(fmt, ap);
+		va_list aq;
+		va_copy(aq, ap);
+		servers[i]->vspeak(fmt, aq);
+		va_end(aq);
 	}
 }
 
@@ -521,7 +625,10 @@ void Client::speak(int verbosity_, const char *fmt, ...) {
 
 void Client::vspeak(int verbosity_, const char *fmt, va_list ap) {
 	for(unsigned int i = 0; i < servers.size(); i++) {
-		servers[i]->vspeak(verbosity_, fmt, ap);
+		va_list aq;
+		va_copy(aq, ap);
+		servers[i]->vspeak(verbosity_, fmt, aq);
+		va_end(aq);
 	}
 }
 
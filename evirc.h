@@ -54,6 +54,15 @@ struct Channel {
 	void vspeak(int verbosity, const char *fmt, va_list ap);
 };
 
+// a line waiting in a server's outbound queue
+struct Message {
+	char *to, *text;
+	int repeats; // identical lines folded into this one
+
+	Message(const char *to_, const char *text_): to(strdup(to_)), text(strdup(text_)), repeats(1) {}
+	~Message() { free(to); free(text); }
+};
+
 struct Client;
 struct Server {
 	char *host;
@@ -69,8 +78,19 @@ struct Server {
 	std::vector <Peer *> peers;
 	std::vector <Channel *> channels;
 
+	// outbound PRIVMSGs wait here and are sent under a token bucket so the network doesn't
+	// throttle us. replies go before notices and notices before game chatter; when the
+	// queue is full the oldest line of the lowest class is dropped. low lines for the same
+	// target are joined into one message while they wait
+	enum { PriorityHigh, PriorityNormal, PriorityLow, NumPriorities };
+	std::vector <Message *> queue[NumPriorities];
+	event *send_event;
+	double tokens;
+	long long lastrefill;
+	long long sent, coalesced, dropped;
+
 	Server() {}
-	~Server() {}
+	~Server();
 
 	void init();
 
@@ -107,8 +127,13 @@ struct Server {
 	void vspeak(int verbosity, const char *fmt, va_list ap);
 
 	void speakto(const char *to, const char *fmt, ...); // speaks to the specified channel or peer
-	void vspeakto(const char *to, const char *fmt, va_list ap);
-	void bspeakto(const char *to, evbuffer *evb);
+	void vspeakto(const char *to, const char *fmt, va_list ap, int priority = PriorityNormal);
+	void bspeakto(const char *to, evbuffer *evb, int priority = PriorityNormal);
+
+	void enqueue(const char *to, const char *line, int priority);
+	void flush(); // sends what the bucket allows and schedules the rest
+	void clearqueue();
+	int queued(int priority = -1);
 };
 
 struct Source {
@@ -128,8 +153,10 @@ struct Client {
 	event_base *base;
 	evdns_base *dnsbase;
 
-	Client() {}
-	Client(event_base *b, evdns_base *db) { base = b; dnsbase = db; }
+	int burst, linemillis, queuelimit; // flood control for every server
+
+	Client(): burst(5), linemillis(2000), queuelimit(100) {}
+	Client(event_base *b, evdns_base *db): burst(5), linemillis(2000), queuelimit(100) { base = b; dnsbase = db; }
 	~Client() {}
 
 	typedef void (*GenericCallback)(Server *, char*, char *);
@@ -0,0 +1,95 @@
+#include "cube.h"
+#include "gamelog.h"
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#define GAMELOG_GROW 4096 // records the file grows by
+
+static int fd = -1;
+static uchar *data = NULL;
+static int64_t capacity = 0, count = 0, basemillis = 0; // basemillis + totalmillis is unix time
+
+static size_t filesize(int64_t records) { return sizeof(gamelogheader) + records*sizeof(gamerecord); }
+
+bool gamelogging() { return data != NULL; }
+
+#ifdef WIN32
+bool opengamelog(const char *name) { if(name[0]) conoutf("the game event log is not supported on this platform"); return false; }
+void closegamelog() {}
+void addgamerecord(gamerecord &r) {}
+#else
+static bool mapgamelog(int64_t records) {
+	if(data) munmap(data, filesize(capacity));
+	data = NULL;
+	if(ftruncate(fd, filesize(records)) < 0) return false;
+	void *p = mmap(NULL, filesize(records), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) return false;
+	data = (uchar *)p;
+	capacity = records;
+	return true;
+}
+
+void closegamelog() {
+	if(fd < 0) return;
+	if(data) {
+		munmap(data, filesize(capacity));
+		data = NULL;
+		if(ftruncate(fd, filesize(count)) < 0) conoutf("could not truncate the game event log: %s", strerror(errno));
+	}
+	close(fd);
+	fd = -1;
+	capacity = count = 0;
+}
+
+bool opengamelog(const char *name) {
+	closegamelog();
+	if(!name[0]) return false;
+	const char *path = findfile(name, "wb");
+	if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) { conoutf("could not open game event log %s: %s", path, strerror(errno)); return false; }
+	struct stat st;
+	if(fstat(fd, &st) < 0) st.st_size = 0;
+	gamelogheader h;
+	bool valid = st.st_size > 0; // an empty file becomes a new log
+	if(valid) {
+		valid = size_t(st.st_size) >= sizeof(h) && pread(fd, &h, sizeof(h), 0) == sizeof(h)
+			&& !memcmp(h.magic, GAMELOG_MAGIC, 8) && h.version == GAMELOG_VERSION && h.recordsize == sizeof(gamerecord);
+		// never overwrite something else, or a log of another version
+		if(!valid) { conoutf("%s is not a game event log of this version, not using it", path); close(fd); fd = -1; return false; }
+		// records past the count were torn by a crash, or are the unused tail of the last chunk
+		count = clamp(h.count, int64_t(0), int64_t((st.st_size - sizeof(h))/sizeof(gamerecord)));
+	}
+	if(!mapgamelog(count + GAMELOG_GROW)) { conoutf("could not map game event log %s: %s", path, strerror(errno)); closegamelog(); return false; }
+	if(!valid) {
+		gamelogheader &nh = *(gamelogheader *)data;
+		memset(&nh, 0, sizeof(nh));
+		memcpy(nh.magic, GAMELOG_MAGIC, 8);
+		nh.version = GAMELOG_VERSION;
+		nh.recordsize = sizeof(gamerecord);
+		count = 0;
+	}
+	((gamelogheader *)data)->count = count;
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	basemillis = tv.tv_sec*1000LL + tv.tv_usec/1000 - totalmillis;
+	return true;
+}
+
+void addgamerecord(gamerecord &r) {
+	if(!data) return;
+	if(count >= capacity && !mapgamelog(capacity + GAMELOG_GROW)) {
+		conoutf("could not grow the game event log: %s", strerror(errno));
+		closegamelog();
+		return;
+	}
+	r.millis = basemillis + totalmillis;
+	memcpy(data + filesize(count), &r, sizeof(r));
+	count++;
+	__atomic_store_n(&((gamelogheader *)data)->count, count, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,51 @@
+#ifndef GAMELOG_H_
+#define GAMELOG_H_
+
+// binary game event log for the stats pipeline. every event is one fixed size record
+// copied into a memory mapped file, so logging from the tick costs a memcpy and never
+// formats text. the count in the header is published after the record, so a reader
+// following the file never sees a half written one. gamelogdump turns a log into csv or json.
+enum {
+	GE_CONNECT = 0, // actor, value: ip, text: name
+	GE_DISCONNECT,  // actor, value: disconnect reason
+	GE_NAME,        // actor, text: new name
+	GE_MAP,         // value: mode, text: map
+	GE_SHOT,        // actor, weapon, pos: from, targetpos: to
+	GE_DAMAGE,      // actor, target, weapon, value: damage, extra: health left
+	GE_KILL,        // actor, target, weapon, value: frags of the actor
+	GE_SUICIDE,     // actor
+	GE_PICKUP,      // actor, value: entity, extra: item type
+	GE_FLAG,        // actor, value: flag, extra: GF_ action
+	GE_BASE,        // value: base, extra: 1 captured, 0 neutralized, text: team
+	GE_NUMTYPES
+};
+
+enum { GF_TAKE = 0, GF_DROP, GF_RETURN, GF_SCORE, GF_RESET };
+
+#define GAMELOG_MAGIC "FROGEVT1"
+#define GAMELOG_VERSION 1
+
+struct gamelogheader {
+	char magic[8];
+	uint version, recordsize; // a mismatch means another layout or byte order
+	int64_t count;            // records after the header
+	int64_t reserved;
+};
+
+struct gamerecord {
+	int64_t millis; // unix time
+	uchar type, weapon;
+	short actor, target, pad; // client numbers, -1 for none
+	int value, extra;
+	union {
+		struct { float pos[3], targetpos[3]; } at;
+		char text[40];
+	};
+};
+
+bool opengamelog(const char *name); // "" closes the log
+void closegamelog(); // truncates the file to its records
+bool gamelogging();
+void addgamerecord(gamerecord &r); // fills in millis
+
+#endif /* GAMELOG_H_ */
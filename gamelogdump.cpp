@@ -0,0 +1,75 @@
+// prints a game event log as csv, or as json lines with -json: ./gamelogdump [-json] file
+#include "cube.h"
+#include "gamelog.h"
+
+static const char *typenames[GE_NUMTYPES] = { "connect", "disconnect", "name", "map", "shot", "damage", "kill", "suicide", "pickup", "flag", "base" };
+
+static bool hastext(int type) {
+	return type == GE_CONNECT || type == GE_NAME || type == GE_MAP || type == GE_BASE;
+}
+
+static void putcsv(const char *s) {
+	putchar('"');
+	for(; *s; s++) {
+		if(*s == '"') putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+static void putjson(const char *s) {
+	putchar('"');
+	for(; *s; s++) {
+		uchar c = *s;
+		if(c == '"' || c == '\\') printf("\\%c", c);
+		else if(c < 0x20) printf("\\u%04x", c);
+		else putchar(c);
+	}
+	putchar('"');
+}
+
+int main(int argc, char **argv) {
+	bool json = false;
+	const char *name = NULL;
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-json")) json = true;
+		else name = argv[i];
+	}
+	if(!name) { fprintf(stderr, "usage: %s [-json] file\n", argv[0]); return EXIT_FAILURE; }
+	FILE *f = fopen(name, "rb");
+	if(!f) { fprintf(stderr, "could not open %s\n", name); return EXIT_FAILURE; }
+	gamelogheader h;
+	if(fread(&h, 1, sizeof(h), f) != sizeof(h) || memcmp(h.magic, GAMELOG_MAGIC, 8)) {
+		fprintf(stderr, "%s is not a game event log\n", name);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	if(h.version != GAMELOG_VERSION || h.recordsize != sizeof(gamerecord)) {
+		fprintf(stderr, "%s has version %u with %u byte records, expected version %d with %d\n", name, h.version, h.recordsize, GAMELOG_VERSION, int(sizeof(gamerecord)));
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	if(!json) puts("millis,type,actor,target,weapon,value,extra,x,y,z,tx,ty,tz,text");
+	gamerecord r;
+	int64_t n = 0;
+	for(; n < h.count && fread(&r, 1, sizeof(r), f) == sizeof(r); n++) {
+		const char *type = r.type < GE_NUMTYPES ? typenames[r.type] : "unknown";
+		bool text = hastext(r.type);
+		if(text) r.text[sizeof(r.text)-1] = 0;
+		if(json) {
+			printf("{\"millis\":%lld,\"type\":\"%s\",\"actor\":%d,\"target\":%d,\"weapon\":%d,\"value\":%d,\"extra\":%d", (long long)r.millis, type, r.actor, r.target, r.weapon, r.value, r.extra);
+			if(text) { printf(",\"text\":"); putjson(r.text); }
+			else printf(",\"pos\":[%.2f,%.2f,%.2f],\"targetpos\":[%.2f,%.2f,%.2f]", r.at.pos[0], r.at.pos[1], r.at.pos[2], r.at.targetpos[0], r.at.targetpos[1], r.at.targetpos[2]);
+			puts("}");
+		} else {
+			printf("%lld,%s,%d,%d,%d,%d,%d,", (long long)r.millis, type, r.actor, r.target, r.weapon, r.value, r.extra);
+			if(text) { printf(",,,,,,"); putcsv(r.text); }
+			else printf("%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,", r.at.pos[0], r.at.pos[1], r.at.pos[2], r.at.targetpos[0], r.at.targetpos[1], r.at.targetpos[2]);
+			putchar('\n');
+		}
+	}
+	fclose(f);
+	if(n < h.count) { fprintf(stderr, "%s ends after %lld of %lld records\n", name, (long long)n, (long long)h.count); return EXIT_FAILURE; }
+	return EXIT_SUCCESS;
+}
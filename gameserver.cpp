@@ -1,8 +1,18 @@
 #include <event2/http.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/keyvalq_struct.h>
 #include "game.h"
 #include "json.h"
+#include "match.h"
+#include "banlog.h"
+#include "registry.h"
+#include "worker.h"
+#include "admission.h"
 #include "color.h"
+#include "logger.h"
+#include "gamelog.h"
+#include "country.h"
 
 namespace server
 {
@@ -222,6 +232,27 @@ namespace server
 		}
 	};
 
+	// binary edit recording (.rec): header, then edit messages exactly as on the wire with
+	// the selection origin stored relative to hdr.origin, so playback can relocate it
+	#define EDITREC_MAGIC "FROGEDIT"
+	#define EDITREC_VERSION 1
+	struct editrecheader
+	{
+		char magic[8];
+		int version, protocol;
+		int origin[3];
+	};
+
+	struct editplayback
+	{
+		uchar *data;
+		int len, pos;
+		bool mapped;
+
+		editplayback() : data(NULL), len(0), pos(0), mapped(false) {}
+		~editplayback() { if(mapped) unmapfile(data, len); else delete[] data; }
+	};
+
 	struct clientinfo
 	{
 		int clientnum, ownernum, sessionid;
@@ -239,6 +270,8 @@ namespace server
 		vector<clientinfo *> bots;
 		uint authreq;
 		string authname;
+		workjob *authjob; // challenge or answer being worked on for a local key
+		void *authanswer; // expected answer to the challenge we sent
 		int ping, aireinit;
 		string clientmap;
 		int mapcrc;
@@ -270,16 +303,27 @@ namespace server
 
 		// edit recording
 		ivec playorigin;
-		stream *recording, *playing;
+		stream *recording;
+		editplayback *playing;
 
 		// protect against mass kicking
 		int64_t lastkick;
 
-		bool logged_in;
+		bool logged_in, loginpending;
 		string permissions;
 
+		// frog command rate limits
+		struct cmdbucket { string name; float tokens; int64_t last; };
+		vector<cmdbucket> cmdbuckets;
+
+		bool relaysynced; // relay mode: got the upstream welcome state and follows the live feed
+		int journalwait; // map loads to wait for before the coop edit journal is sent
+		int journalend; // journal records broadcast before the welcome; later ones come live
+		vector<uchar> heldmessages; // world messages kept back until the journal is sent
+		int64_t heldsince;
+
 		clientinfo() { reset(); }
-		~clientinfo() { events.deletecontentsp(); }
+		~clientinfo() { events.deletecontentsp(); cancelauth(); }
 
 		void addevent(gameevent *e) {
 			if(state.state==CS_SPECTATOR || events.length()>100) delete e;
@@ -296,6 +340,8 @@ namespace server
 			mapcrc = 0;
 			warned = false;
 			gameclip = false;
+			journalwait = journalend = 0;
+			heldmessages.setsize(0);
 		}
 
 		void reassign() {
@@ -311,13 +357,17 @@ namespace server
 			privilege = PRIV_NONE;
 			connected = local = false;
 			authreq = 0;
+			authjob = NULL;
+			authanswer = NULL;
 			position.setsizenodelete(0);
 			messages.setsizenodelete(0);
 			ping = 0;
 			aireinit = 0;
 			mapchange();
 
-			recording = playing = NULL;
+			recording = NULL;
+			playing = NULL;
+			relaysynced = false;
 			playorigin.x = playorigin.y = playorigin.z = 512; //middle of a size 10 map, I guess
 
 			lastremip = lastnewmap = 0;
@@ -335,7 +385,15 @@ namespace server
 			mapmodelspamwarned = 0;
 			mapmodelspamtimes = 0;
 			lastkick = 0;
+			loginpending = false;
 			permissions[0] = 0;
+			cmdbuckets.setsize(0);
+		}
+
+		void cancelauth() {
+			if(authjob) { canceljob(authjob); authjob = NULL; }
+			if(authanswer) { freechallenge(authanswer); authanswer = NULL; }
+			authreq = 0;
 		}
 
 		bool can_script() {
@@ -386,6 +444,13 @@ namespace server
 		extern void savebotnames(stream *s);
 	}
 
+	banlog bandb; // permanent bans and notices, see loadbans()
+	registry hostregistry; // shared with the other servers on this host, see attachregistry()
+	SVAR(sharedregistry, ""); // shm name like /frogmod, servers on this host with the same name share bans, notices and logins
+	VAR(sharedregistrypoll, 100, 1000, 60000); // ms between checks for changes
+	VAR(sharedregistrysize, 256, 65536, 1<<20); // entries in the table; the first server to create it decides
+	bool registrysyncing = false; // applying hostregistry changes, don't publish them back
+
 	/********************************
 	 * NOTICES (blacklist/whitelist)
 	 ********************************/
@@ -393,27 +458,72 @@ namespace server
 		string match;
 		string reason;
 	};
-	
-	vector <notice> blacklisted, whitelisted;
+
+	// a notice list plus its compiled matcher. entries are tagged by index, so
+	// appending extends the matcher and only a removal needs a rebuild
+	struct noticelist : vector<notice> {
+		int kind; // BANLOG_*
+		matchset set;
+		bool dirty;
+
+		noticelist(int kind) : kind(kind), dirty(false) {}
+
+		void append(const notice &n) {
+			add(n);
+			if(!dirty) set.add(last().match, (void *)(intptr_t)length());
+			bandb.add(kind, n.match, n.reason);
+			if(!registrysyncing) hostregistry.put(registrykind(), n.match, n.reason);
+		}
+
+		// drops every entry with this pattern
+		bool drop(const char *pattern) {
+			string match; // pattern may be one of the entries
+			copystring(match, pattern);
+			bool found = false;
+			loopv(*this) if(!strcmp((*this)[i].match, match)) { remove(i--); found = true; }
+			if(found) {
+				dirty = true;
+				bandb.remove(kind, match);
+				if(!registrysyncing) hostregistry.remove(registrykind(), match);
+			}
+			return found;
+		}
+
+		int registrykind() const { return kind == BANLOG_BLACKLIST ? REGISTRY_BLACKLIST : REGISTRY_WHITELIST; }
+
+		// every notice matching the client's ip, hostname and optionally name, in one pass per field
+		int find(int cn, vector<notice *> &out, bool byname) {
+			if(dirty) {
+				set.clear();
+				loopv(*this) set.add((*this)[i].match, (void *)(intptr_t)(i+1));
+				dirty = false;
+			}
+			vector<void *> hits;
+			set.matchip(getclientip(cn), &hits);
+			set.match(getclienthostname(cn), &hits);
+			clientinfo *ci = byname ? (clientinfo *)getclientinfo(cn) : NULL;
+			if(ci) set.match(ci->name, &hits);
+			loopv(hits) out.add(&(*this)[(intptr_t)hits[i] - 1]);
+			return out.length();
+		}
+	};
+
+	noticelist blacklisted(BANLOG_BLACKLIST), whitelisted(BANLOG_WHITELIST);
 
 	ICOMMAND(blacklist, "ss", (char *match, char *reason), {
 		if(!match || !*match) return;
 		notice n;
 		copystring(n.match, match);
 		copystring(n.reason, reason);
-		blacklisted.add(n);
+		blacklisted.append(n);
 		message("\f3%s\f6 has been blacklisted.", match);
 		irc.speak("\00314%s has been blacklisted.", match);
 	});
 	ICOMMAND(unblacklist, "s", (char *match), {
-		if(match && *match)
-			loopv(blacklisted)
-				if(!strcmp(blacklisted[i].match, match)) {
-					blacklisted.remove(i);
-					message("\f3%s\f6 has been unblacklisted.", match);
-					irc.speak("\00314%s has been unblacklisted.", match);
-					return;
-				}
+		if(match && *match && blacklisted.drop(match)) {
+			message("\f3%s\f6 has been unblacklisted.", match);
+			irc.speak("\00314%s has been unblacklisted.", match);
+		}
 	});
 
 	ICOMMAND(whitelist, "ss", (char *match, char *reason), {
@@ -421,19 +531,15 @@ namespace server
 		notice n;
 		copystring(n.match, match);
 		copystring(n.reason, reason);
-		whitelisted.add(n);
+		whitelisted.append(n);
 		message("\f3%s\f6 has been whitelisted.", match);
 		irc.speak("\00314%s has been whitelisted.", match);
 	});
 	ICOMMAND(unwhitelist, "s", (char *match), {
-		if(match && *match)
-			loopv(whitelisted)
-				if(!strcmp(whitelisted[i].match, match)) {
-					whitelisted.remove(i);
-					message("\f3%s\f6 has been unwhitelisted.", match);
-					irc.speak("\00314%s has been unwhitelisted.", match);
-					return;
-				}
+		if(match && *match && whitelisted.drop(match)) {
+			message("\f3%s\f6 has been unwhitelisted.", match);
+			irc.speak("\00314%s has been unwhitelisted.", match);
+		}
 	});
 
 	int show_blacklist(int who) {
@@ -451,22 +557,27 @@ namespace server
 	}
 
 	bool is_blacklisted(int cn) {
-		clientinfo *ci = (clientinfo *)getclientinfo(cn);
-		loopv(blacklisted)
-			if(!fnmatch(blacklisted[i].match, getclientipstr(cn), 0) ||
-			   !fnmatch(blacklisted[i].match, getclienthostname(cn), 0) ||
-			   !fnmatch(blacklisted[i].match, ci->name, 0)) return true;
-		return false;
+		vector<notice *> hits;
+		return blacklisted.find(cn, hits, true) > 0;
 	}
 
+	// all distinct reasons of the matching entries, or NULL if none match
 	const char *blacklist_reason(int cn) {
-		loopv(blacklisted) if(!fnmatch(blacklisted[i].match, getclientipstr(cn), 0) || !fnmatch(blacklisted[i].match, getclienthostname(cn), 0)) return blacklisted[i].reason;
-		return "";
+		static string reason;
+		vector<notice *> hits;
+		if(!blacklisted.find(cn, hits, true)) return NULL;
+		reason[0] = 0;
+		loopv(hits) {
+			if(!hits[i]->reason[0] || strstr(reason, hits[i]->reason)) continue;
+			if(reason[0]) concatstring(reason, ", ");
+			concatstring(reason, hits[i]->reason);
+		}
+		return reason;
 	}
 
 	bool is_whitelisted(int cn) {
-		loopv(whitelisted) if(!fnmatch(whitelisted[i].match, getclientipstr(cn), 0) || !fnmatch(whitelisted[i].match, getclienthostname(cn), 0)) return true;
-		return false;
+		vector<notice *> hits;
+		return whitelisted.find(cn, hits, false) > 0;
 	}
 
 	#define MM_MODE 0xF
@@ -491,7 +602,9 @@ namespace server
 	stream *mapdata = NULL;
 
 	vector<uint> allowedips;
-	vector<ban> bans;
+	vector<ban *> bans;
+	matchset banmatch; // compiled from bans, see banset()
+	bool bansdirty = false;
 	vector<clientinfo *> connects, clients, bots;
 	vector<worldstate *> worldstates;
 	bool reliablemessages = false;
@@ -538,6 +651,41 @@ namespace server
 		virtual bool extinfoteam(const char *team, ucharbuf &p) { return false; }
 	};
 
+	SVARF(gamelogfile, "", opengamelog(gamelogfile));
+
+	// positions default to the actor's and the target's
+	void logevent(int type, clientinfo *actor, clientinfo *target = NULL, int weapon = 0, int value = 0, int extra = 0, const vec *from = NULL, const vec *to = NULL)
+	{
+		if(!gamelogging()) return;
+		gamerecord r;
+		memset(&r, 0, sizeof(r));
+		r.type = type;
+		r.weapon = weapon;
+		r.actor = actor ? actor->clientnum : -1;
+		r.target = target ? target->clientnum : -1;
+		r.value = value;
+		r.extra = extra;
+		if(!from && actor) from = &actor->state.o;
+		if(!to && target) to = &target->state.o;
+		if(from) loopi(3) r.at.pos[i] = (*from)[i];
+		if(to) loopi(3) r.at.targetpos[i] = (*to)[i];
+		addgamerecord(r);
+	}
+
+	void logevent(int type, clientinfo *actor, int value, int extra, const char *text)
+	{
+		if(!gamelogging()) return;
+		gamerecord r;
+		memset(&r, 0, sizeof(r));
+		r.type = type;
+		r.actor = actor ? actor->clientnum : -1;
+		r.target = -1;
+		r.value = value;
+		r.extra = extra;
+		copystring(r.text, text, sizeof(r.text));
+		addgamerecord(r);
+	}
+
 	#define SERVMODE 1
 	#include "capture.h"
 	#include "ctf.h"
@@ -561,7 +709,7 @@ namespace server
 
 	//vampi
 	SVAR(frogchar, "@");
-	SVAR(logfile, "");
+	SVARF(logfile, "", setlogfile(logfile));
 
 	VAR(remipmillis, 1, 2000, INT_MAX);
 	VAR(newmapmillis, 1, 2000, INT_MAX);
@@ -571,7 +719,8 @@ namespace server
 
 	VAR(multifragmillis, 1, 2000, INT_MAX); // MULTI KILL!!
 
-	VAR(playbackmillis, 10, 100, INT_MAX); // play back a recorded edit action at this rate
+	VAR(playbackmillis, 10, 100, INT_MAX); // play back recorded edit actions at this rate
+	VAR(playbackbytes, 16, 1024, MAXTRANS); // bytes of recorded edit messages sent per player every playbackmillis
 	int64_t lastplaybackmillis;
 
 	bool chainsaw = false, gunfinity = false;
@@ -591,6 +740,67 @@ namespace server
 	VAR(kickmillis, 1, 30000, INT_MAX); // interval between kicks for protecting against mass kicking
 
 	SVAR(webhook, ""); // web hook. this url is accessed to send information to the central server
+	VAR(webhookjson, 0, 0, 1); // post each event to the web hook as a json object instead of a query string
+	void flushwebhook();
+	VARF(webhookbatch, 0, 0, 3600000, flushwebhook()); // with webhookjson, gather the events for this many milliseconds and post them as one { "events": [...] }. frags are only sent this way
+	VAR(webhookbatchmax, 1, 500, 100000); // events in one batch; more are dropped and counted
+
+	// the webhook event being written, or the batch it goes into
+	static evbuffer *webhookbuf = NULL;
+	static JSON::Writer *webhookwriter = NULL;
+	static bool webhookbatched = false;
+	static int webhookevents = 0, webhookdropped = 0;
+	static int64_t webhookopened = 0;
+
+	// NULL when the batch is full. fill in the members, then endwebhook()
+	static JSON::Writer *beginwebhook(const char *action) {
+		if(!webhookwriter) {
+			webhookbuf = evbuffer_new();
+			webhookwriter = new JSON::Writer(webhookbuf);
+			webhookbatched = webhookbatch > 0;
+			webhookevents = webhookdropped = 0;
+			webhookopened = totalmillis;
+			if(webhookbatched) {
+				webhookwriter->beginobject();
+				webhookwriter->key("events");
+				webhookwriter->beginarray();
+			}
+		} else if(webhookevents >= webhookbatchmax) {
+			webhookdropped++;
+			return NULL;
+		}
+		webhookwriter->beginobject();
+		webhookwriter->member("action", action);
+		if(webhookbatched) webhookwriter->member("millis", int(totalmillis - webhookopened));
+		return webhookwriter;
+	}
+
+	void flushwebhook() {
+		if(!webhookwriter) return;
+		if(webhookbatched) {
+			webhookwriter->endarray();
+			if(webhookdropped) webhookwriter->member("dropped", webhookdropped);
+			webhookwriter->endobject();
+		}
+		DELETEP(webhookwriter);
+		if(webhook[0]) froghttp_post(evbase, dnsbase, webhook, "application/json", webhookbuf, NULL, NULL);
+		evbuffer_free(webhookbuf);
+		webhookbuf = NULL;
+	}
+
+	static void endwebhook() {
+		webhookwriter->endobject();
+		webhookevents++;
+		if(!webhookbatched) flushwebhook();
+	}
+
+	VARF(httpconns, 1, 2, 16, httpclient.maxconns = httpconns); // keep-alive connections per host for outgoing requests
+	VARF(httpretries, 0, 3, 100, httpclient.retries = httpretries); // failed requests are sent again this many times
+	VARF(httpbackoffmillis, 1, 1000, 600000, httpclient.backoffmillis = httpbackoffmillis); // first pause before sending again, doubled each time
+	VARF(httpmaxbackoffmillis, 1, 60000, 3600000, httpclient.maxbackoffmillis = httpmaxbackoffmillis);
+	VARF(httpmaxpending, 1, 256, 65536, httpclient.maxpending = httpmaxpending); // outgoing requests in flight or waiting to be retried
+	VARF(httptimeout, 1, 10, 600, httpclient.timeout = httptimeout); // seconds
+	VARF(httpdnsttl, 0, 60, 86400, httpclient.mindnsttl = httpdnsttl); // cache host addresses at least this long
 	SVAR(loginsurl, ""); // if this URL is set, you can update logins.cfg from this url, using @getlogins
 	VAR(httpport, 0, 0, 65535); // the port on which to open the http server. set to 0 to disable
 	
@@ -647,29 +857,10 @@ namespace server
 	}
 
 	void log(const char *fmt, ...) {
-		stream *f = NULL;
-		if(logfile[0]) {
-			f = openfile(path(logfile, true), "a"); //FIXME: add openfile(FILE *f); so we can open stdout, and simplify this
-		}
-
 		va_list ap;
-
 		va_start(ap, fmt);
-		time_t t = time(NULL);
-		char *ct = ctime(&t);
-		ct[strlen(ct) - 1] = ' '; //replace trailing newline with space
-		if(f) {
-			f->putstring(ct);
-			f->vprintf(fmt, ap);
-			f->putstring("\n");
-		} else {
-			fputs(ct, stdout);
-			vfprintf(stdout, fmt, ap);
-			fputs("\n", stdout);
-		}
+		logoutfv(LL_INFO, fmt, ap);
 		va_end(ap);
-
-		if(f) delete f;
 	}
 
 	const char *privname(int type)
@@ -778,38 +969,267 @@ namespace server
 
 	struct login {
 		string user;
-		string password; // hashed
+		string key; // lowercase user, for loginindex
+		string password; // sha1 hex, or $pbkdf2-sha1$iterations$salt$hash (see loginhash)
 		string permissions; // each char is a permission
 	};
-	vector <login> logins;
+	vector <login *> logins;
+	hashtable<const char *, login *> loginindex;
+
+	login *findlogin(const char *user) {
+		string key;
+		copystring(key, user);
+		for(char *c = key; *c; c++) *c = tolower(*c);
+		login **l = loginindex.access(key);
+		return l ? *l : NULL;
+	}
+
+	login *setlogin(const char *user, const char *password, const char *permissions) {
+		login *l = findlogin(user);
+		if(!l) {
+			l = logins.add(new login);
+			copystring(l->user, user);
+			copystring(l->key, user);
+			for(char *c = l->key; *c; c++) *c = tolower(*c);
+			l->permissions[0] = 0;
+			loginindex[l->key] = l;
+		}
+		copystring(l->password, password);
+		if(permissions) copystring(l->permissions, permissions);
+		return l;
+	}
+
+	void clearlogins() {
+		loginindex.clear();
+		logins.deletecontentsp();
+	}
+
 	ICOMMAND(addlogin, "sss", (char *u, char *p, char *perms), {
 		CHECK_PERM;
-		loopv(logins) { // check for existing user
-			if(!strcmp(logins[i].user, u)) {
-				copystring(logins[i].password, p);
-				if(perms) copystring(logins[i].permissions, perms);
-				return;
+		hostregistry.put(REGISTRY_LOGIN, u, p, perms);
+		setlogin(u, p, perms);
+	});
+	ICOMMAND(clearlogins, "", (), { CHECK_PERM; clearlogins(); hostregistry.clear(REGISTRY_LOGIN); });
+
+	VAR(loginiterations, 1000, 20000, 10000000); // PBKDF2 rounds for new loginhash results
+	#define LOGINKDF "$pbkdf2-sha1$"
+	#define MAXLOGINJOBS 32
+
+	static char *tohex(const uchar *b, int n, char *out) {
+		loopi(n) {
+			out[2*i] = "0123456789abcdef"[b[i] >> 4];
+			out[2*i+1] = "0123456789abcdef"[b[i] & 0xF];
+		}
+		out[2*n] = 0;
+		return out;
+	}
+
+	// rounds gets the PBKDF2 rounds spent, 0 for a legacy sha1 entry
+	static bool checkloginhash(const char *pwd, const char *stored, int &rounds) {
+		rounds = 0;
+		if(!strncmp(stored, LOGINKDF, strlen(LOGINKDF))) {
+			const char *s = stored + strlen(LOGINKDF), *salthex = strchr(s, '$'), *hashhex = salthex ? strchr(salthex+1, '$') : NULL;
+			int iters = atoi(s);
+			if(!hashhex || iters <= 0) return false;
+			salthex++;
+			hashhex++;
+			uchar salt[64], hash[64];
+			int saltlen = 0, hashlen = strlen(hashhex)/2;
+			for(const char *h = salthex; h < hashhex-1 && saltlen < (int)sizeof(salt); h += 2) {
+				uint b;
+				if(sscanf(h, "%2x", &b) != 1) return false;
+				salt[saltlen++] = b;
+			}
+			if(hashlen <= 0 || hashlen > (int)sizeof(hash)) return false;
+			pbkdf2sha1(pwd, salt, saltlen, iters, hash, hashlen);
+			rounds = iters;
+			string hex;
+			return hashequal(tohex(hash, hashlen, hex), hashhex);
+		}
+		string hash;
+		getsha1((char *)pwd, hash);
+		return hashequal(hash, stored);
+	}
+
+	// checks a password on the worker thread, then logs in a game client or an irc peer
+	struct loginjob : workjob {
+		int cn, sessionid; // game client, or -1
+		string ircserver, ircnick, ircto;
+		string user, pwd, stored, permissions;
+		bool found, ok;
+		int iters;
+
+		loginjob(const char *u, const char *p) : cn(-1), sessionid(0), ok(false), iters(loginiterations) {
+			ircserver[0] = ircnick[0] = ircto[0] = 0;
+			copystring(user, u);
+			copystring(pwd, p);
+			login *l = findlogin(u);
+			found = l != NULL;
+			if(l) {
+				copystring(stored, l->password);
+				copystring(permissions, l->permissions);
+			} else stored[0] = 0;
+		}
+
+		// every check costs at least loginiterations rounds, so unknown names and
+		// legacy sha1 entries take as long as a current hash
+		void work() {
+			int rounds;
+			ok = checkloginhash(pwd, stored, rounds) && found;
+			if(rounds < iters) {
+				uchar pad[20];
+				pbkdf2sha1(pwd, (const uchar *)user, strlen(user), iters - rounds, pad, sizeof(pad));
 			}
+			memset(pwd, 0, sizeof(pwd));
 		}
-		login l;
-		copystring(l.user, u);
-		copystring(l.password, p);
-		copystring(l.permissions, perms);
-		logins.add(l);
+
+		void done();
+	};
+	static int loginjobs = 0;
+
+	void loginjob::done() {
+		loginjobs--;
+		if(cn >= 0) {
+			clientinfo *ci = (clientinfo *)getclientinfo(cn);
+			if(!ci || ci->sessionid != sessionid) return;
+			ci->loginpending = false;
+			if(!ok) return;
+			ci->logged_in = true;
+			copystring(ci->permissions, permissions);
+			message("%s has now logged in.", ci->name);
+			irc.speak(1, "\00306%s\00314 has now logged in.", ci->name);
+			return;
+		}
+		IRC::Server *s = irc.findserv(ircserver);
+		if(!s) return;
+		IRC::Peer *p = NULL;
+		for(unsigned int i = 0; i < s->peers.size(); i++) if(s->peers[i]->nick && !strcmp(s->peers[i]->nick, ircnick)) { p = s->peers[i]; break; }
+		if(!p) return;
+		if(!ok) {
+			if(strcmp(ircto, ircnick)) s->speakto(ircto, "%s: \00314Invalid login.", ircnick);
+			else s->speakto(ircto, "\00314Invalid login.");
+			return;
+		}
+		copystring(p->data, permissions);
+		message("%s has logged in from IRC", p->nick);
+		irc.speak(1, "\00306%s\00314 has logged in", p->nick);
+	}
+
+	VAR(loginattempts, 1, 5, 1000); // logins one address or irc nick may try per loginattemptmillis
+	VAR(loginattemptmillis, 1000, 60000, 3600000);
+	struct loginattempt {
+		string who;
+		int64_t since;
+		int count;
+	};
+	static vector<loginattempt> loginattemptlog;
+
+	// counts the attempt, false once who is over the limit
+	static bool allowlogin(const char *who) {
+		loopv(loginattemptlog) if(totalmillis - loginattemptlog[i].since >= loginattemptmillis) loginattemptlog.removeunordered(i--);
+		loopv(loginattemptlog) if(!strcmp(loginattemptlog[i].who, who)) return ++loginattemptlog[i].count <= loginattempts;
+		loginattempt &a = loginattemptlog.add();
+		copystring(a.who, who);
+		a.since = totalmillis;
+		a.count = 1;
+		return true;
+	}
+
+	static bool queuelogin(loginjob *job) {
+		if(loginjobs >= MAXLOGINJOBS) { delete job; return false; }
+		loginjobs++;
+		queuejob(job);
+		return true;
+	}
+
+	// makes the stored form of a password for addlogin
+	struct loginhashjob : workjob {
+		string pwd, result;
+		int iters;
+
+		loginhashjob(const char *p) : iters(loginiterations) { copystring(pwd, p); result[0] = 0; }
+
+		void work() {
+			uchar salt[16], hash[20];
+			FILE *f = fopen("/dev/urandom", "rb");
+			if(!f || fread(salt, 1, sizeof(salt), f) != sizeof(salt)) loopi(sizeof(salt)) salt[i] = rnd(256);
+			if(f) fclose(f);
+			pbkdf2sha1(pwd, salt, sizeof(salt), iters, hash, sizeof(hash));
+			memset(pwd, 0, sizeof(pwd));
+			string salthex, hashhex;
+			formatstring(result)("%s%d$%s$%s", LOGINKDF, iters, tohex(salt, sizeof(salt), salthex), tohex(hash, sizeof(hash), hashhex));
+		}
+
+		void done() { echo("loginhash: %s", result); }
+	};
+	ICOMMAND(loginhash, "s", (char *pwd), {
+		CHECK_PERM;
+		if(pwd && *pwd) queuejob(new loginhashjob(pwd));
 	});
-	ICOMMAND(clearlogins, "", (), { CHECK_PERM; logins.setsize(0); });
+	// ^ is cubescript's escape inside quotes, so it cannot go into logins.cfg either
+	static bool cfgquotable(const char *s) {
+		for(; *s; s++) if(*s == '"' || *s == '^' || uchar(*s) < 0x20) return false;
+		return true;
+	}
+
+	// a json list of { "name", "hash", "perms" } objects, bare or as "logins" in an object.
+	// it replaces all the logins here; logins.cfg only keeps them for the next start
+	static bool applyjsonlogins(stream *s, char *data, size_t len) {
+		JSON::Document doc;
+		if(!doc.parse(data, len)) {
+			privilegemsg(PRIV_ADMIN, "\f3Bad logins list\f7: %s at byte %d", doc.error, int(doc.erroroffset));
+			return false;
+		}
+		JSON::Value *list = doc.root->type == JSON::ObjectType ? doc.root->get("logins") : doc.root;
+		if(!list || list->type != JSON::ArrayType) {
+			privilegemsg(PRIV_ADMIN, "\f3Bad logins list\f7: no array of logins");
+			return false;
+		}
+		clearlogins();
+		hostregistry.clear(REGISTRY_LOGIN);
+		s->printf("clearlogins\n");
+		for(JSON::Value *l = list->first; l; l = l->next) {
+			JSON::Value *name = l->get("name"), *hash = l->get("hash"), *perms = l->get("perms");
+			if(!name || !hash || name->type != JSON::StringType || hash->type != JSON::StringType) continue;
+			const char *p = perms ? perms->str() : "";
+			if(!cfgquotable(name->s) || !cfgquotable(hash->s) || !cfgquotable(p)) continue;
+			hostregistry.put(REGISTRY_LOGIN, name->s, hash->s, p);
+			setlogin(name->s, hash->s, p);
+			s->printf("addlogin \"%s\" \"%s\" \"%s\"\n", name->s, hash->s, p);
+		}
+		return true;
+	}
+
 	static void gotlogins(evhttp_request *req, void *arg) {
 		if(!req) return;
 		evbuffer *buf = evhttp_request_get_input_buffer(req);
 		if(!buf) return;
+		if(evhttp_request_get_response_code(req) != HTTP_OK) {
+			privilegemsg(PRIV_ADMIN, "\f3Could not get logins\f7: HTTP %d", evhttp_request_get_response_code(req));
+			return;
+		}
+		size_t len = evbuffer_get_length(buf);
+		char *data = (char *)evbuffer_pullup(buf, -1); // parsed where it lies
+		size_t skip = 0;
+		while(skip < len && isspace(uchar(data[skip]))) skip++;
+		bool json = skip < len && (data[skip] == '[' || data[skip] == '{');
 		char *ln = NULL;
-		stream *s = openfile("logins.cfg", "w");
+		// the old logins.cfg stays until the new one is complete
+		stream *s = openfile("logins.cfg.tmp", "w");
 		if(!s) return;
-		while((ln = evbuffer_readln_nul(buf, NULL, EVBUFFER_EOL_ANY))) {
+		bool ok = true;
+		if(json) ok = applyjsonlogins(s, data, len);
+		else while((ln = evbuffer_readln_nul(buf, NULL, EVBUFFER_EOL_ANY))) {
 			s->putline(ln);
 			free(ln);
 		}
-		execfile("logins.cfg");
+		delete s; // flushed before it is moved into place
+		if(!ok) return;
+		if(!replacefile("logins.cfg.tmp", "logins.cfg")) {
+			privilegemsg(PRIV_ADMIN, "\f3Could not replace logins.cfg");
+			return;
+		}
+		if(!json) execfile("logins.cfg");
 		privilegemsg(PRIV_ADMIN, "Updated \f1logins.cfg");
 	}
 	ICOMMAND(getlogins, "", (), {
@@ -869,11 +1289,7 @@ namespace server
     });
     ICOMMAND(getclientip, "i", (int *cn), result(getclientipstr(*cn)));
     ICOMMAND(getclienthostname, "i", (int *cn), result(getclienthostname(*cn)));
-#ifdef HAVE_GEOIP
     ICOMMAND(getclientcountry, "i", (int *cn), result(getclientcountry(*cn)));
-#else
-    ICOMMAND(getclientcountry, "i", (int *cn), result(""));
-#endif
     ICOMMAND(getclientuptime, "i", (int *cn), { //FIXME: split into more functions (ie timestr)
     	clientinfo *ci = (clientinfo *)getclientinfo(*cn);
     	result(ci ? timestr(totalmillis - ci->connectmillis) : "");
@@ -898,28 +1314,18 @@ namespace server
 				loopv(clients) {
 					char buf[MAXIRC+1];
 					clientinfo *ci = clients[i];
+					const char *country = getclientcountrynul(ci->clientnum), *sep = country ? "/" : "";
+					if(!country) country = ""; // no table loaded, or not found
 					if(is_admin(scriptircsource)) {
-#ifdef HAVE_GEOIP
-						if(ci->privilege)
-							snprintf(buf, sizeof(buf), "\00305%s\00314 (%d/%s/%s/%s/%s)", ci->name, ci->clientnum, privname(ci->privilege), ci->state.statename(), getclientipstr(ci->clientnum), getclientcountry(ci->clientnum));
-						else
-							snprintf(buf, sizeof(buf), "\00306%s\00314 (%d/%s/%s/%s)", ci->name, ci->clientnum, ci->state.statename(), getclientipstr(ci->clientnum), getclientcountry(ci->clientnum));
-					} else {
 						if(ci->privilege)
-							snprintf(buf, sizeof(buf), "\00305%s\00314 (%d/%s/%s/%s)", ci->name, ci->clientnum, privname(ci->privilege), ci->state.statename(), getclientcountry(ci->clientnum));
+							snprintf(buf, sizeof(buf), "\00305%s\00314 (%d/%s/%s/%s%s%s)", ci->name, ci->clientnum, privname(ci->privilege), ci->state.statename(), getclientipstr(ci->clientnum), sep, country);
 						else
-							snprintf(buf, sizeof(buf), "\00306%s\00314 (%d/%s/%s)", ci->name, ci->clientnum, ci->state.statename(), getclientcountry(ci->clientnum));
-#else
-						if(ci->privilege)
-							snprintf(buf, sizeof(buf), "\00305%s\00314 (%d/%s/%s/%s)", ci->name, ci->clientnum, privname(ci->privilege), ci->state.statename(), getclientipstr(ci->clientnum));
-						else
-							snprintf(buf, sizeof(buf), "\00306%s\00314 (%d/%s/%s)", ci->name, ci->clientnum, ci->state.statename(), getclientipstr(ci->clientnum));
+							snprintf(buf, sizeof(buf), "\00306%s\00314 (%d/%s/%s%s%s)", ci->name, ci->clientnum, ci->state.statename(), getclientipstr(ci->clientnum), sep, country);
 					} else {
 						if(ci->privilege)
-							snprintf(buf, sizeof(buf), "\00305%s\00314 (%d/%s/%s)", ci->name, ci->clientnum, privname(ci->privilege), ci->state.statename());
+							snprintf(buf, sizeof(buf), "\00305%s\00314 (%d/%s/%s%s%s)", ci->name, ci->clientnum, privname(ci->privilege), ci->state.statename(), sep, country);
 						else
-							snprintf(buf, sizeof(buf), "\00306%s\00314 (%d/%s)", ci->name, ci->clientnum, ci->state.statename());
-#endif
+							snprintf(buf, sizeof(buf), "\00306%s\00314 (%d/%s%s%s)", ci->name, ci->clientnum, ci->state.statename(), sep, country);
 					}
 
 					w.append((char *)buf);
@@ -932,18 +1338,13 @@ namespace server
 				int cn = clients[i]->clientnum;
 				if(cn < 0 || cn > MAXCLIENTS) continue; // no bots. FIXME: is this a proper way to check?
 				int connectedseconds = (totalmillis - clients[i]->connectmillis);
+				const char *country = getclientcountrynul(cn);
+				string from = "";
+				if(country) formatstring(from)(" from \f6%s\f7", country);
 				if((scriptclient && scriptclient->privilege < PRIV_ADMIN)) { // check for NOT admin
-#ifdef HAVE_GEOIP
-					echo("%d %s (%s) from \f3%s\f7 connected for %sh", cn, clients[i]->name, clients[i]->state.statename(), getclientcountry(cn), timestr(connectedseconds));
-#else
-					echo("%d %s (%s) connected for %sh", cn, clients[i]->name, clients[i]->state.statename(), timestr(connectedseconds));
-#endif
+					echo("%d %s (%s)%s connected for %sh", cn, clients[i]->name, clients[i]->state.statename(), from, timestr(connectedseconds));
 				} else {
-#ifdef HAVE_GEOIP
-					echo("%d %s (%s) \f3%s %s\f7 from \f6%s\f7 connected for %sh", cn, clients[i]->name, clients[i]->state.statename(), getclientipstr(cn), getclienthostname(cn), getclientcountry(cn), timestr(connectedseconds));
-#else
-					echo("%d %s (%s) \f3%s %s\f7 connected for %sh", cn, clients[i]->name, clients[i]->state.statename(), getclientipstr(cn), getclienthostname(cn), timestr(connectedseconds));
-#endif
+					echo("%d %s (%s) \f3%s %s\f7%s connected for %sh", cn, clients[i]->name, clients[i]->state.statename(), getclientipstr(cn), getclienthostname(cn), from, timestr(connectedseconds));
 				}
 			}
 		}
@@ -956,12 +1357,6 @@ namespace server
 
 		if(f) {
 //			f->printf("bantime \"%d\"\n", bantime);
-			loopv(bans) if(bans[i].expiry < 0) f->printf("pban \"%s\"\n", bans[i].match);
-			loopv(blacklisted)
-				f->printf("blacklist \"%s\" \"%s\"\n", blacklisted[i].match, blacklisted[i].reason);
-			loopv(whitelisted)
-				f->printf("whitelist \"%s\" \"%s\"\n", whitelisted[i].match, whitelisted[i].reason);
-
 			aiman::savebotnames(f);
 
 			cmdwritecfg(f);
@@ -976,7 +1371,7 @@ namespace server
 
 		if(f) {
 			loopv(logins) {
-				f->printf("addlogin \"%s\" \"%s\" \"%s\"\n", logins[i].user, logins[i].password, logins[i].permissions);
+				f->printf("addlogin \"%s\" \"%s\" \"%s\"\n", logins[i]->user, logins[i]->password, logins[i]->permissions);
 			}
 		}
 	}
@@ -1029,14 +1424,24 @@ namespace server
 	void kick(int victim);
 	void addban(const char *match, char *name = NULL, int btime = bantime);
 	const char *colorname(clientinfo *ci, char *name = NULL, bool color = true);
+	void statusrequest(evhttp_request *req, const char *wait);
+	static void jsonmessage(evbuffer *buf, const char *key, const char *msg) {
+		JSON::Writer w(buf);
+		w.beginobject();
+		w.member(key, msg);
+		w.endobject();
+	}
 	void httpcb(evhttp_request *req, void *arg) {
-		const char *uri = evhttp_request_get_uri(req);
-		evkeyvalq *query = NULL; // uninitialized
-		evhttp_parse_query(uri, query);
-		const char *q_pass = evhttp_find_header(query, "pass");
-		const char *q_kick = evhttp_find_header(query, "kick");
-		const char *q_ban = evhttp_find_header(query, "ban");
-		evhttp_clear_headers(query);
+		evkeyvalq query;
+		evhttp_parse_query(evhttp_request_get_uri(req), &query);
+		const char *q_pass = evhttp_find_header(&query, "pass");
+		const char *q_kick = evhttp_find_header(&query, "kick");
+		const char *q_ban = evhttp_find_header(&query, "ban");
+		if(!q_kick && !q_ban) {
+			statusrequest(req, evhttp_find_header(&query, "wait"));
+			evhttp_clear_headers(&query);
+			return;
+		}
 
 		evbuffer *buf = evbuffer_new();
 		if(q_kick) {
@@ -1048,32 +1453,25 @@ namespace server
 							kick(cn);
 							message("\f3%s is being kicked by http command", colorname(clients[i]));
 							irc.speak("\00305%s is being kicked by http command", colorname(clients[i], NULL, false));
-							evbuffer_add_printf(buf, "{ \"success\": \"client kicked\" }\n");
+							jsonmessage(buf, "success", "client kicked");
 							break;
 						}
 					}
-				} else evbuffer_add_printf(buf, "{ \"error\": \"bad password\" }\n");
+				} else jsonmessage(buf, "error", "bad password");
 			} else {
-				evbuffer_add_printf(buf, "{ \"error\": \"password not specified\" }\n");
+				jsonmessage(buf, "error", "password not specified");
 			}
-		} else if(q_ban) {
+		} else {
 			if(q_pass) {
 				if(!strcmp(q_pass, adminpass)) {
 					addban(q_ban, NULL, -1);
-					evbuffer_add_printf(buf, "{ \"success\": \"IP banned\" }\n");
-				} else evbuffer_add_printf(buf, "{ \"error\": \"bad password\" }\n");
+					jsonmessage(buf, "success", "IP banned");
+				} else jsonmessage(buf, "error", "bad password");
 			} else {
-				evbuffer_add_printf(buf, "{ \"error\": \"password not specified\" }\n");
+				jsonmessage(buf, "error", "password not specified");
 			}
-		} else {
-			evbuffer_add_printf(buf, "{\n\t\"map\": \"%s\",\n\t\"mode\": %d,\n\t\"modename\": \"%s\",\n\t\"maxclients\": %d,\n\t\"clients\": [\n", smapname, gamemode, modename(gamemode), maxclients);
-			loopv(clients)
-				if(clients[i]) {
-					int cn = clients[i]->clientnum;
-					evbuffer_add_printf(buf, "%s\t\t{\n\t\t\t\"name\": \"%s\",\n\t\t\t\"cn\": %d,\n\t\t\t\"ip\": \"%s\",\n\t\t\t\"host\": \"%s\"\n\t\t}\n", i > 0 ? "," : "", clients[i]->name, cn, getclientipstr(cn), getclienthostname(cn));
-				}
-			evbuffer_add_printf(buf, "\t]\n}");
 		}
+		evhttp_clear_headers(&query);
 
 		evkeyvalq *oh = evhttp_request_get_output_headers(req);
 		evhttp_add_header(oh, "Content-type", "application/json");
@@ -1086,15 +1484,531 @@ namespace server
 		evhttp_send_error(req, 404, "Not found");
 	}
 
-	struct evhttp *http;
+	// live demo stream: /demo serves the running match in (uncompressed) demo format.
+	// each recorded packet is encoded once and referenced by every viewer's output buffer.
+	VAR(demostreamviewers, 0, 8, 1024); // maximum number of /demo viewers. set to 0 to disable the stream
+	VAR(demostreamlag, 1, 256, INT_MAX); // kB a viewer may have queued before position updates are skipped for it
+	SVAR(demostreampass, ""); // viewers must pass ?pass=... the stream shows every player's position, so it is off while this is empty
+
+	// relay mode: mirror an upstream server's /demo feed to our own clients, who watch it as a demo
+	SVAR(relayupstream, ""); // http://host:port of the upstream server. if set, this server runs as a relay
+	SVAR(relaypass, ""); // demostreampass of the upstream server
+	void setrelaychat();
+	SVARF(relaychatpass, "", setrelaychat()); // secret shared with the relays. /relaysay only exists while it is set, and relays send it upstream with their chat
+	VAR(relaychatrate, 1, 10, 1000); // lines per second accepted on /relaysay from one address
+	VAR(relayjournal, 16, 1024, INT_MAX); // kB of upstream messages kept for late joiners before resyncing with upstream
+	vector<uchar> relaywelcome, relaymessages; // upstream welcome packet, and every message since then
+
+	struct demoviewer {
+		evhttp_request *req;
+		evhttp_connection *conn;
+		bool dropmode; // ?policy=drop: disconnect when lagging instead of skipping position updates
+	};
+	vector<demoviewer *> demoviewers;
+	vector<uchar> demowelcome; // header + welcome state, rebuilt lazily after anything is recorded
+	evbuffer *demochunk = NULL;
+
+	struct demoblock {
+		int refs;
+		uchar data[1];
+	};
+
+	static void demoblock_unref(const void *data, size_t len, void *arg) {
+		demoblock *b = (demoblock *)arg;
+		if(--b->refs <= 0) free(b);
+	}
+
+	static void demoviewer_closecb(evhttp_connection *conn, void *arg) {
+		demoviewer *v = (demoviewer *)arg;
+		demoviewers.removeobj(v);
+		delete v;
+	}
+
+	static void demoviewer_drop(demoviewer *v) {
+		evhttp_connection_set_closecb(v->conn, NULL, NULL);
+		evhttp_send_reply_end(v->req);
+		demoviewers.removeobj(v);
+		delete v;
+	}
+
+	static size_t demoviewer_backlog(demoviewer *v) {
+		bufferevent *bev = evhttp_connection_get_bufferevent(v->conn);
+		return bev ? evbuffer_get_length(bufferevent_get_output(bev)) : 0;
+	}
+
+	static void putdemostamp(vector<uchar> &buf, int chan, int len) {
+		int stamp[3] = { (int)gamemillis, chan, len };
+		lilswap(stamp, 3);
+		buf.put((uchar *)stamp, sizeof(stamp));
+	}
+
+	int welcomepacket(packetbuf &p, clientinfo *ci);
+	static void builddemowelcome() {
+		if(demowelcome.length()) return;
+		demoheader hdr;
+		memcpy(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic));
+		hdr.version = DEMO_VERSION;
+		hdr.protocol = PROTOCOL_VERSION;
+		lilswap(&hdr.version, 2);
+		demowelcome.put((uchar *)&hdr, sizeof(hdr));
+		if(relayupstream[0]) { // chained relay: pass on what we got from upstream
+			putdemostamp(demowelcome, 1, relaywelcome.length());
+			demowelcome.put(relaywelcome.getbuf(), relaywelcome.length());
+			if(relaymessages.length()) {
+				putdemostamp(demowelcome, 1, relaymessages.length());
+				demowelcome.put(relaymessages.getbuf(), relaymessages.length());
+			}
+			return;
+		}
+		packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+		welcomepacket(p, NULL);
+		putdemostamp(demowelcome, 1, p.len);
+		demowelcome.put(p.buf, p.len);
+	}
+
+	void demostreampacket(int chan, void *data, int len) {
+		demowelcome.setsizenodelete(0);
+		if(demoviewers.empty()) return;
+
+		demoblock *b = (demoblock *)malloc(sizeof(demoblock) + 3*sizeof(int) + len);
+		int stamp[3] = { (int)gamemillis, chan, len };
+		lilswap(stamp, 3);
+		memcpy(b->data, stamp, sizeof(stamp));
+		memcpy(b->data + sizeof(stamp), data, len);
+		b->refs = 1;
+		size_t blen = sizeof(stamp) + len, maxlag = size_t(demostreamlag)*1024;
+
+		if(!demochunk) demochunk = evbuffer_new();
+		loopvrev(demoviewers) {
+			demoviewer *v = demoviewers[i];
+			size_t backlog = demoviewer_backlog(v);
+			if(backlog > maxlag) {
+				// positions are resent every frame, so they can be skipped; anything else would desync the viewer
+				if(v->dropmode || backlog > 4*maxlag) { demoviewer_drop(v); continue; }
+				if(chan == 0) continue;
+			}
+			b->refs++;
+			evbuffer_add_reference(demochunk, b->data, blen, demoblock_unref, b);
+			evhttp_send_reply_chunk(v->req, demochunk);
+		}
+		demoblock_unref(NULL, 0, b);
+	}
+
+	static void demostreamcb(evhttp_request *req, void *arg) {
+		evkeyvalq query;
+		evhttp_parse_query(evhttp_request_get_uri(req), &query);
+		const char *q_pass = evhttp_find_header(&query, "pass");
+		const char *q_policy = evhttp_find_header(&query, "policy");
+		bool authed = demostreampass[0] && q_pass && !strcmp(q_pass, demostreampass);
+		bool dropmode = q_policy && !strcmp(q_policy, "drop");
+		evhttp_clear_headers(&query);
+
+		if(!authed) { evhttp_send_error(req, 403, "Forbidden"); return; }
+		if(demoviewers.length() >= demostreamviewers) { evhttp_send_error(req, 503, "Too many viewers"); return; }
+
+		demoviewer *v = new demoviewer;
+		v->req = req;
+		v->conn = evhttp_request_get_connection(req);
+		v->dropmode = dropmode;
+		demoviewers.add(v);
+		evhttp_connection_set_closecb(v->conn, demoviewer_closecb, v);
+
+		evkeyvalq *oh = evhttp_request_get_output_headers(req);
+		evhttp_add_header(oh, "Content-type", "application/octet-stream");
+		evhttp_add_header(oh, "Cache-Control", "no-cache");
+		evhttp_add_header(oh, "Connection", "close");
+		evhttp_send_reply_start(req, 200, "OK");
+
+		builddemowelcome();
+		evbuffer *buf = evbuffer_new();
+		evbuffer_add(buf, demowelcome.getbuf(), demowelcome.length());
+		evhttp_send_reply_chunk(req, buf);
+		evbuffer_free(buf);
+	}
+
+	// demo ring: the last few minutes of recordpacket() traffic in a fixed buffer, with a welcome
+	// keyframe every demoringkeyframe seconds, so a clip can be saved at any time
+	void resizedemoring();
+	VARF(demoring, 0, 8192, 1024*1024, resizedemoring()); // kB kept in memory. set to 0 to disable
+	VAR(demoringkeyframe, 5, 30, 3600); // seconds between keyframes
+	VAR(demoringminutes, 1, 5, 600); // length of a saved clip
+
+	#define MAXRINGKEYS 256
+	struct ringkey { int64_t pos; int millis; };
+	uchar *demoringbuf = NULL;
+	int demoringsize = 0, demoringkeys = 0, demoringfirstkey = 0;
+	int64_t demoringhead = 0, demoringtail = 0, demoringepoch = 0, lastringkey = 0;
+	ringkey ringkeys[MAXRINGKEYS];
+
+	void resizedemoring() {
+		if(demoringsize == demoring*1024) return;
+		DELETEA(demoringbuf);
+		demoringsize = demoring*1024;
+		if(demoringsize) demoringbuf = new uchar[demoringsize];
+		demoringhead = demoringtail = 0;
+		demoringkeys = demoringfirstkey = 0;
+		demoringepoch = totalmillis;
+		lastringkey = 0;
+	}
+
+	static void ringput(const void *src, int n) {
+		int off = int(demoringhead % demoringsize), first = min(n, demoringsize - off);
+		memcpy(&demoringbuf[off], src, first);
+		memcpy(demoringbuf, (const uchar *)src + first, n - first);
+		demoringhead += n;
+	}
+
+	static void ringget(int64_t pos, void *dst, int n) {
+		int off = int(pos % demoringsize), first = min(n, demoringsize - off);
+		memcpy(dst, &demoringbuf[off], first);
+		memcpy((uchar *)dst + first, demoringbuf, n - first);
+	}
+
+	static void ringrecord(int chan, const void *data, int len) {
+		int stamp[3] = { int(totalmillis - demoringepoch), chan, len };
+		int n = sizeof(stamp) + len;
+		if(n > demoringsize) return;
+		while(demoringhead + n - demoringtail > demoringsize) { // evict whole records from the tail
+			int old[3];
+			ringget(demoringtail, old, sizeof(old));
+			demoringtail += sizeof(old) + old[2];
+		}
+		while(demoringkeys && ringkeys[demoringfirstkey].pos < demoringtail) {
+			demoringfirstkey = (demoringfirstkey + 1) % MAXRINGKEYS;
+			demoringkeys--;
+		}
+		ringput(stamp, sizeof(stamp));
+		ringput(data, len);
+	}
+
+	void demoringpacket(int chan, void *data, int len) {
+		if(!demoringbuf || m_edit || m_demo || relayupstream[0]) return;
+		if(!demoringkeys || totalmillis - lastringkey >= demoringkeyframe*1000) {
+			static packetbuf key(MAXTRANS, ENET_PACKET_FLAG_RELIABLE); // reused, so keyframes don't allocate
+			key.len = 0;
+			welcomepacket(key, NULL);
+			ringrecord(1, key.buf, key.len);
+			if(demoringkeys == MAXRINGKEYS) { demoringfirstkey = (demoringfirstkey + 1) % MAXRINGKEYS; demoringkeys--; }
+			ringkey &k = ringkeys[(demoringfirstkey + demoringkeys++) % MAXRINGKEYS];
+			k.pos = demoringhead - sizeof(int)*3 - key.len;
+			k.millis = int(totalmillis - demoringepoch);
+			lastringkey = totalmillis;
+		}
+		ringrecord(chan, data, len);
+	}
+
+	// letters, digits, - and _ only, so a name can't leave the directory
+	static void safefilename(char *dst, const char *src, int maxlen) {
+		int n = 0;
+		for(; *src && n < maxlen; src++) dst[n++] = isalnum(uchar(*src)) || *src == '-' || *src == '_' ? *src : '_';
+		dst[n] = 0;
+	}
+
+	// the clip is copied out of the ring on the main thread, compressed and written on a worker
+	struct demosavejob : workjob {
+		stream *f;
+		uchar *data;
+		int len;
+		string file;
+		bool ok;
+
+		demosavejob(stream *f, const char *name, int size) : f(f), data(new uchar[size]), len(0), ok(false) { copystring(file, name); }
+		~demosavejob() { DELETEP(f); DELETEA(data); }
+
+		void put(const void *src, int n) { memcpy(&data[len], src, n); len += n; }
+		void work() {
+			ok = f->write(data, len) == len;
+			DELETEP(f);
+		}
+		void done();
+	};
+	static demosavejob *demosaving = NULL;
+
+	void demosavejob::done() {
+		demosaving = NULL;
+		if(ok) echo("Demo clip: wrote %s (%d kB)", file, len/1024);
+		else echo("\f3Demo clip: could not write %s", file);
+	}
+
+	// write the ring from the oldest keyframe within demoringminutes to name.dmo
+	bool savedemoring(const char *name, string &msg) {
+		if(!demoringbuf || !demoringkeys) { copystring(msg, "nothing recorded"); return false; }
+		if(demosaving) { formatstring(msg)("still writing %s", demosaving->file); return false; }
+		string base;
+		safefilename(base, name, 100);
+		if(!base[0]) {
+			string map;
+			safefilename(map, smapname[0] ? smapname : "nomap", 100);
+			formatstring(base)("clip_%s_%d", map, (int)time(NULL));
+		}
+		defformatstring(file)("%s.dmo", base);
+
+		int now = int(totalmillis - demoringepoch), k = 0;
+		while(k+1 < demoringkeys && now - ringkeys[(demoringfirstkey + k) % MAXRINGKEYS].millis > demoringminutes*60000) k++;
+		ringkey start = ringkeys[(demoringfirstkey + k) % MAXRINGKEYS];
+
+		stream *f = opengzfile(file, "wb", NULL, Z_BEST_SPEED);
+		if(!f) { formatstring(msg)("could not write %s", file); return false; }
+		demosavejob *job = new demosavejob(f, file, sizeof(demoheader) + int(demoringhead - start.pos));
+		demoheader hdr;
+		memcpy(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic));
+		hdr.version = DEMO_VERSION;
+		hdr.protocol = PROTOCOL_VERSION;
+		lilswap(&hdr.version, 2);
+		job->put(&hdr, sizeof(hdr));
+		for(int64_t pos = start.pos; pos < demoringhead;) {
+			int stamp[3];
+			ringget(pos, stamp, sizeof(stamp));
+			pos += sizeof(stamp);
+			int len = stamp[2], off = int(pos % demoringsize), first = min(len, demoringsize - off);
+			stamp[0] -= start.millis;
+			lilswap(stamp, 3);
+			job->put(stamp, sizeof(stamp));
+			job->put(&demoringbuf[off], first);
+			if(first < len) job->put(demoringbuf, len - first);
+			pos += len;
+		}
+		demosaving = job;
+		queuejob(job);
+		formatstring(msg)("saving %.1f minutes to %s", (now - start.millis)/60000.0f, file);
+		return true;
+	}
+
+	ICOMMAND(savedemo, "s", (char *name), {
+		CHECK_PERM;
+		string msg;
+		savedemoring(name ? name : "", msg);
+		echo("Demo clip: %s", msg);
+	});
+
+	static void savedemocb(evhttp_request *req, void *arg) {
+		evkeyvalq query;
+		evhttp_parse_query(evhttp_request_get_uri(req), &query);
+		const char *q_pass = evhttp_find_header(&query, "pass");
+		const char *q_name = evhttp_find_header(&query, "name");
+		evbuffer *buf = evbuffer_new();
+		if(!q_pass) jsonmessage(buf, "error", "password not specified");
+		else if(!adminpass[0] || strcmp(q_pass, adminpass)) jsonmessage(buf, "error", "bad password");
+		else {
+			string msg;
+			bool ok = savedemoring(q_name ? q_name : "", msg);
+			jsonmessage(buf, ok ? "success" : "error", msg);
+		}
+		evhttp_clear_headers(&query);
+		evhttp_add_header(evhttp_request_get_output_headers(req), "Content-type", "application/json");
+		evhttp_send_reply(req, 200, "OK", buf);
+		evbuffer_free(buf);
+	}
+
+	// the status document at /. it is serialized again at most once per tick after something
+	// it shows changed, and every reply references the same copy. a request with the current
+	// ETag in If-None-Match gets a 304, or with ?wait=secs is held until the document changes
+	VAR(statuswait, 0, 30, 300); // longest ?wait= in seconds, 0 to answer at once
+	VAR(statuswaiters, 0, 256, 65536); // requests that may wait at once
+	static int statusepoch = 0, statusbuilt = -1, statusmaxclients = -1, statuslen = 0;
+	static demoblock *statusdoc = NULL;
+	static string statusetag;
+
+	struct statuswaiter {
+		evhttp_request *req;
+		evhttp_connection *conn;
+		int epoch;
+		int64_t deadline;
+	};
+	vector<statuswaiter *> waiters;
+
+	void statuschanged() { statusepoch++; }
+
+	static void buildstatus() {
+		if(statusmaxclients != maxclients) { statusmaxclients = maxclients; statusepoch++; }
+		if(statusbuilt == statusepoch) return;
+		evbuffer *buf = evbuffer_new();
+		JSON::Writer w(buf, true);
+		w.beginobject();
+		w.member("map", smapname);
+		w.member("mode", gamemode);
+		w.member("modename", modename(gamemode));
+		w.member("maxclients", maxclients);
+		w.key("clients");
+		w.beginarray();
+		loopv(clients) {
+			int cn = clients[i]->clientnum;
+			w.beginobject();
+			w.member("name", clients[i]->name);
+			w.member("cn", cn);
+			w.member("ip", getclientipstr(cn));
+			w.member("host", getclienthostname(cn));
+			w.endobject();
+		}
+		w.endarray();
+		w.endobject();
+		if(statusdoc && --statusdoc->refs <= 0) free(statusdoc);
+		statuslen = evbuffer_get_length(buf);
+		statusdoc = (demoblock *)malloc(sizeof(demoblock) + statuslen);
+		statusdoc->refs = 1; // the cache's own
+		evbuffer_remove(buf, statusdoc->data, statuslen);
+		evbuffer_free(buf);
+		statusbuilt = statusepoch;
+		static time_t boot = time(NULL); // tags from an earlier run never match
+		formatstring(statusetag)("\"%x-%x\"", uint(boot), statusepoch);
+	}
+
+	static void sendstatus(evhttp_request *req, bool modified) {
+		evkeyvalq *oh = evhttp_request_get_output_headers(req);
+		evhttp_add_header(oh, "Content-type", "application/json");
+		evhttp_add_header(oh, "ETag", statusetag);
+		evhttp_add_header(oh, "Cache-Control", "no-cache");
+		if(!modified) { evhttp_send_reply(req, 304, "Not Modified", NULL); return; }
+		evbuffer *buf = evbuffer_new();
+		statusdoc->refs++;
+		evbuffer_add_reference(buf, statusdoc->data, statuslen, demoblock_unref, statusdoc);
+		evhttp_send_reply(req, 200, "OK", buf);
+		evbuffer_free(buf);
+	}
+
+	static void statuswaiter_closecb(evhttp_connection *conn, void *arg) {
+		statuswaiter *w = (statuswaiter *)arg;
+		waiters.removeobj(w);
+		delete w;
+	}
+
+	void statusrequest(evhttp_request *req, const char *wait) {
+		buildstatus();
+		const char *inm = evhttp_find_header(evhttp_request_get_input_headers(req), "If-None-Match");
+		if(!inm || !strstr(inm, statusetag)) { sendstatus(req, true); return; }
+		int secs = wait ? min(atoi(wait), statuswait) : 0;
+		if(secs <= 0 || waiters.length() >= statuswaiters) { sendstatus(req, false); return; }
+		statuswaiter *w = new statuswaiter;
+		w->req = req;
+		w->conn = evhttp_request_get_connection(req);
+		w->epoch = statusbuilt;
+		w->deadline = totalmillis + secs*1000LL;
+		evhttp_connection_set_closecb(w->conn, statuswaiter_closecb, w);
+		waiters.add(w);
+	}
+
+	// answers the waiters whose document changed or whose wait ran out
+	void updatestatuswaiters() {
+		if(waiters.empty()) return;
+		if(statusepoch != statusbuilt) buildstatus();
+		loopv(waiters) {
+			statuswaiter *w = waiters[i];
+			bool modified = w->epoch != statusbuilt;
+			if(!modified && totalmillis < w->deadline) continue;
+			evhttp_connection_set_closecb(w->conn, NULL, NULL);
+			sendstatus(w->req, modified);
+			delete w;
+			waiters.remove(i--);
+		}
+	}
+
+	// /scriptprofile?pass=...: the script profiler's table as json, or with &folded=1 its
+	// stacks as text for flamegraph.pl
+	static void scriptprofilecb(evhttp_request *req, void *arg) {
+		evkeyvalq query;
+		evhttp_parse_query(evhttp_request_get_uri(req), &query);
+		const char *q_pass = evhttp_find_header(&query, "pass");
+		const char *q_folded = evhttp_find_header(&query, "folded");
+		bool folded = q_folded && atoi(q_folded);
+		evbuffer *buf = evbuffer_new();
+		if(!q_pass) jsonmessage(buf, "error", "password not specified");
+		else if(!adminpass[0] || strcmp(q_pass, adminpass)) jsonmessage(buf, "error", "bad password");
+		else if(folded) {
+			evhttp_add_header(evhttp_request_get_output_headers(req), "Content-type", "text/plain");
+			vector<char> stacks;
+			getscriptstacks(stacks);
+			evbuffer_add(buf, stacks.getbuf(), stacks.length());
+		} else {
+			vector<scriptprofentry> profs;
+			getscriptprofile(profs);
+			JSON::Writer w(buf, true);
+			w.beginobject();
+			w.member("enabled", getvar("scriptprofile"));
+			w.key("calls");
+			w.beginarray();
+			loopv(profs) {
+				w.beginobject();
+				w.member("name", profs[i].name);
+				w.member("calls", profs[i].calls);
+				w.member("self_us", (long long)profs[i].self);
+				w.member("total_us", (long long)profs[i].total);
+				w.endobject();
+			}
+			w.endarray();
+			w.endobject();
+		}
+		evhttp_clear_headers(&query);
+		if(!evhttp_find_header(evhttp_request_get_output_headers(req), "Content-type"))
+			evhttp_add_header(evhttp_request_get_output_headers(req), "Content-type", "application/json");
+		evhttp_send_reply(req, 200, "OK", buf);
+		evbuffer_free(buf);
+	}
+
+	// lines relayed from one address in the current second
+	struct relaychatsource {
+		string addr;
+		int64_t second;
+		int lines;
+	};
+	vector<relaychatsource> relaychatsources;
+
+	static bool relaychatallowed(evhttp_request *req) {
+		char *addr = NULL;
+		ev_uint16_t port;
+		evhttp_connection_get_peer(evhttp_request_get_connection(req), &addr, &port);
+		if(!addr) return false;
+		int64_t second = totalmillis / 1000;
+		relaychatsource *src = NULL;
+		loopv(relaychatsources) {
+			if(relaychatsources[i].second < second) { relaychatsources.remove(i--); continue; }
+			if(!strcmp(relaychatsources[i].addr, addr)) src = &relaychatsources[i];
+		}
+		if(!src) {
+			src = &relaychatsources.add();
+			copystring(src->addr, addr);
+			src->second = second;
+			src->lines = 0;
+		}
+		return ++src->lines <= relaychatrate;
+	}
+
+	void relaysay(const char *name, const char *text);
+	static void relaysaycb(evhttp_request *req, void *arg) {
+		evkeyvalq query;
+		evhttp_parse_query(evhttp_request_get_uri(req), &query);
+		const char *q_pass = evhttp_find_header(&query, "pass");
+		const char *q_name = evhttp_find_header(&query, "name");
+		const char *q_text = evhttp_find_header(&query, "text");
+		if(!relaychatpass[0] || !q_pass || strcmp(q_pass, relaychatpass)) evhttp_send_error(req, 403, "Forbidden");
+		else if(!q_name || !q_text) evhttp_send_error(req, 400, "Bad request");
+		else if(!relaychatallowed(req)) evhttp_send_error(req, 429, "Too many requests");
+		else {
+			relaysay(q_name, q_text);
+			evhttp_send_reply(req, 200, "OK", NULL);
+		}
+		evhttp_clear_headers(&query);
+	}
+
+	struct evhttp *http = NULL;
 	void http_init(int port) {
 		http = evhttp_new(evbase);
 		evhttp_bind_socket(http, NULL, httpport);
 		evhttp_set_cb(http, "/", httpcb, NULL);
+		evhttp_set_cb(http, "/demo", demostreamcb, NULL);
+		evhttp_set_cb(http, "/savedemo", savedemocb, NULL);
+		evhttp_set_cb(http, "/scriptprofile", scriptprofilecb, NULL);
 		evhttp_set_gencb(http, http404cb, NULL);
+		setrelaychat();
 		printf("HTTP server up.\n");
 	}
 
+	void setrelaychat() {
+		if(!http) return;
+		evhttp_del_cb(http, "/relaysay");
+		if(relaychatpass[0]) evhttp_set_cb(http, "/relaysay", relaysaycb, NULL);
+	}
+
+	void relayrestart(int secs);
 	void ircmsgcb(IRC::Source *source, char *msg);
 	void ircactioncb(IRC::Source *source, char *msg) {
 		string buf, buf2;
@@ -1130,6 +2044,9 @@ namespace server
 		}
 	}
 
+	void loadbans();
+	void attachregistry();
+
 	void serverinit()
 	{
 		smapname[0] = '\0';
@@ -1145,13 +2062,21 @@ namespace server
 		execfile("stdlib.cfg", false);
 		persistidents=true;
 		execfile("logins.cfg", false);
+		loadbans();
+		int banlive = bandb.live;
 		execfile("config.cfg", false);
+		if(bandb.live > banlive) writecfg(); // an older config.cfg listed them, move them over once
+		if(sharedregistry[0]) attachregistry();
+		if(!countriesloaded()) printf("No country table loaded, player countries are not shown. Set countryfile to a GeoIP country csv to show them\n");
 		irc.channel_message_cb = irc.private_message_cb = ircmsgcb;
 		irc.channel_action_message_cb = irc.private_action_message_cb = ircactioncb;
 		irc.notice_cb = irc.motd_cb = ircnoticecb;
 		irc.ping_cb = ircpingcb;
 		irc.join_cb = ircjoincb;
 		irc.part_cb = ircpartcb;
+
+		if(relayupstream[0]) relayrestart(0);
+		resizedemoring();
 	}
 
 	int numclients(int exclude = -1, bool nospec = true, bool noai = true)
@@ -1216,6 +2141,7 @@ namespace server
 		sents[i].spawntime = spawntime(sents[i].type);
 		sendf(-1, 1, "ri3", SV_ITEMACC, i, sender);
 		ci->state.pickup(sents[i].type);
+		logevent(GE_PICKUP, ci, NULL, 0, i, sents[i].type);
 		return true;
 	}
 
@@ -1322,6 +2248,8 @@ namespace server
 	void recordpacket(int chan, void *data, int len)
 	{
 		writedemo(chan, data, len);
+		demostreampacket(chan, data, len);
+		demoringpacket(chan, data, len);
 	}
 
 	void enddemorecord()
@@ -1495,6 +2423,156 @@ namespace server
 		}
 	}
 
+	evhttp_connection *relayconn = NULL;
+	bool relaygotheader = false, relayrestarting = false;
+	event relaytimer;
+
+	static void relaysend(clientinfo *ci, int chan, const uchar *data, int len) {
+		if(!len) return;
+		ENetPacket *packet = enet_packet_create(data, len, chan ? ENET_PACKET_FLAG_RELIABLE : 0);
+		sendpacket(ci->clientnum, chan, packet);
+		if(!packet->referenceCount) enet_packet_destroy(packet);
+	}
+
+	static void relaysync(clientinfo *ci) {
+		sendf(ci->clientnum, 1, "ri3", SV_DEMOPLAYBACK, 1, -1);
+		relaysend(ci, 1, relaywelcome.getbuf(), relaywelcome.length());
+		relaysend(ci, 1, relaymessages.getbuf(), relaymessages.length());
+		ci->relaysynced = true;
+	}
+
+	void relayrestart(int secs);
+	static void relaypacket(int chan, uchar *data, int len) {
+		if(!relaywelcome.length()) { // the first record of the feed is the upstream welcome state
+			relaywelcome.put(data, len);
+			loopv(clients) if(clients[i]->connected) relaysync(clients[i]);
+			return;
+		}
+		if(chan == 1) {
+			relaymessages.put(data, len);
+			if(relaymessages.length() > relayjournal*1024) {
+				echo("\f1Relay journal full, resyncing with upstream");
+				relayrestart(0);
+			}
+		}
+		ENetPacket *packet = enet_packet_create(data, len, chan ? ENET_PACKET_FLAG_RELIABLE : 0);
+		loopv(clients) if(clients[i]->relaysynced) sendpacket(clients[i]->clientnum, chan, packet);
+		if(!packet->referenceCount) enet_packet_destroy(packet);
+		recordpacket(chan, data, len);
+	}
+
+	static void relaychunkcb(evhttp_request *req, void *arg) {
+		evbuffer *in = evhttp_request_get_input_buffer(req);
+		if(relayrestarting) { evbuffer_drain(in, evbuffer_get_length(in)); return; }
+		if(!relaygotheader) {
+			if(evbuffer_get_length(in) < sizeof(demoheader)) return;
+			demoheader hdr;
+			evbuffer_remove(in, &hdr, sizeof(hdr));
+			lilswap(&hdr.version, 2);
+			if(memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic)) || hdr.version!=DEMO_VERSION || hdr.protocol!=PROTOCOL_VERSION) {
+				echo("\f3Relay: upstream feed is not a compatible demo stream");
+				relayrestart(30);
+				return;
+			}
+			relaygotheader = true;
+		}
+		for(;;) {
+			int stamp[3];
+			if(evbuffer_copyout(in, stamp, sizeof(stamp)) < (int)sizeof(stamp)) break;
+			lilswap(stamp, 3);
+			int chan = stamp[1], len = stamp[2];
+			if(chan < 0 || chan > 1 || len < 0 || len > 16*1024*1024) {
+				echo("\f3Relay: corrupt upstream feed");
+				relayrestart(5);
+				return;
+			}
+			if(evbuffer_get_length(in) < sizeof(stamp) + len) break;
+			evbuffer_drain(in, sizeof(stamp));
+			relaypacket(chan, evbuffer_pullup(in, len), len);
+			evbuffer_drain(in, len);
+			if(relayrestarting) return;
+		}
+	}
+
+	static void relaydonecb(evhttp_request *req, void *arg) {
+		if(relayrestarting) return;
+		echo("\f3Relay: lost upstream %s", relayupstream);
+		relayrestart(5);
+	}
+
+	static void relayconnect() {
+		if(relayconn) { evhttp_connection_free(relayconn); relayconn = NULL; }
+		relayrestarting = false;
+		if(!relayupstream[0]) return;
+		URL url(relayupstream);
+		if(!url.hostname) { echo("\f3Relay: bad upstream url %s", relayupstream); return; }
+
+		relaygotheader = false;
+		relaywelcome.setsizenodelete(0);
+		relaymessages.setsizenodelete(0);
+		demowelcome.setsizenodelete(0);
+		loopv(clients) clients[i]->relaysynced = false;
+
+		relayconn = evhttp_connection_base_new(evbase, dnsbase, url.hostname, url.port ? url.port : 80);
+		evhttp_connection_set_timeout(relayconn, 600);
+		evhttp_request *req = evhttp_request_new(relaydonecb, NULL);
+		evhttp_request_set_chunked_cb(req, relaychunkcb);
+		evhttp_add_header(evhttp_request_get_output_headers(req), "Host", url.hostname);
+		char *epass = evhttp_encode_uri(relaypass);
+		defformatstring(uri)("/demo?pass=%s", epass);
+		free(epass);
+		evhttp_make_request(relayconn, req, EVHTTP_REQ_GET, uri);
+		echo("\f1Relay: following %s", relayupstream);
+	}
+
+	static void relaytimer_cb(evutil_socket_t fd, short what, void *arg) {
+		relayconnect();
+	}
+
+	// never tear down the connection from inside its own callbacks; reconnect from a timer instead
+	void relayrestart(int secs) {
+		relayrestarting = true;
+		static bool inited = false;
+		if(!inited) { evtimer_assign(&relaytimer, evbase, relaytimer_cb, NULL); inited = true; }
+		timeval tv = { secs, 0 };
+		evtimer_add(&relaytimer, &tv);
+	}
+
+	void relaysay(const char *name, const char *text) {
+		string n, t;
+		filtertext(n, name, false, MAXNAMELEN);
+		filtertext(t, text);
+		if(relayupstream[0]) { // chained relay: pass it on
+			if(!relaychatpass[0]) return; // upstream would refuse it
+			char *ename = evhttp_encode_uri(n), *etext = evhttp_encode_uri(t), *epass = evhttp_encode_uri(relaychatpass);
+			defformatstring(url)("%s/relaysay?pass=%s&name=%s&text=%s", relayupstream, epass, ename, etext);
+			free(ename); free(etext); free(epass);
+			froghttp_get(evbase, dnsbase, url, NULL, NULL);
+			return;
+		}
+		message("\f4[relay] \f0%s\f7: %s", n, t);
+		irc.speak(1, "\00314[relay] \00306<%s> \00303%s", n, t);
+	}
+
+	// relay clients only spectate; chat goes upstream, everything else is ignored
+	static void relayparse(clientinfo *ci, packetbuf &p) {
+		char text[MAXTRANS];
+		while(p.remaining()) switch(getint(p)) {
+			case SV_TEXT:
+				getstring(text, p);
+				if(totalmillis - ci->lasttext >= (int64_t)spammillis) ci->spamlines = 0;
+				else if(++ci->spamlines >= maxspam) break;
+				ci->lasttext = totalmillis;
+				relaysay(ci->name, text);
+				break;
+			case SV_PING:
+				sendf(ci->clientnum, 1, "i2", SV_PONG, getint(p));
+				break;
+			default:
+				return;
+		}
+	}
+
 	void stopdemo()
 	{
 		if(m_demo) enddemoplayback();
@@ -1684,6 +2762,319 @@ namespace server
 		}
 	}
 
+	// coop edit journal: every edit relayed since the map was loaded, uploaded or newmapped.
+	// late joiners get it once they have loaded that map. edits that were later fully
+	// overwritten are dropped, unless something in between may have read them.
+	VAR(editjournal, 0, 4096, INT_MAX); // kB of coop edits kept for late joiners. set to 0 to disable
+
+	struct editrecord
+	{
+		int cn, type, off, len;
+		selinfo sel;
+		int args[2]; // ints following the selection, e.g. tex and allfaces for SV_EDITT
+		int ent; // SV_EDITENT
+		char *var; // SV_EDITVAR
+		bool dead;
+	};
+	vector<editrecord> editrecords;
+	vector<uchar> editjournalbuf;
+	int editjournalsent = 0, editjournaldead = 0; // records already broadcast; bytes of dropped records
+	bool editjournalfull = false;
+
+	void reseteditjournal() {
+		loopv(editrecords) DELETEA(editrecords[i].var);
+		editrecords.setsize(0);
+		editjournalbuf.setsize(0);
+		editjournalsent = editjournaldead = 0;
+		editjournalfull = false;
+		loopv(clients) clients[i]->journalend = 0;
+	}
+
+	static inline bool iseditrecord(int type) { return type >= SV_EDITF && type <= SV_DELCUBE; }
+
+	// box touched by a cube edit, grown by a cube to cover face pushes into the neighbours
+	static void editbox(const selinfo &sel, ivec &lo, ivec &hi, int grow) {
+		loopi(3) {
+			lo.v[i] = sel.o.v[i] - grow*sel.grid;
+			hi.v[i] = sel.o.v[i] + (sel.s.v[i] + grow)*sel.grid;
+		}
+	}
+	static bool boxinside(const ivec &alo, const ivec &ahi, const ivec &blo, const ivec &bhi) {
+		loopi(3) if(alo.v[i] < blo.v[i] || ahi.v[i] > bhi.v[i]) return false;
+		return true;
+	}
+	static bool boxoverlap(const ivec &alo, const ivec &ahi, const ivec &blo, const ivec &bhi) {
+		loopi(3) if(ahi.v[i] <= blo.v[i] || alo.v[i] >= bhi.v[i]) return false;
+		return true;
+	}
+
+	static bool overwrites(const editrecord &l, const editrecord &e) {
+		switch(l.type) {
+			case SV_EDITENT: return e.type == SV_EDITENT && e.ent == l.ent;
+			case SV_EDITVAR: return e.type == SV_EDITVAR && !strcmp(e.var, l.var);
+			case SV_EDITT: return e.type == SV_EDITT && e.sel == l.sel && l.args[1] >= e.args[1]; // allfaces covers a single face
+			case SV_DELCUBE:
+				switch(e.type) {
+					case SV_EDITF: case SV_EDITT: case SV_EDITM: case SV_FLIP: case SV_ROTATE: case SV_DELCUBE:
+					{
+						ivec elo, ehi, llo, lhi;
+						editbox(e.sel, elo, ehi, 1);
+						editbox(l.sel, llo, lhi, 0);
+						return boxinside(elo, ehi, llo, lhi);
+					}
+				}
+		}
+		return false;
+	}
+
+	// ops that read cubes and may carry them elsewhere (clipboard, flips, face extrusion)
+	static inline bool movesedits(int type) { return type == SV_COPY || type == SV_FLIP || type == SV_ROTATE || type == SV_EDITF; }
+
+	static void compacteditjournal() {
+		vector<uchar> buf;
+		vector<int> ends;
+		loopv(clients) ends.add(0);
+		int sent = 0, n = 0;
+		loopv(editrecords) {
+			editrecord &r = editrecords[i];
+			if(r.dead) { DELETEA(r.var); continue; }
+			if(i < editjournalsent) sent++;
+			loopvj(clients) if(i < clients[j]->journalend) ends[j]++;
+			int off = buf.length();
+			buf.put(&editjournalbuf[r.off], r.len);
+			r.off = off;
+			editrecords[n++] = r;
+		}
+		editrecords.setsizenodelete(n);
+		editjournalbuf.setsize(0);
+		editjournalbuf.put(buf.getbuf(), buf.length());
+		editjournalsent = sent;
+		editjournaldead = 0;
+		loopv(clients) clients[i]->journalend = ends[i];
+	}
+
+	void journaledit(int cn, const uchar *data, int len) {
+		if(!editjournal || editjournalfull || !m_edit || len <= 0) return;
+		editrecord r;
+		r.cn = cn;
+		r.off = editjournalbuf.length();
+		r.len = len;
+		r.ent = -1;
+		r.var = NULL;
+		r.dead = false;
+		r.args[0] = r.args[1] = 0;
+		ucharbuf p((uchar *)data, len);
+		r.type = getint(p);
+		if(iseditrecord(r.type)) {
+			selinfo &sel = r.sel;
+			sel.o.x = getint(p); sel.o.y = getint(p); sel.o.z = getint(p);
+			sel.s.x = getint(p); sel.s.y = getint(p); sel.s.z = getint(p);
+			sel.grid = getint(p); sel.orient = getint(p);
+			sel.cx = getint(p); sel.cxs = getint(p); sel.cy = getint(p), sel.cys = getint(p);
+			sel.corner = getint(p);
+			loopi(min(2, msgsizelookup(r.type) - 14)) r.args[i] = getint(p);
+		} else if(r.type == SV_EDITENT) r.ent = getint(p);
+		else if(r.type == SV_EDITVAR) {
+			char name[MAXTRANS];
+			getint(p);
+			getstring(name, p);
+			r.var = newstring(name);
+		}
+
+		if(r.type == SV_EDITENT || r.type == SV_EDITVAR || r.type == SV_EDITT || r.type == SV_DELCUBE) {
+			ivec llo, lhi;
+			if(iseditrecord(r.type)) editbox(r.sel, llo, lhi, 0);
+			vector<ivec> barriers; // boxes read by ops between an older edit and this one
+			for(int i = editrecords.length()-1, scanned = 0; i >= 0 && scanned < 4096; i--, scanned++) {
+				editrecord &e = editrecords[i];
+				if(e.dead) continue;
+				if(overwrites(r, e)) {
+					bool read = false;
+					if(iseditrecord(e.type)) {
+						ivec elo, ehi;
+						editbox(e.sel, elo, ehi, 1);
+						for(int j = 0; j < barriers.length(); j += 2) if(boxoverlap(elo, ehi, barriers[j], barriers[j+1])) { read = true; break; }
+					}
+					if(!read) { e.dead = true; editjournaldead += e.len; }
+				}
+				if(iseditrecord(r.type) && iseditrecord(e.type) && movesedits(e.type)) {
+					ivec blo, bhi;
+					editbox(e.sel, blo, bhi, 1);
+					if(!boxinside(blo, bhi, llo, lhi)) {
+						if(barriers.length() >= 64) break;
+						barriers.add(blo);
+						barriers.add(bhi);
+					}
+				}
+			}
+		}
+
+		editrecords.add(r);
+		editjournalbuf.put(data, len);
+		if(editjournaldead*2 > editjournalbuf.length()) compacteditjournal();
+		if(editjournalbuf.length() > editjournal*1024) {
+			if(editjournaldead) compacteditjournal();
+			if(editjournalbuf.length() > editjournal*1024) {
+				reseteditjournal();
+				editjournalfull = true;
+				echo("\f3Coop edit journal is full, late joiners will need /getmap");
+			}
+		}
+	}
+
+	void editjournaldisconnect(int cn) {
+		loopv(editrecords) if(editrecords[i].cn == cn) editrecords[i].cn = -1;
+	}
+
+	static void flushheldmessages(clientinfo *ci) {
+		if(ci->heldmessages.empty()) return;
+		sendpacket(ci->clientnum, 1, enet_packet_create(ci->heldmessages.getbuf(), ci->heldmessages.length(), ENET_PACKET_FLAG_RELIABLE));
+		ci->heldmessages.setsize(0);
+	}
+
+	// a joiner's world messages are held while it loads the map: edits arriving before the load
+	// would be lost with the old map, and the journal must not repeat the ones after it
+	static void holdmessages(clientinfo &ci, const uchar *data, int len) {
+		if(ci.heldmessages.empty()) ci.heldsince = totalmillis;
+		ci.heldmessages.put(data, len);
+		if(ci.heldmessages.length() <= editjournal*1024 && totalmillis - ci.heldsince < 60000) return;
+		ci.journalwait = 0;
+		flushheldmessages(&ci);
+		whisper(ci.clientnum, "\f3Gave up waiting for the map to load, use \f2/getmap\f3 to get the current map");
+	}
+
+	// replay the part of the journal broadcast before the welcome, under the original editor's cn
+	// where possible so their clipboard is right on the joiner's side, then what was held since
+	void sendeditjournal(clientinfo *ci) {
+		if(editjournalfull) {
+			whisper(ci->clientnum, "\f3The edit journal overflowed, use \f2/getmap\f3 to get the current map");
+			flushheldmessages(ci);
+			return;
+		}
+		int carrier = ci->clientnum;
+		loopv(clients) if(clients[i] != ci && clients[i]->state.aitype == AI_NONE) { carrier = clients[i]->clientnum; break; }
+		packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+		vector<uchar> group;
+		int groupcn = -1, n = 0, end = min(ci->journalend, editrecords.length());
+		loopi(end + 1) {
+			int cn = -1;
+			if(i < end) {
+				editrecord &r = editrecords[i];
+				if(r.dead) continue;
+				clientinfo *oi = r.cn >= 0 ? getinfo(r.cn) : NULL;
+				cn = oi && oi->connected && oi != ci ? r.cn : carrier;
+			}
+			if(group.length() && (cn != groupcn || i == end)) {
+				putint(p, SV_CLIENT);
+				putint(p, groupcn);
+				putuint(p, group.length());
+				p.put(group.getbuf(), group.length());
+				group.setsizenodelete(0);
+			}
+			if(i == end) break;
+			groupcn = cn;
+			group.put(&editjournalbuf[editrecords[i].off], editrecords[i].len);
+			n++;
+		}
+		if(n) sendpacket(ci->clientnum, 1, p.finalize());
+		flushheldmessages(ci);
+		if(n) whisper(ci->clientnum, "\f1Sent %d coop edits made since the map was loaded", n);
+	}
+
+	// splice whole records into q until the byte budget is used up, relocating each selection to origin
+	static void spliceedits(editplayback *pb, vector<uchar> &q, const ivec &origin, int budget, int cn) {
+		ucharbuf in(pb->data, pb->len);
+		in.len = pb->pos;
+		int limit = q.length() + budget;
+		while(in.remaining() && q.length() < limit) {
+			int type = getint(in);
+			if(!iseditrecord(type)) { in.len = in.maxlen; break; }
+			ucharbuf out = q.reserve(4*5);
+			putint(out, type);
+			loopj(3) putint(out, origin.v[j] + getint(in));
+			q.addbuf(out);
+			int rest = in.len;
+			loopj(msgsizelookup(type) - 4) getint(in);
+			if(in.overread()) { in.len = in.maxlen; q.setsizenodelete(q.length() - out.len); break; }
+			q.put(&in.buf[rest], in.len - rest);
+			journaledit(cn, &q[q.length() - out.len - (in.len - rest)], out.len + in.len - rest);
+		}
+		pb->pos = in.len;
+	}
+
+	// old text recordings are converted once when loaded
+	static editplayback *convertrecording(stream *f) {
+		vector<uchar> bin;
+		char buf[1024];
+		while(f->getline(buf, sizeof(buf))) {
+			char *t = strtok(buf, "\t\n ");
+			if(!t || !*t) continue;
+			int type = strtol(t, NULL, 0);
+			if(!iseditrecord(type)) continue;
+			ucharbuf b = bin.reserve(5*msgsizelookup(type));
+			putint(b, type);
+			loopj(msgsizelookup(type) - 1) {
+				char *s = strtok(NULL, "\t\n ");
+				putint(b, s && *s ? strtol(s, NULL, 0) : 0);
+			}
+			bin.addbuf(b);
+		}
+		editplayback *pb = new editplayback;
+		pb->len = bin.length();
+		pb->data = new uchar[max(pb->len, 1)];
+		memcpy(pb->data, bin.getbuf(), pb->len);
+		return pb;
+	}
+
+	editplayback *openrecording(const char *file) {
+		int len = 0;
+		uchar *data = mapfile(file, &len);
+		if(!data) return NULL;
+		editrecheader hdr;
+		if(len >= (int)sizeof(hdr)) {
+			memcpy(&hdr, data, sizeof(hdr));
+			lilswap(&hdr.version, 2);
+		}
+		if(len < (int)sizeof(hdr) || memcmp(hdr.magic, EDITREC_MAGIC, sizeof(hdr.magic))) {
+			unmapfile(data, len);
+			stream *f = openfile(file, "r");
+			if(!f) return NULL;
+			editplayback *pb = convertrecording(f);
+			delete f;
+			return pb;
+		}
+		if(hdr.version != EDITREC_VERSION || hdr.protocol != PROTOCOL_VERSION) { unmapfile(data, len); return NULL; }
+		editplayback *pb = new editplayback;
+		pb->data = data;
+		pb->len = len;
+		pb->pos = sizeof(hdr);
+		pb->mapped = true;
+		return pb;
+	}
+
+	// the recording is created under a temporary name and renamed over the old file, so a
+	// playback that has the old file mapped keeps its own copy instead of being truncated
+	// (windows reads playbacks into memory instead, and cannot rename an open file)
+	stream *createrecording(const char *file, const ivec &origin) {
+#ifdef WIN32
+		stream *f = openfile(file, "wb");
+		if(!f) return NULL;
+#else
+		defformatstring(tmp)("%s.tmp", file);
+		stream *f = openfile(tmp, "wb");
+		if(!f) return NULL;
+		if(!replacefile(tmp, file)) { delete f; return NULL; }
+#endif
+		editrecheader hdr;
+		memcpy(hdr.magic, EDITREC_MAGIC, sizeof(hdr.magic));
+		hdr.version = EDITREC_VERSION;
+		hdr.protocol = PROTOCOL_VERSION;
+		loopi(3) hdr.origin[i] = origin.v[i];
+		lilswap(&hdr.version, 5);
+		f->write(&hdr, sizeof(hdr));
+		return f;
+	}
+
 	void addeditcommands(worldstate &ws) {
 		if(totalmillis - lastplaybackmillis < (int64_t)playbackmillis) return; // limit playback speed to avoid lag
 		lastplaybackmillis = totalmillis;
@@ -1691,7 +3082,6 @@ namespace server
 		int goodcn = -1;
 
 		vector <uchar> q;
-		ucharbuf qb = q.reserve(64);
 
 		loopv(clients) {
 			int cn = clients[i]->clientnum;
@@ -1699,39 +3089,15 @@ namespace server
 			if(goodcn < 0) goodcn = cn; // find a good cn
 
 			if(clients[i]->playing) {
-				char buf[1024] = "";
-
-				clients[i]->playing->getline(buf, sizeof(buf));
-
-				char *t = strtok(buf, "\t\n ");
-				if(t && *t) {
-					int type = strtol(t, NULL, 0);
-					putint(qb, type);
-					int nrest = msgsizelookup(type) - 4;
-					loopj(3) {
-						char *s = strtok(NULL, "\t\n ");
-						if(s && *s) {
-							int w = clients[i]->playorigin.v[j];
-							int v = strtol(s, NULL, 0);
-							putint(qb, w + v);
-						}
-					}
-					loopj(nrest) {
-						char *s = strtok(NULL, "\t\n ");
-//						printf("j %d s %s\n", j, s);
-						if(s && *s) putint(qb, strtol(s, NULL, 0));
-//						else printf("s %p type %d j %d\n", s, type, j);
-					}
-				}
+				spliceedits(clients[i]->playing, q, clients[i]->playorigin, playbackbytes, goodcn);
 
-				if(clients[i]->playing->end()) {
+				if(clients[i]->playing->pos >= clients[i]->playing->len) {
 					DELETEP(clients[i]->playing);
 					whisper(cn, "Finished playing.");
 				}
 			}
 		}
 
-		q.addbuf(qb);
 
 		if(q.length() > 0) {
 			ucharbuf p = ws.messages.reserve(64);
@@ -1772,6 +3138,7 @@ namespace server
 
 		//vampi
 		addeditcommands(ws);
+		editjournalsent = editrecords.length(); // everything journalled so far goes out with this worldstate
 
 		int psize = ws.positions.length(), msize = ws.messages.length();
 		if(psize) recordpacket(0, ws.positions.getbuf(), psize);
@@ -1796,9 +3163,10 @@ namespace server
 
 			if(msize && (ci.msgoff<0 || msize-ci.msglen>0))
 			{
-				packet = enet_packet_create(&ws.messages[ci.msgoff<0 ? 0 : ci.msgoff+ci.msglen],
-											ci.msgoff<0 ? msize : msize-ci.msglen,
-											(reliablemessages ? ENET_PACKET_FLAG_RELIABLE : 0) | ENET_PACKET_FLAG_NO_ALLOCATE);
+				uchar *data = &ws.messages[ci.msgoff<0 ? 0 : ci.msgoff+ci.msglen];
+				int len = ci.msgoff<0 ? msize : msize-ci.msglen;
+				if(ci.journalwait > 0) { holdmessages(ci, data, len); continue; }
+				packet = enet_packet_create(data, len, (reliablemessages ? ENET_PACKET_FLAG_RELIABLE : 0) | ENET_PACKET_FLAG_NO_ALLOCATE);
 				sendpacket(ci.clientnum, 1, packet);
 				if(!packet->referenceCount) enet_packet_destroy(packet);
 				else { ++ws.uses; packet->freeCallback = cleanworldstate; }
@@ -1898,9 +3266,14 @@ namespace server
 		}
 	}
 
+	bool welcomehasmap(clientinfo *ci)
+	{
+		return (m_edit && (clients.length()>1 || (ci && ci->local))) || (smapname[0] && (minremain>0 || (ci && ci->state.state==CS_SPECTATOR) || numclients(ci && ci->local ? ci->clientnum : -1)));
+	}
+
 	int welcomepacket(packetbuf &p, clientinfo *ci)
 	{
-		int hasmap = (m_edit && (clients.length()>1 || (ci && ci->local))) || (smapname[0] && (minremain>0 || (ci && ci->state.state==CS_SPECTATOR) || numclients(ci && ci->local ? ci->clientnum : -1)));
+		int hasmap = welcomehasmap(ci) ? 1 : 0;
 		putint(p, SV_WELCOME);
 		putint(p, hasmap);
 		if(hasmap)
@@ -2026,9 +3399,12 @@ namespace server
 		gamelimit = minremain*60000;
 		interm = 0;
 		copystring(smapname, s);
+		logevent(GE_MAP, NULL, mode, 0, smapname);
+		statuschanged();
 		resetitems();
 		notgotitems = true;
 		scores.setsize(0);
+		reseteditjournal();
 		loopv(clients)
 		{
 			clientinfo *ci = clients[i];
@@ -2164,7 +3540,21 @@ namespace server
 			interm = gamemillis+10000;
 			if(clients.length() > 0) {
 				irc.speak(2, "\00312Intermission.");
-				if(webhook[0]) {
+				if(webhook[0] && webhookjson) {
+					if(JSON::Writer *w = beginwebhook("intermission")) {
+						w->key("players");
+						w->beginarray();
+						loopv(clients) {
+							w->beginobject();
+							w->member("name", clients[i]->name);
+							w->member("frags", clients[i]->state.frags);
+							w->member("deaths", clients[i]->state.deaths);
+							w->endobject();
+						}
+						w->endarray();
+						endwebhook();
+					}
+				} else if(webhook[0]) {
 					char *url = (char *)malloc(strlen(webhook) + strlen("?action=intermission") + 1);
 					if(url) {
 						sprintf(url, "%s?action=intermission", webhook);
@@ -2180,7 +3570,7 @@ namespace server
 							}
 						}
 						if(url) {
-							printf("getting %s\n", url);
+							logdebug("getting %s", url);
 							froghttp_get(evbase, dnsbase, url, NULL, NULL);
 							free(url);
 						}
@@ -2217,6 +3607,7 @@ namespace server
 		ts.dodamage(damage);
 		actor->state.damage += damage;
 		sendf(-1, 1, "ri6", SV_DAMAGE, target->clientnum, actor->clientnum, damage, ts.armour, ts.health);
+		logevent(GE_DAMAGE, actor, target, gun, damage, ts.health);
 		if(target!=actor && !hitpush.iszero())
 		{
 			ivec v = vec(hitpush).rescale(DNF);
@@ -2243,6 +3634,16 @@ namespace server
 				actor->state.lastfragmillis = totalmillis;
 			}
 			sendf(-1, 1, "ri4", SV_DIED, target->clientnum, actor->clientnum, actor->state.frags);
+			logevent(GE_KILL, actor, target, gun, actor->state.frags);
+			if(webhook[0] && webhookjson && webhookbatch) {
+				if(JSON::Writer *w = beginwebhook("frag")) {
+					w->member("actor", actor->name);
+					w->member("target", target->name);
+					w->member("gun", gun);
+					w->member("frags", actor->state.frags);
+					endwebhook();
+				}
+			}
 			if(!firstblood && actor != target) { firstblood = true; message("\f2%s drew \f6FIRST BLOOD!!!", colorname(actor)); }
 			if(actor != target) actor->state.spreefrags++;
 			if(target->state.spreefrags >= minspreefrags) {
@@ -2273,6 +3674,7 @@ namespace server
 		ci->state.frags += smode ? smode->fragvalue(ci, ci) : -1;
 		ci->state.deaths++;
 		sendf(-1, 1, "ri4", SV_DIED, ci->clientnum, ci->clientnum, gs.frags);
+		logevent(GE_SUICIDE, ci);
 		if(gs.spreefrags >= 5) message("\f2%s was looking good until he killed himself", colorname(ci));
 		gs.spreefrags = 0;
 		gs.multifrags = 0;
@@ -2338,6 +3740,7 @@ namespace server
 				int(from.x*DMF), int(from.y*DMF), int(from.z*DMF),
 				int(to.x*DMF), int(to.y*DMF), int(to.z*DMF),
 				ci->ownernum);
+		logevent(GE_SHOT, ci, NULL, gun, 0, 0, &from, &to);
 		gs.shotdamage += guns[gun].damage*(gs.quadmillis ? 4 : 1)*(gun==GUN_SG ? SGRAYS : 1);
 		switch(gun)
 		{
@@ -2437,6 +3840,8 @@ namespace server
 	{
 		if(!gamepaused) gamemillis += curtime;
 
+		finishjobs();
+
 		if(m_demo) readdemo();
 		else if(!gamepaused && minremain>0)
 		{
@@ -2472,6 +3877,9 @@ namespace server
 			masterupdate = false;
 		}
 
+		updatestatuswaiters();
+		if(webhookwriter && webhookbatched && totalmillis - webhookopened >= webhookbatch) flushwebhook();
+
 		if(!gamepaused && m_timed && smapname[0] && gamemillis-curtime>0 && gamemillis/60000!=(gamemillis-curtime)/60000) checkintermission();
 		if(interm && gamemillis>interm)
 		{
@@ -2567,6 +3975,7 @@ namespace server
 	}
 
 	void clearbans();
+	matchset &banset();
 	void noclients()
 	{
 		clearbans();
@@ -2607,16 +4016,26 @@ namespace server
 
 	void clientdisconnect(int n, int reason) {
 		clientinfo *ci = getinfo(n);
+		ci->cancelauth();
 		if(ci->connected) {
+			logevent(GE_DISCONNECT, ci, NULL, 0, reason);
 			if(ci->privilege) setmaster(ci, false);
 			if(smode) smode->leavegame(ci, true);
 			ci->state.timeplayed += lastmillis - ci->state.lasttimeplayed;
 			savescore(ci);
-			sendf(-1, 1, "ri2", SV_CDIS, n);
+			if(!relayupstream[0]) sendf(-1, 1, "ri2", SV_CDIS, n); // relay viewers are invisible to each other
+			editjournaldisconnect(n);
 			if(ci->name[0]) {
 				irc.speak(1, "\00312Disconnect: \00306%s", ci->name);
 				echo("\f1Disconnect: \f0%s", ci->name);
-				if(webhook[0]) {
+				if(webhook[0] && webhookjson) {
+					if(JSON::Writer *w = beginwebhook("disconnect")) {
+						w->member("name", ci->name);
+						w->member("ip", getclientipstr(ci->clientnum));
+						w->member("reason", disc_reasons[reason]);
+						endwebhook();
+					}
+				} else if(webhook[0]) {
 					char *ereason = evhttp_encode_uri(disc_reasons[reason]);
 					defformatstring(url)("%s?action=disconnect&ip=%s&reason=%s", webhook, getclientipstr(ci->clientnum), ereason);
 					free(ereason);
@@ -2625,6 +4044,7 @@ namespace server
 			}
 
 			clients.removeobj(ci);
+			statuschanged();
 			aiman::removeai(ci);
 			if(!numclients(-1, false, true)) noclients(); // bans clear when server empties
 		}
@@ -2646,9 +4066,7 @@ namespace server
 		if(numclients(-1, false, true)>=maxclients) return DISC_MAXCLIENTS;
 		uint ip = getclientip(ci->clientnum);
 		//wildcard matching:
-		loopv(bans)
-			if(!fnmatch(bans[i].match, getclientipstr(ci->clientnum), 0) ||
-			   !fnmatch(bans[i].match, ci->name, 0)) return DISC_IPBAN;
+		if(banset().matchip(ip) || banset().match(ci->name)) return DISC_IPBAN;
 		
 		int priv = PRIV_NONE;
 		loopv(clients) if(clients[i]->privilege > priv) priv = clients[i]->privilege;
@@ -2690,13 +4108,107 @@ namespace server
 		sendf(ci->clientnum, 1, "risis", SV_AUTHCHAL, "", id, val);
 	}
 
+	// /auth keys this server checks itself; these names never go to the master server
+	struct authkey {
+		string name, pubkey;
+	};
+	vector<authkey> authkeys;
+
+	authkey *findauthkey(const char *name) {
+		loopv(authkeys) if(!strcmp(authkeys[i].name, name)) return &authkeys[i];
+		return NULL;
+	}
+
+	ICOMMAND(addauthkey, "ss", (char *name, char *pubkey), {
+		CHECK_PERM;
+		string fname;
+		filtertext(fname, name, false, 100);
+		authkey *k = findauthkey(fname);
+		if(!k) { k = &authkeys.add(); copystring(k->name, fname); }
+		copystring(k->pubkey, pubkey);
+	});
+	ICOMMAND(clearauthkeys, "", (), { CHECK_PERM; authkeys.setsize(0); });
+
+	// the ecc work for a local key runs on the worker threads. a client has one job at
+	// most, and disconnecting cancels it (clientinfo::cancelauth)
+	struct authchaljob : workjob {
+		int cn;
+		uint id;
+		string pubkey;
+		uint seed[4];
+		vector<char> challenge;
+		void *answer;
+
+		authchaljob(clientinfo *ci, const char *key) : cn(ci->clientnum), id(ci->authreq), answer(NULL) {
+			copystring(pubkey, key);
+			loopi(3) seed[i] = randomMT();
+			seed[3] = uint(totalmillis);
+		}
+		~authchaljob() { if(answer) freechallenge(answer); }
+
+		void work() {
+			// anyone who can guess the seed can answer without the private key
+			uint r[3];
+			FILE *f = fopen("/dev/urandom", "rb");
+			if(f) {
+				if(fread(r, sizeof(uint), 3, f) == 3) loopi(3) seed[i] ^= r[i];
+				fclose(f);
+			}
+			void *pub = parsepubkey(pubkey);
+			answer = genchallenge(pub, seed, sizeof(seed), challenge);
+			freepubkey(pub);
+		}
+
+		void done() {
+			clientinfo *ci = getinfo(cn);
+			if(!ci || ci->authjob != this) return;
+			ci->authjob = NULL;
+			ci->authanswer = answer;
+			answer = NULL;
+			sendf(ci->clientnum, 1, "risis", SV_AUTHCHAL, "", id, challenge.getbuf());
+		}
+	};
+
+	struct authansjob : workjob {
+		int cn;
+		string val;
+		void *answer;
+		bool ok;
+
+		authansjob(clientinfo *ci, const char *v) : cn(ci->clientnum), answer(ci->authanswer), ok(false) {
+			copystring(val, v);
+			ci->authanswer = NULL;
+		}
+		~authansjob() { freechallenge(answer); }
+
+		void work() { ok = checkchallenge(val, answer); }
+
+		void done() {
+			clientinfo *ci = getinfo(cn);
+			if(!ci || ci->authjob != this) return;
+			ci->authjob = NULL;
+			ci->authreq = 0;
+			if(ok) setmaster(ci, true, "", ci->authname);
+			else sendf(ci->clientnum, 1, "ris", SV_SERVMSG, "authentication failed");
+		}
+	};
+
 	uint nextauthreq = 0;
 
 	void tryauth(clientinfo *ci, const char *user)
 	{
+		if(ci->authjob) return; // still working on the last one
+		ci->cancelauth();
 		if(!nextauthreq) nextauthreq = 1;
 		ci->authreq = nextauthreq++;
 		filtertext(ci->authname, user, false, 100);
+		authkey *k = findauthkey(ci->authname);
+		if(k)
+		{
+			ci->authjob = new authchaljob(ci, k->pubkey);
+			queuejob(ci->authjob);
+			return;
+		}
 		if(!requestmasterf("reqauth %u %s\n", ci->authreq, ci->authname))
 		{
 			ci->authreq = 0;
@@ -2706,11 +4218,17 @@ namespace server
 
 	void answerchallenge(clientinfo *ci, uint id, char *val)
 	{
-		if(ci->authreq != id) return;
+		if(ci->authreq != id || ci->authjob) return;
 		for(char *s = val; *s; s++)
 		{
 			if(!isxdigit(*s)) { *s = '\0'; break; }
 		}
+		if(ci->authanswer)
+		{
+			ci->authjob = new authansjob(ci, val);
+			queuejob(ci->authjob);
+			return;
+		}
 		if(!requestmasterf("confauth %u %s\n", id, val))
 		{
 			ci->authreq = 0;
@@ -2740,6 +4258,7 @@ namespace server
 		mapdata = opentempfile("mapdata", "w+b");
 		if(!mapdata) { sendf(sender, 1, "ris", SV_SERVMSG, "failed to open temporary file for map"); return; }
 		mapdata->write(data, len);
+		reseteditjournal(); // the upload is the new base for late joiners
 		message("[\f0%s\ff uploaded map to server, type \f2/getmap\ff to receive it]", colorname(ci));
 	}
 
@@ -2819,36 +4338,69 @@ namespace server
 		return n;
 	}
 
+	// the ban list compiled into one matcher; removing a ban just marks it for a rebuild
+	matchset &banset() {
+		if(bansdirty) {
+			banmatch.clear();
+			loopv(bans) banmatch.add(bans[i]->match, bans[i]);
+			bansdirty = false;
+		}
+		return banmatch;
+	}
+
+	void removeban(int i) {
+		ban *b = bans.remove(i);
+		if(evtimer_initialized(&b->tev)) evtimer_del(&b->tev);
+		if(!registrysyncing) hostregistry.remove(REGISTRY_BAN, b->match);
+		delete b;
+		bansdirty = true;
+	}
+
 	void bantimer_cb(int fd, short type, void *arg) {
 		loopv(bans) {
-			if(bans[i].expiry > 0 && get_ticks() >= bans[i].expiry) {
-				if(evtimer_initialized(&bans[i].tev)) evtimer_del(&bans[i].tev);
-				message("Ban \f3%s (%s)\f7 expired.\n", bans[i].match, bans[i].name);
-				bans.remove(i);
+			if(bans[i]->expiry > 0 && get_ticks() >= bans[i]->expiry) {
+				message("Ban \f3%s (%s)\f7 expired.\n", bans[i]->match, bans[i]->name);
+				removeban(i);
 				i--;
 			}
 		}
 	}
 
-	void addban(const char *match, char *name, int btime) {
-		ban &b = bans.add();
-		if(btime > 0) b.expiry = get_ticks() + btime * 60000;
-		else b.expiry = -1; // never expire
-		copystring(b.match, match);
-		if(name) copystring(b.name, name);
-		else b.name[0] = 0;
+	// secs <= 0 never expires
+	ban *insertban(const char *match, const char *name, int secs) {
+		ban *b = new ban;
+		memset(&b->tev, 0, sizeof(b->tev));
+		bans.add(b);
+		if(secs > 0) b->expiry = get_ticks() + secs * 1000LL;
+		else b->expiry = -1; // never expire
+		copystring(b->match, match);
+		if(name) copystring(b->name, name);
+		else b->name[0] = 0;
+		if(!bansdirty) banmatch.add(b->match, b);
+		uint net;
+		int bits;
+		bool ip = matchset::parseip(match, net, bits);
 		loopv(allowedips) {
-			if(!fnmatch(match, ipstr(allowedips[i]), 0)) { allowedips.remove(i); i--; }
+			bool hit;
+			if(ip) hit = !bits || !((ENET_NET_TO_HOST_32(allowedips[i]) ^ net) >> (32 - bits));
+			else hit = !fnmatch(match, ipstr(allowedips[i]), 0);
+			if(hit) { allowedips.remove(i); i--; }
 		}
 
-		if(btime < 0) writecfg();
-		else {
-			evtimer_assign(&b.tev, evbase, &bantimer_cb, &b);
+		if(secs >= 0) {
+			evtimer_assign(&b->tev, evbase, &bantimer_cb, b);
 			struct timeval tv;
-			tv.tv_sec = btime * 60;
+			tv.tv_sec = secs;
 			tv.tv_usec = 0;
-			evtimer_add(&b.tev, &tv);
+			evtimer_add(&b->tev, &tv);
 		}
+		return b;
+	}
+
+	void addban(const char *match, char *name, int btime) {
+		ban *b = insertban(match, name, btime * 60);
+		if(btime < 0) bandb.add(BANLOG_BAN, b->match);
+		hostregistry.put(REGISTRY_BAN, b->match, b->name, NULL, btime > 0 ? time(NULL) + btime * 60 : 0);
 	}
 	ICOMMAND(pban, "s", (char *match), {
 		CHECK_PERM;
@@ -2861,9 +4413,9 @@ namespace server
 	
 	bool delban(char *match) {
 		loopv(bans) {
-			if(!strcmp(match, bans[i].match)) {
-				if(evtimer_initialized(&bans[i].tev)) evtimer_del(&bans[i].tev);
-				bans.remove(i);
+			if(!strcmp(match, bans[i]->match)) {
+				if(bans[i]->expiry < 0) bandb.remove(BANLOG_BAN, match);
+				removeban(i);
 				return true;
 			}
 		}
@@ -2887,9 +4439,8 @@ namespace server
 
 	void clearbans() {
 		loopv(bans) {
-			if(bans[i].expiry >= 0) {
-				if(evtimer_initialized(&bans[i].tev)) evtimer_del(&bans[i].tev);
-				bans.remove(i);
+			if(bans[i]->expiry >= 0) {
+				removeban(i);
 				i--;
 			}
 		}
@@ -2898,6 +4449,124 @@ namespace server
 	}
 	COMMAND(clearbans, "");
 
+	void applybanlog(int kind, const char *match, const char *reason, bool add) {
+		if(kind == BANLOG_BAN) {
+			if(add) addban(match, NULL, -1);
+			else delban((char *)match);
+			return;
+		}
+		noticelist &l = kind == BANLOG_BLACKLIST ? blacklisted : whitelisted;
+		if(add) {
+			notice n;
+			copystring(n.match, match);
+			copystring(n.reason, reason);
+			l.append(n);
+		} else l.drop(match);
+	}
+
+	void dumpbanlog(banlog &log) {
+		loopv(bans) if(bans[i]->expiry < 0) log.add(BANLOG_BAN, bans[i]->match);
+		loopv(blacklisted) log.add(BANLOG_BLACKLIST, blacklisted[i].match, blacklisted[i].reason);
+		loopv(whitelisted) log.add(BANLOG_WHITELIST, whitelisted[i].match, whitelisted[i].reason);
+	}
+
+	// permanent bans and notices live in bans.db instead of config.cfg, so that
+	// startup doesn't run them as script and a change doesn't rewrite the config
+	void loadbans() {
+		int n = bandb.open("bans.db", applybanlog, dumpbanlog);
+		if(n) printf("Loaded %d bans and notices\n", n);
+	}
+
+	void closebans() {
+		bandb.close();
+		hostregistry.detach();
+	}
+
+	event registrytimer;
+
+	static void syncnotices(noticelist &l, hashtable<const char *, registryentry *> &want, bool prune) {
+		vector<char *> stale;
+		loopv(l) {
+			registryentry **e = want.access(l[i].match);
+			if(e ? strcmp((*e)->value, l[i].reason) : prune) stale.add(newstring(l[i].match));
+		}
+		loopv(stale) l.drop(stale[i]);
+		stale.deletecontentsa();
+		hashtable<const char *, int> have(1<<10);
+		loopv(l) have[l[i].match] = i;
+		enumerate(want, registryentry *, e, {
+			if(have.access(e->key)) continue;
+			notice n;
+			copystring(n.match, e->key);
+			copystring(n.reason, e->value);
+			l.append(n);
+		});
+	}
+
+	// make the local lists match the shared table
+	void syncregistry() {
+		vector<registryentry> entries;
+		if(!hostregistry.snapshot(entries)) return;
+		hashtable<const char *, registryentry *> want[REGISTRY_NUMKINDS];
+		loopv(entries) want[entries[i].kind][entries[i].key] = &entries[i];
+
+		// a full table misses some of our entries, so only take additions from it
+		bool prune = !hostregistry.full();
+		static bool warnedfull = false;
+		if(!prune && !warnedfull) conoutf("\f3shared registry %s is full (%d entries), local entries are kept", sharedregistry, hostregistry.capacity());
+		warnedfull = !prune;
+
+		registrysyncing = true;
+		int64_t now = time(NULL);
+		loopv(bans) {
+			registryentry **e = want[REGISTRY_BAN].access(bans[i]->match);
+			if(e ? ((*e)->expiry != 0) != (bans[i]->expiry > 0) : prune) {
+				if(bans[i]->expiry < 0) bandb.remove(BANLOG_BAN, bans[i]->match);
+				removeban(i--);
+			}
+		}
+		hashtable<const char *, ban *> banned(1<<10);
+		loopv(bans) banned[bans[i]->match] = bans[i];
+		enumerate(want[REGISTRY_BAN], registryentry *, e, {
+			if(banned.access(e->key) || (e->expiry && e->expiry <= now)) continue;
+			insertban(e->key, e->value, e->expiry ? int(e->expiry - now) : -1);
+			if(!e->expiry) bandb.add(BANLOG_BAN, e->key);
+		});
+
+		syncnotices(blacklisted, want[REGISTRY_BLACKLIST], prune);
+		syncnotices(whitelisted, want[REGISTRY_WHITELIST], prune);
+
+		if(prune) clearlogins();
+		enumerate(want[REGISTRY_LOGIN], registryentry *, e, setlogin(e->key, e->value, e->extra));
+		registrysyncing = false;
+	}
+
+	static void registrytimer_cb(evutil_socket_t fd, short what, void *arg) {
+		if(hostregistry.changed()) syncregistry();
+		struct timeval tv;
+		tv.tv_sec = sharedregistrypoll / 1000;
+		tv.tv_usec = (sharedregistrypoll % 1000) * 1000;
+		evtimer_add(&registrytimer, &tv);
+	}
+
+	// the first server up seeds the table with its lists, the others take what is there
+	void attachregistry() {
+		bool created;
+		if(!hostregistry.attach(sharedregistry, created, sharedregistrysize)) return;
+		printf("Attached to shared registry %s\n", sharedregistry);
+		if(created) {
+			vector<registryentry> entries;
+			hostregistry.snapshot(entries); // marks the empty table as seen
+			loopv(bans) hostregistry.put(REGISTRY_BAN, bans[i]->match, bans[i]->name, NULL, bans[i]->expiry > 0 ? time(NULL) + (bans[i]->expiry - get_ticks()) / 1000 : 0);
+			loopv(blacklisted) hostregistry.put(REGISTRY_BLACKLIST, blacklisted[i].match, blacklisted[i].reason);
+			loopv(whitelisted) hostregistry.put(REGISTRY_WHITELIST, whitelisted[i].match, whitelisted[i].reason);
+			loopv(logins) hostregistry.put(REGISTRY_LOGIN, logins[i]->user, logins[i]->password, logins[i]->permissions);
+		}
+		syncregistry();
+		evtimer_assign(&registrytimer, evbase, registrytimer_cb, NULL);
+		registrytimer_cb(-1, 0, NULL);
+	}
+
 	void spectator(int val, int cn) {
 		clientinfo *spinfo = (clientinfo *)getclientinfo(cn); // no bots
 		if(!spinfo) return;
@@ -2941,7 +4610,8 @@ namespace server
 
 	void gothostname(void *info) {
 		clientinfo *ci = (clientinfo *)info;
-		loopv(bans) if(!fnmatch(bans[i].match, getclienthostname(ci->clientnum), 0)) { disconnect_client(ci->clientnum, DISC_IPBAN); return; }
+		statuschanged();
+		if(banset().match(getclienthostname(ci->clientnum))) disconnect_client(ci->clientnum, DISC_IPBAN);
 	}
 
 	ICOMMAND(ircconnect, "ssis", (const char *s, const char *n, int *p, const char *a), {
@@ -2953,6 +4623,22 @@ namespace server
 	ICOMMAND(ircpart, "ss", (const char *s, const char *c), {
 		if(s && *s && c && *c) irc.part(s, c);
 	});
+	// most networks allow a burst of about five lines, then one every two seconds
+	VARF(ircburst, 1, 5, 100, irc.burst = ircburst);
+	VARF(irclinemillis, 0, 2000, 60000, irc.linemillis = irclinemillis);
+	VARF(ircqueuelimit, 1, 100, 10000, irc.queuelimit = ircqueuelimit);
+	ICOMMAND(ircqueue, "", (), {
+		for(unsigned int i = 0; i < irc.servers.size(); i++) {
+			IRC::Server *s = irc.servers[i];
+			echo("%s: %d queued (%d replies, %d notices, %d chatter), %lld sent, %lld coalesced, %lld dropped", s->alias, s->queued(),
+				s->queued(IRC::Server::PriorityHigh), s->queued(IRC::Server::PriorityNormal), s->queued(IRC::Server::PriorityLow), s->sent, s->coalesced, s->dropped);
+		}
+	});
+	ICOMMAND(httpstats, "", (), {
+		echo("%d http requests pending, %lld sent, %lld retried, %lld failed, %lld dropped, %lld connections opened (%d idle), %lld dns lookups",
+			httpclient.pending, httpclient.sent, httpclient.retried, httpclient.failed, httpclient.dropped, httpclient.connections, httpclient.idle(), httpclient.lookups);
+		if(webhookwriter && webhookbatched) echo("%d webhook events waiting, %d dropped", webhookevents, webhookdropped);
+	});
 	ICOMMAND(ircecho, "C", (const char *msg), {
 		string buf;
 		color_sauer2irc((char *)msg, buf);
@@ -3018,19 +4704,14 @@ namespace server
 			else if(!strcmp(command, "login")) {
 				string user, pwd;
 				int r = tokenize(c, "ss", user, pwd);
-				if(r >= 2) {
-					string hash;
-					getsha1(pwd, hash);
-					bool good = false;
-					loopvj(logins) {
-						if(!strcasecmp(logins[j].user, user) && !strcasecmp(logins[j].password, hash)) {
-							copystring(scriptircsource->peer->data, logins[j].permissions);
-							message("%s has logged in from IRC", scriptircsource->peer->nick);
-							irc.speak(1, "\00306%s\00314 has logged in", scriptircsource->peer->nick);
-							good = true; break;
-						}
-					}
-					if(!good) source->reply("\00314Invalid login.");
+				defformatstring(who)("irc %s %s", source->server->host, source->peer->nick);
+				if(r >= 1 && !allowlogin(who)) source->reply("\00314Too many login attempts, try again later.");
+				else if(r >= 2) {
+					loginjob *job = new loginjob(user, pwd);
+					copystring(job->ircserver, source->server->host);
+					copystring(job->ircnick, source->peer->nick);
+					copystring(job->ircto, source->channel ? source->channel->name : source->peer->nick);
+					if(!queuelogin(job)) source->reply("\00314Too many logins in progress, try again.");
 				} else if(r == 1) {
 					if(!strcmp(user, adminpass)) {
 						scriptircsource->peer->data[0] = 'a';
@@ -3041,7 +4722,14 @@ namespace server
 				} else scriptircsource->reply("\00314Invalid usage.");
 			} else if(!strcmp(command, "help")) {
 				source->reply("\00314Available commands: \00307who info login");
-			} else if(can_script(scriptircsource)) execute(msg);
+			} else if(can_script(scriptircsource)) {
+				defformatstring(who)("irc %s", source->peer->nick);
+				const char *why = executeguarded(msg, who);
+				if(why) {
+					source->reply("\00304%s", why);
+					conoutf("script from %s stopped: %s", who, why);
+				}
+			}
 		} else {
 			if(source->channel) { // only relay channel messages, not private messages
 				if(fnmatch(ircignore, source->peer->nick, 0)) {
@@ -3053,7 +4741,7 @@ namespace server
 					const char *al = getalias("ircmsgcb");
 					string buf3;
 					escapecubestring(buf3, msg);
-					printf("escaped cube string: [%s]\n", buf3);
+					logdebug("escaped cube string: [%s]", buf3);
 					defformatstring(str)("ircmsgcb \"%s\" \"%s\" \"%s\"", buf3, source->peer->nick, source->channel->name);
 					scriptircsource = source;
 					if(al && *al) execute(str);
@@ -3063,6 +4751,424 @@ namespace server
 		scriptircsource = NULL;
 	}
 
+	// chat commands: "#name args". each is a row of the command table with the least
+	// privilege it needs, its usage (<required> and [optional] arguments), a cost class for
+	// the per-client rate limit and a handler. scripts add rows with frogcommand. names are
+	// found through a perfect hash, rebuilt whenever the table changes.
+	enum { FC_FREE = 0, FC_NORMAL, FC_HEAVY };
+
+	typedef void (*frogcmdfn)(clientinfo *ci, const char *name, char *args);
+
+	struct frogcmd {
+		const char *name;
+		int priv, cost;
+		const char *usage, *help; // help is NULL for alternative names, help lists those under the first
+		frogcmdfn fn;
+		char *script; // alias run by script commands
+	};
+
+	VAR(cmdburst, 1, 5, 100); // normal commands per client and command, refilled at cmdrate a minute
+	VAR(cmdrate, 1, 20, 6000);
+	VAR(heavycmdburst, 1, 2, 100); // for commands that touch files or send maps
+	VAR(heavycmdrate, 1, 4, 6000);
+
+	static vector<frogcmd> frogcmds;
+	static vector<int> frogslots;
+	static uint frogseed = 0, frogmask = 0;
+
+	static frogcmd *findfrogcmd(const char *name);
+
+	static void fc_help(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		if(*c) {
+			for(char *l = c; *l; l++) *l = tolower(*l);
+			frogcmd *cmd = findfrogcmd(c);
+			if(!cmd || ci->privilege < cmd->priv) { whisper(sender, "Unknown command \f6%s\f7.", c); return; }
+			const char *help = cmd->help;
+			loopv(frogcmds) if(!help && frogcmds[i].fn == cmd->fn && frogcmds[i].script == cmd->script) help = frogcmds[i].help;
+			whisper(sender, "\f6%s%s\f2%s\f7: %s", c, cmd->usage[0] ? " " : "", cmd->usage, help && help[0] ? help : "No help available.");
+			return;
+		}
+		whisper(sender, "Type \f6%s\f2 <command>\f7 to see help for a command.", name);
+		static const char * const levels[] = { "Available commands:", "Available master commands:", "Available admin commands:" };
+		for(int priv = PRIV_NONE; priv <= ci->privilege && priv <= PRIV_ADMIN; priv++) {
+			Wrapper w;
+			w.append("%s", levels[priv]);
+			loopv(frogcmds) if(frogcmds[i].priv == priv && frogcmds[i].help) w.append("\f6%s\f7", frogcmds[i].name);
+			if(w.lines.length() && strcmp(w.lines[0].s, levels[priv])) loopv(w.lines) whisper(sender, "%s", w.lines[i].s);
+		}
+	}
+
+	static void fc_info(clientinfo *ci, const char *name, char *c) {
+		execute("info");
+	}
+
+	static void fc_who(clientinfo *ci, const char *name, char *c) {
+		execute("who");
+	}
+
+	static void fc_me(clientinfo *ci, const char *name, char *c) {
+		message("* \f1%s\f7 %s", ci->name, c);
+		irc.speak(1 , "\00306*%s \00303%s", ci->name, c);
+	}
+
+	static void fc_ircsay(clientinfo *ci, const char *name, char *c) {
+		irc.speak(1 , "%s", c); // use %s instead of c directly to avoid attacks: if someone says "ircsay %s", it could make the server crash
+	}
+
+	static void fc_ircme(clientinfo *ci, const char *name, char *c) {
+		irc.speak(1 , "\001ACTION %s\001", c);
+	}
+
+	static void fc_whisper(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		int cn;
+		string str;
+		int r = tokenize(c, "cr", &cn, str);
+
+		if(r < 2) whisper(sender, "Usage: whisper <cn> <message>.");
+		else {
+			if(cn > -1 && cn < MAXCLIENTS) {
+				whisper(cn, "* \f1%s\f7 whispers to you: %s", ci->name, str);
+				clientinfo *to = (clientinfo *)getclientinfo(cn);
+				if(to) whisper(sender, "* Whispered to \f2%s\f7.", to->name);
+			} else whisper(sender, "Incorrect player specified.");
+		}
+	}
+
+	static void fc_bans(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		if(server::bans.length() > 0) {
+			sendf(sender, 1, "ris", SV_SERVMSG, "Bans:");
+			loopv(bans) {
+				if(bans[i]->expiry < 0)
+					whisper(sender, " \f3*\f7 %s %s, permanent", bans[i]->match, bans[i]->name);
+				else whisper(sender, " \f3*\f7 %s %s, expires in %s", bans[i]->match, bans[i]->name, timestr(bans[i]->expiry - get_ticks()));
+			}
+		} else sendf(sender, 1, "ris", SV_SERVMSG, "No banned IPs.");
+	}
+
+	static void fc_uptime(clientinfo *ci, const char *name, char *c) {
+		int connectedseconds = (totalmillis - ci->connectmillis);
+		whisper(ci->clientnum, "This server has been running for \f2%s\f7h.\nYou have been connected to this server for \f2%s\f7h.", timestr(totalmillis), timestr(connectedseconds));
+	}
+
+	static void fc_blacklist(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		notice n;
+		n.reason[0] = 0;
+		int r = tokenize(c, "sr", n.match, n.reason);
+		if(r >= 1) {
+			blacklisted.append(n);
+
+			whisper(sender, "Appended \f2%s\f7 to blacklist.", n.match);
+		} else {
+			if(show_blacklist(sender) < 1)
+				whisper(sender, "Blacklist empty.");
+		}
+	}
+
+	static void fc_unblacklist(clientinfo *ci, const char *name, char *c) {
+		blacklisted.drop(c);
+		whisper(ci->clientnum, "Removed %s from blacklist.", c);
+	}
+
+	static void fc_whitelist(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		notice n;
+		n.reason[0] = 0;
+		int r = tokenize(c, "sr", n.match, n.reason);
+		if(r >= 1) {
+			whitelisted.append(n);
+
+			whisper(sender, "Appended \f2%s\f7 to whitelist.", n.match);
+		} else {
+			if(show_whitelist(sender) < 1)
+				whisper(sender, "Whitelist empty.");
+		}
+	}
+
+	static void fc_unwhitelist(clientinfo *ci, const char *name, char *c) {
+		whitelisted.drop(c);
+		whisper(ci->clientnum, "Removed %s from whitelist.", c);
+	}
+
+	static void fc_damage(clientinfo *ci, const char *name, char *c) {
+		int victim, damage;
+		int r = tokenize(c, "ci", &victim, &damage);
+
+		if(r >= 2) {
+			clientinfo *vi = (clientinfo *)getclientinfo(victim);
+			if(vi) dodamage(vi, ci, damage, GUN_PISTOL);
+		} else whisper(ci->clientnum, "Invalid usage.");
+	}
+
+#ifdef FROGMOD_VERSION
+	static void fc_version(clientinfo *ci, const char *name, char *c) {
+		whisper(ci->clientnum, "Running FrogMod " FROGMOD_VERSION ".");
+	}
+#endif
+
+	// givemaster and giveadmin
+	static void fc_give(clientinfo *ci, const char *name, char *c) {
+		int priv = strcmp(name, "giveadmin") ? PRIV_MASTER : PRIV_ADMIN;
+		int cn;
+		int r = tokenize(c, "c", &cn);
+		if(r >= 1) {
+			clientinfo *ni = (clientinfo *)getclientinfo(cn);
+			if(ni && ci != ni) {
+				ci->privilege = 0;
+				ni->privilege = priv;
+				currentmaster = cn;
+				masterupdate = true;
+				message("\f0%s\f2 gives %s to \f0%s\f2. mastermode remains \f0%s\f2 (\f6%d\f2) ", ci->name, privname(priv), ni->name, mastermodename(mastermode), mastermode);
+				irc.speak(1, "\00306%s\00314 gives %s to \00306%s", ci->name, privname(priv), ni->name);
+			}
+		}
+	}
+
+	static void fc_record(clientinfo *ci, const char *name, char *c) { //record coopedit commands
+		int sender = ci->clientnum;
+		if(m_edit) { //FIXME: check for existing and append .rec extension automatically
+			char buf[1024];
+			sprintf(buf, "%s.rec", c);
+			DELETEP(ci->recording);
+			ci->recording = createrecording(buf, ci->playorigin);
+			if(!ci->recording) {
+				whisper(sender, "Could not start recording %s", c);
+			} else {
+				whisper(sender, "Recording %s...", c);
+			}
+		} else whisper(sender, "Recordings only work in coop edit.");
+	}
+
+	static void fc_recstop(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		if(ci->recording) {
+			DELETEP(ci->recording);
+			whisper(sender, "Stopped recording.");
+		}
+		if(ci->playing) {
+			DELETEP(ci->playing)
+			whisper(sender, "Stopped playing.");
+		}
+	}
+
+	static void fc_recplay(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		if(m_edit) {
+			DELETEP(ci->recording);
+			char buf[1024];
+			sprintf(buf, "%s.rec", c);
+			DELETEP(ci->playing);
+			ci->playing = openrecording(buf); //FIXME: better avoid path attacks?
+			if(ci->playing) whisper(sender, "Playing back %s...", c);
+			else whisper(sender, "Could not find recording \"%s\"", c);
+		} else whisper(sender, "Recordings only work in coop edit.");
+	}
+
+	static void fc_reclist(clientinfo *ci, const char *name, char *c) {
+		int sender = ci->clientnum;
+		glob_t pglob;
+		int r = glob("*?.rec", 0, NULL, &pglob); // at least one char
+
+		if(r == 0) {
+			if(pglob.gl_pathc > 0) {
+				Wrapper w;
+				w.append("\f6Available recordings:\f7");
+				loopi(pglob.gl_pathc) {
+					char *buf = pglob.gl_pathv[i];
+					int l = strlen(buf);
+					buf[l - 4] = 0; // discard .rec extension
+					w.append("\f2%s\f7", buf);
+					w.sep = ", ";
+				}
+				loopv(w.lines) whisper(sender, "%s", w.lines[i].s);
+			} else whisper(sender, "\f6No recordings.");
+			globfree(&pglob);
+		} else if(r == GLOB_NOMATCH) whisper(sender, "\f6No recordings.");
+		else whisper(sender, "\f6Could not list recordings.");
+	}
+
+	static void fc_recdel(clientinfo *ci, const char *name, char *c) { //FIXME: check if file exists
+		char buf[1024];
+		sprintf(buf, "%s.rec", c);
+		unlink(buf);
+		whisper(ci->clientnum, "Recording \"%s\" deleted.", c);
+	}
+
+	static void fc_sendto(clientinfo *ci, const char *name, char *c) {
+		int cn;
+		int r = tokenize(c, "c", &cn);
+		if(r >= 1) {
+			clientinfo *to = (clientinfo *)getclientinfo(cn);
+			if(mapdata && to)
+			{
+				message("\f1Master sending map to \f2%s\f1...", to->name);
+				sendfile(cn, 2, mapdata, "ri", SV_SENDMAP);
+			}
+			else sendf(ci->clientnum, 1, "ris", SV_SERVMSG, "No map to send");
+		}
+	}
+
+	static void fc_login(clientinfo *ci, const char *name, char *c) {
+		string user, pwd;
+		int r = tokenize(c, "ss", user, pwd);
+		if(r >= 1 && !ci->loginpending && !allowlogin(getclientipstr(ci->clientnum))) whisper(ci->clientnum, "Too many login attempts, try again later.");
+		else if(r >= 2) {
+			if(!ci->loginpending) {
+				loginjob *job = new loginjob(user, pwd);
+				job->cn = ci->clientnum;
+				job->sessionid = ci->sessionid;
+				if(queuelogin(job)) ci->loginpending = true;
+				else whisper(ci->clientnum, "Too many logins in progress, try again.");
+			}
+		} else if(r == 1) {
+			if(!strcmp(user, adminpass)) {
+					ci->logged_in = true;
+					copystring(ci->permissions, "a");
+					message("%s has now logged in.", ci->name);
+					irc.speak(1, "\00306%s\00314 has now logged in.", ci->name);
+			}
+		}
+	}
+
+	// runs the alias frogcmd_<name> with the arguments as $arg1, under the script budget
+	static void fc_script(clientinfo *ci, const char *name, char *c) {
+		string arg, escaped;
+		copystring(arg, c, MAXSTRLEN/2);
+		escapecubestring(escaped, arg);
+		defformatstring(cmd)("frogcmd_%s \"%s\"", name, escaped);
+		defformatstring(who)("client %s", getclientipstr(ci->clientnum));
+		const char *why = executeguarded(cmd, who);
+		if(why) {
+			whisper(ci->clientnum, "\f3%s", why);
+			conoutf("script from %s stopped: %s", who, why);
+		}
+	}
+
+	static const frogcmd builtinfrogcmds[] = {
+		{ "help", PRIV_NONE, FC_FREE, "[command]", "Prints this message. Use it without an argument to list available commands.", fc_help },
+		{ "info", PRIV_NONE, FC_NORMAL, "", "Show the information list.", fc_info },
+		{ "uptime", PRIV_NONE, FC_FREE, "", "Show the time you've been connected to this server, and the time the server has been running.", fc_uptime },
+		{ "me", PRIV_NONE, FC_NORMAL, "<text>", "Send a special message (equivalent of /me from IRC).", fc_me },
+		{ "whisper", PRIV_NONE, FC_NORMAL, "<player or clientnum> <message>", "Send a private message to a player.", fc_whisper },
+		{ "bans", PRIV_NONE, FC_NORMAL, "", "Show currently banned IPs and names.", fc_bans },
+		{ "who", PRIV_NONE, FC_NORMAL, "[admin password]", "Show player names and countries, and if the password is provided, IPs too.", fc_who },
+		{ "login", PRIV_NONE, FC_HEAVY, "<user or admin password> [password]", "Log in with a user account, or as admin.", fc_login },
+#ifdef FROGMOD_VERSION
+		{ "version", PRIV_NONE, FC_FREE, "", "Show the version of the server.", fc_version },
+#endif
+		{ "record", PRIV_NONE, FC_HEAVY, "<file>", "Record your coop edit commands.", fc_record },
+		{ "rec", PRIV_NONE, FC_HEAVY, "<file>", NULL, fc_record },
+		{ "recstop", PRIV_NONE, FC_FREE, "", "Stop recording or playing back.", fc_recstop },
+		{ "stoprec", PRIV_NONE, FC_FREE, "", NULL, fc_recstop },
+		{ "recplay", PRIV_NONE, FC_HEAVY, "<file>", "Play back a recording of coop edit commands.", fc_recplay },
+		{ "reclist", PRIV_NONE, FC_HEAVY, "", "List the recordings.", fc_reclist },
+		{ "listrec", PRIV_NONE, FC_HEAVY, "", NULL, fc_reclist },
+		{ "givemaster", PRIV_MASTER, FC_NORMAL, "<player or cn>", "Pass your master to another player.", fc_give },
+		{ "sendto", PRIV_MASTER, FC_HEAVY, "<player or cn>", "Send the map to a player.", fc_sendto },
+		{ "giveadmin", PRIV_ADMIN, FC_NORMAL, "<player or cn>", "Pass your admin to another player.", fc_give },
+		{ "ircsay", PRIV_ADMIN, FC_FREE, "<text>", "Say something on IRC.", fc_ircsay },
+		{ "ircme", PRIV_ADMIN, FC_FREE, "<text>", "Send an action to IRC.", fc_ircme },
+		{ "blacklist", PRIV_ADMIN, FC_FREE, "[IP] [reason]", "Show the blacklist, or add an IP to it, optionally with a reason. When a blacklisted player joins the server, a warning is issued by the server.", fc_blacklist },
+		{ "unblacklist", PRIV_ADMIN, FC_FREE, "<IP>", "Remove an IP from the blacklist.", fc_unblacklist },
+		{ "whitelist", PRIV_ADMIN, FC_FREE, "[IP]", "Show the whitelist, or add an IP to it. Whitelisted players cannot be kicked by master.", fc_whitelist },
+		{ "unwhitelist", PRIV_ADMIN, FC_FREE, "<IP>", "Remove an IP from the whitelist.", fc_unwhitelist },
+		{ "damage", PRIV_ADMIN, FC_FREE, "<player or cn> <damage>", "Damage a player.", fc_damage },
+		{ "recdel", PRIV_ADMIN, FC_FREE, "<file>", "Delete a recording.", fc_recdel },
+	};
+
+	static uint frogcmdhash(const char *s, uint seed) {
+		uint h = 2166136261U ^ seed;
+		for(; *s; s++) h = (h ^ uchar(*s)) * 16777619U;
+		return h ^ (h >> 15);
+	}
+
+	// tries seeds until every name has a slot of its own
+	static void buildfrogcmdhash() {
+		int size = 16;
+		while(size < 4*frogcmds.length()) size *= 2;
+		for(uint seed = 1;; seed++) {
+			if(seed % 1000 == 0) size *= 2;
+			frogslots.setsize(0);
+			loopi(size) frogslots.add(-1);
+			bool collided = false;
+			loopv(frogcmds) {
+				int &slot = frogslots[frogcmdhash(frogcmds[i].name, seed) & (size-1)];
+				if(slot >= 0) { collided = true; break; }
+				slot = i;
+			}
+			if(!collided) { frogseed = seed; frogmask = size-1; return; }
+		}
+	}
+
+	static frogcmd *findfrogcmd(const char *name) {
+		if(frogcmds.empty()) {
+			loopi(sizeof(builtinfrogcmds)/sizeof(builtinfrogcmds[0])) frogcmds.add(builtinfrogcmds[i]);
+			buildfrogcmdhash();
+		}
+		int i = frogslots[frogcmdhash(name, frogseed) & frogmask];
+		return i >= 0 && !strcmp(frogcmds[i].name, name) ? &frogcmds[i] : NULL;
+	}
+
+	// frogcommand name privilege cost usage body: privilege 0 for everyone, 1 master, 2 admin;
+	// cost 0 is not rate limited, 1 normal, 2 heavy. the body gets the arguments as $arg1
+	ICOMMAND(frogcommand, "siiss", (char *name, int *priv, int *cost, char *usage, char *body), {
+		CHECK_PERM;
+		if(!*name) return;
+		for(char *l = name; *l; l++) *l = tolower(*l);
+		frogcmd *cmd = findfrogcmd(name);
+		if(cmd && !cmd->script) { conoutf("\f3%s is a built-in command", name); return; }
+		defformatstring(aliasname)("frogcmd_%s", name);
+		alias(aliasname, body);
+		if(!cmd) {
+			cmd = &frogcmds.add();
+			cmd->name = newstring(name);
+			cmd->help = "";
+			cmd->fn = fc_script;
+			cmd->script = newstring(aliasname);
+		} else delete[] (char *)cmd->usage;
+		cmd->priv = clamp(*priv, int(PRIV_NONE), int(PRIV_ADMIN));
+		cmd->cost = clamp(*cost, int(FC_FREE), int(FC_HEAVY));
+		cmd->usage = newstring(usage);
+		buildfrogcmdhash();
+	});
+
+	ICOMMAND(delfrogcommand, "s", (char *name), {
+		CHECK_PERM;
+		for(char *l = name; *l; l++) *l = tolower(*l);
+		frogcmd *cmd = findfrogcmd(name);
+		if(!cmd || !cmd->script) return;
+		delete[] (char *)cmd->name;
+		delete[] (char *)cmd->usage;
+		delete[] cmd->script;
+		frogcmds.remove(cmd - frogcmds.getbuf());
+		buildfrogcmdhash();
+	});
+
+	// one token bucket per client and command
+	static bool allowfrogcmd(clientinfo *ci, frogcmd *cmd, int &wait) {
+		if(cmd->cost == FC_FREE || ci->privilege >= PRIV_ADMIN) return true;
+		int burst = cmd->cost == FC_HEAVY ? heavycmdburst : cmdburst, perminute = cmd->cost == FC_HEAVY ? heavycmdrate : cmdrate;
+		clientinfo::cmdbucket *b = NULL;
+		loopv(ci->cmdbuckets) if(!strcmp(ci->cmdbuckets[i].name, cmd->name)) { b = &ci->cmdbuckets[i]; break; }
+		if(!b) {
+			b = &ci->cmdbuckets.add();
+			copystring(b->name, cmd->name);
+			b->tokens = burst;
+			b->last = totalmillis;
+		}
+		b->tokens = min(float(burst), b->tokens + (totalmillis - b->last) * perminute / 60000.0f);
+		b->last = totalmillis;
+		if(b->tokens < 1) {
+			wait = int((1 - b->tokens) * 60 / perminute) + 1;
+			return false;
+		}
+		b->tokens--;
+		return true;
+	}
+
 	bool frog_command(char *text, int sender, clientinfo *ci) {
 		char *c = text;
 
@@ -3079,7 +5185,7 @@ namespace server
 		text = c;
 
 		char command[40] = "";
-		for(int i = 0; *c && !isspace(*c) && i < 40; i++, c++) { command[i] = tolower(*c); command[i+1] = 0; }
+		for(int i = 0; *c && !isspace(*c) && i < (int)sizeof(command) - 1; i++, c++) { command[i] = tolower(*c); command[i+1] = 0; }
 
 		c = trim(c);
 
@@ -3088,276 +5194,20 @@ namespace server
 		while(l > 0 && isspace(c[l])) c[l--] = 0; // right trim
 
 		scriptclient = ci;
-		if(!strcmp(command, "help")) {
-			if(*c) {
-				if(!strcmp(c, "help"))
-					whisper(sender, "\f6%s\f7: Prints this message. Use it without an argument to list available commands.", c);
-				else if(!strcmp(c, "uptime"))
-					whisper(sender, "\f6%s\f7: Show the time you've been connected to this server, and the time the server has been running.", c);
-				else if(!strcmp(c, "me"))
-					whisper(sender, "\f6%s \f2<text>\f7: Send a special message (equivalent of /me from IRC).\n", c);
-				else if(!strcmp(c, "whisper"))
-					whisper(sender, "\f6%s \f2<player or clientnum> <message>\f7: Send a private message to a player.\n", c);
-				else if(!strcmp(c, "bans"))
-					whisper(sender, "\f6%s\f7: Show currently banned IPs and names.", c);
-				else if(!strcmp(c, "who"))
-					whisper(sender, "\f6%s \f2[admin password]\f7: Show player names"
-#ifdef HAVE_GEOIP
-					" and countries,"
-#endif
-					" and if the password is provided, IPs too.", c);
-				else if(ci->privilege == PRIV_ADMIN) {
-					if(!strcmp(c, "blacklist")) {
-						whisper(sender, "\f6%s\f7: Show blacklist. When a blacklisted player joins the server, a warning is issued by the server.", c);
-						whisper(sender, "\f6%s\f2 <IP> [reason]\f7: Add an IP to the blacklist, optionally specifying a reason.", c);
-					} else if(!strcmp(c, "unblacklist")) {
-						whisper(sender, "\f6%s\f7: Remove an IP from the blacklist.", frogchar[0], c);
-					} else if(!strcmp(c, "whitelist")) {
-						whisper(sender, "\f6%s\f7: Show whitelist. Whitelisted players cannot be kicked by master.", c);
-						whisper(sender, "\f6%s\f2 <IP>\f7: Add an IP to the whitelist.", c);
-					} else if(!strcmp(c, "unwhitelist")) {
-						whisper(sender, "\f6%s\f7: Remove an IP from the whitelist.", c);
-					} else if(!strcmp(c, "ban")) {
-						whisper(sender, "\f6%s\f2 <IP>\f7: Add an IP to the bans list.", c);
-					} else if(!strcmp(c, "kick")) {
-						whisper(sender, "\f6%s\f2 <player or cn>\f7: Kick a player without banning.", c);
-					} else if(!strcmp(c, "addinfo")) {
-						whisper(sender, "\f6%s\f2 <name> <text>\f7: Add an item to the information list.", c);
-					} else if(!strcmp(c, "delinfo")) {
-						whisper(sender, "\f6%s\f2 <name>\f7: Delete an item from the information list.", c);
-					}
-				}
-			} else {
-				whisper(sender, "Type \f6%s\f2 <command>\f7 to see help for a command.", command);
-				whisper(sender, "Available commands: \f6help info uptime me whisper bans who listbotnames");
-				if(ci->privilege == PRIV_ADMIN) whisper(sender, "Available admin commands: \f6blacklist unblacklist whitelist unwhitelist ban kick ircsay ircme addbotname delbtoname addinfo delinfo");
-			}
-		} else if(!strcmp(command, "info")) {
-			execute("info");
-		} else if(!strcmp(command, "me")) {
-			if(*c) {
-				message("* \f1%s\f7 %s", ci->name, c);
-				irc.speak(1 , "\00306*%s \00303%s", ci->name, c);
-			}
-		} else if(!strcmp(command, "ircsay")) {
-			if(ci->privilege == PRIV_ADMIN && *c) {
-				irc.speak(1 , "%s", c); // use %s instead of c directly to avoid attacks: if someone says "ircsay %s", it could make the server crash
-			}
-		} else if(!strcmp(command, "ircme")) {
-			if(ci->privilege == PRIV_ADMIN && *c) {
-				irc.speak(1 , "\001ACTION %s\001", c); // use %s instead of c directly to avoid attacks: if someone says "ircsay %s", it could make the server crash
-			}
-		} else if(!strcmp(command, "whisper")) {
-			int cn;
-			string str;
-			int r = tokenize(c, "cr", &cn, str);
-
-			if(r < 2) whisper(sender, "Usage: whisper <cn> <message>.");
-			else {
-				if(cn > -1 && cn < MAXCLIENTS) {
-					whisper(cn, "* \f1%s\f7 whispers to you: %s", ci->name, str);
-					clientinfo *to = (clientinfo *)getclientinfo(cn);
-					if(to) whisper(sender, "* Whispered to \f2%s\f7.", to->name);
-				} else whisper(sender, "Incorrect player specified.");
-			}
-		} else if(!strcmp(command, "bans")) {
-			if(server::bans.length() > 0) {
-				sendf(sender, 1, "ris", SV_SERVMSG, "Bans:");
-				loopv(bans) {
-					if(bans[i].expiry < 0)
-						whisper(sender, " \f3*\f7 %s %s, permanent", bans[i].match, bans[i].name);
-					else whisper(sender, " \f3*\f7 %s %s, expires in %s", bans[i].match, bans[i].name, timestr(bans[i].expiry - get_ticks()));
-				}
-			} else sendf(sender, 1, "ris", SV_SERVMSG, "No banned IPs.");
-		} else if(!strcmp(command, "uptime")) {
-				int connectedseconds = (totalmillis - ci->connectmillis);
-				whisper(sender, "This server has been running for \f2%s\f7h.\nYou have been connected to this server for \f2%s\f7h.", timestr(totalmillis), timestr(connectedseconds));
-		} else if(!strcmp(command, "blacklist")) {
-			if(ci->privilege == PRIV_ADMIN) {
-				notice n;
-				n.reason[0] = 0;
-				int r = tokenize(c, "sr", n.match, n.reason);
-				if(r >= 1) {
-					blacklisted.add(n);
-
-					writecfg();
-
-					whisper(sender, "Appended \f2%s\f7 to blacklist.", n.match);
-				} else {
-					if(show_blacklist(sender) < 1)
-						whisper(sender, "Blacklist empty.");
-				}
-			}
-		} else if(!strcmp(command, "unblacklist")) {
-			if(*c && ci->privilege == PRIV_ADMIN) {
-				loopv(blacklisted) if(!strcmp(blacklisted[i].match, c)) { blacklisted.remove(i); i--; }
-				writecfg();
-				whisper(sender, "Removed %s from blacklist.", c);
-			} else whisper(sender, "IP not specified.");
-		} else if(!strcmp(command, "whitelist")) {
-			if(ci->privilege == PRIV_ADMIN) {
-				notice n;
-				n.reason[0] = 0;
-				int r = tokenize(c, "sr", n.match, n.reason);
-				if(r >= 1) {
-					whitelisted.add(n);
-
-					writecfg();
-
-					whisper(sender, "Appended \f2%s\f7 to whitelist.", n.match);
-				} else {
-					if(show_whitelist(sender) < 1)
-						whisper(sender, "Whitelist empty.");
-				}
-			}
-		} else if(!strcmp(command, "unwhitelist")) {
-			if(*c && ci->privilege == PRIV_ADMIN) {
-				loopv(whitelisted) if(!strcmp(whitelisted[i].match, c)) { whitelisted.remove(i); i--; }
-				writecfg();
-				whisper(sender, "Removed %s from whitelist.", c);
-			} else whisper(sender, "IP not specified.");
-		} else if(!strcmp(command, "damage")) {
-			if(ci->privilege >= PRIV_ADMIN && *c) {
-				int victim, damage;
-				int r = tokenize(c, "ci", &victim, &damage);
-				
-				if(r >= 2) {
-					clientinfo *vi = (clientinfo *)getclientinfo(victim);
-					if(vi) dodamage(vi, ci, damage, GUN_PISTOL);
-				} else whisper(sender, "Invalid usage.");
-			}
-#ifdef FROGMOD_VERSION
-		} else if(!strcmp(command, "version")) {
-			whisper(sender, "Running FrogMod " FROGMOD_VERSION ".");
-#endif
-		} else if(!strcmp(command, "givemaster")) {
-			if(ci->privilege >= PRIV_MASTER && *c) {
-				int cn;
-				int r = tokenize(c, "c", &cn);
-				if(r >= 1) {
-					clientinfo *ni = (clientinfo *)getclientinfo(cn);
-					if(ni && ci != ni) {
-						ci->privilege = 0;
-						ni->privilege = PRIV_MASTER;
-						currentmaster = cn;
-						masterupdate = true;
-						message("\f0%s\f2 gives master to \f0%s\f2. mastermode remains \f0%s\f2 (\f6%d\f2) ", ci->name, ni->name, mastermodename(mastermode), mastermode);
-						irc.speak(1, "\00306%s\00314 gives master to \00306%s", ci->name, ni->name);
-					}
-				}
-			}
-		} else if(!strcmp(command, "giveadmin")) {
-			if(ci->privilege >= PRIV_ADMIN && *c) {
-				int cn;
-				int r = tokenize(c, "c", &cn);
-				if(r >= 1) {
-					clientinfo *ni = (clientinfo *)getclientinfo(cn);
-					if(ni && ci != ni) {
-						ci->privilege = 0;
-						ni->privilege = PRIV_ADMIN;
-						currentmaster = cn;
-						masterupdate = true;
-						message("\f0%s\f2 gives admin to \f0%s\f2. mastermode remains \f0%s\f2 (\f6%d\f2) ", ci->name, ni->name, mastermodename(mastermode), mastermode);
-						irc.speak(1, "\00306%s\00314 gives admin to \00306%s", ci->name, ni->name);
-					}
-				}
-			}
-		} else if(!strcmp(command, "record") || !strcmp(command, "rec")) { //record coopedit commands
-			if(*c && m_edit) { //FIXME: check for existing and append .rec extension automatically
-				char buf[1024];
-				sprintf(buf, "%s.rec", c);
-				DELETEP(ci->recording);
-				ci->recording = openfile(buf, "w");
-				if(!ci->recording) {
-					whisper(sender, "Could not start recording %s", c);
-				} else {
-					whisper(sender, "Recording %s...", c);
-				}
-			} else whisper(sender, "Filename not specified.");
-		} else if(!strcmp(command, "recstop") || !strcmp(command, "stoprec")) {
-			if(ci->recording) {
-				DELETEP(ci->recording);
-				whisper(sender, "Stopped recording.");
-			}
-			if(ci->playing) {
-				DELETEP(ci->playing)
-				whisper(sender, "Stopped playing.");
-			}
-		} else if(!strcmp(command, "recplay")) {
-			if(*c && m_edit) {
-				DELETEP(ci->recording);
-				char buf[1024];
-				sprintf(buf, "%s.rec", c);
-				ci->playing = openfile(buf, "r"); //FIXME: better avoid path attacks?
-				if(ci->playing) whisper(sender, "Playing back %s...", c);
-				else whisper(sender, "Could not find recording \"%s\"", c);
-			} else whisper(sender, "Filename not specified.");
-		} else if(!strcmp(command, "reclist") || !strcmp(command, "listrec")) {
-			glob_t pglob;
-			int r = glob("*?.rec", 0, NULL, &pglob); // at least one char
-			
-			if(r == 0) {
-				if(pglob.gl_pathc > 0) {
-					Wrapper w;
-					w.append("\f6Available recordings:\f7");
-					loopi(pglob.gl_pathc) {
-						char *buf = pglob.gl_pathv[i];
-						int l = strlen(buf);
-						buf[l - 4] = 0; // discard .rec extension
-						w.append("\f2%s\f7", buf);
-						w.sep = ", ";
-					}
-					loopv(w.lines) whisper(sender, "%s", w.lines[i].s);
-				} else whisper(sender, "\f6No recordings.");
-				globfree(&pglob);
-			} else if(r == GLOB_NOMATCH) whisper(sender, "\f6No recordings.");
-			else whisper(sender, "\f6Could not list recordings.");
-		} else if(!strcmp(command, "recdel")) {
-			if(ci->privilege >= PRIV_ADMIN && *c) { //FIXME: check if file exists
-				char buf[1024];
-				sprintf(buf, "%s.rec", c);
-				unlink(buf);
-				whisper(sender, "Recording \"%s\" deleted.", c);
-			}
-		} else if(!strcmp(command, "sendto")) {
-			if(ci->privilege >= PRIV_MASTER) {
-				int cn;
-				int r = tokenize(c, "c", &cn);
-				if(r >= 1) {
-					clientinfo *to = (clientinfo *)getclientinfo(cn);
-					if(mapdata && to)
-					{
-						message("\f1Master sending map to \f2%s\f1...", to->name);
-						sendfile(cn, 2, mapdata, "ri", SV_SENDMAP);
-					}
-					else sendf(sender, 1, "ris", SV_SERVMSG, "No map to send");
-				}
-			}
-		} else if(!strcmp(command, "login")) {
-			string user, pwd;
-			int r = tokenize(c, "ss", user, pwd);
-			if(r >= 2) {
-				string hash;
-				getsha1(pwd, hash);
-				loopv(logins) {
-					if(!strcasecmp(logins[i].user, user) && !strcasecmp(logins[i].password, hash)) {
-						ci->logged_in = true;
-						copystring(ci->permissions, logins[i].permissions);
-						message("%s has now logged in.", ci->name);
-						irc.speak(1, "\00306%s\00314 has now logged in.", ci->name);
-					}
-				}
-			} else if(r == 1) {
-				if(!strcmp(user, adminpass)) {
-						ci->logged_in = true;
-						copystring(ci->permissions, "a");
-						message("%s has now logged in.", ci->name);
-						irc.speak(1, "\00306%s\00314 has now logged in.", ci->name);
-				}
+		frogcmd *cmd = findfrogcmd(command);
+		int wait = 0;
+		if(cmd && ci->privilege >= cmd->priv) {
+			if(cmd->usage[0] == '<' && !*c) whisper(sender, "Usage: \f6%s \f2%s", command, cmd->usage);
+			else if(!allowfrogcmd(ci, cmd, wait)) whisper(sender, "\f6%s\f7 is rate limited, try again in %d seconds.", command, wait);
+			else cmd->fn(ci, command, c);
+		} else if(ci->can_script()) {
+			defformatstring(who)("client %s", getclientipstr(sender));
+			const char *why = executeguarded(text, who);
+			if(why) {
+				whisper(sender, "\f3%s", why);
+				conoutf("script from %s stopped: %s", who, why);
 			}
-		} else if(!strcmp(command, "who")) {
-			execute(command);
-		} else if(ci->can_script()) execute(text);
+		}
 
 		scriptclient = NULL;
 
@@ -3390,7 +5240,8 @@ namespace server
 					return;
 				}
 
-				if(is_blacklisted(sender)) message("\f3Blacklist warning\f7: \f2%s\f7: %s", colorname(ci), blacklist_reason(sender));
+				const char *reason = blacklist_reason(sender);
+				if(reason) message("\f3Blacklist warning\f7: \f2%s\f7: %s", colorname(ci), reason);
 
 				ci->playermodel = getint(p);
 
@@ -3398,14 +5249,28 @@ namespace server
 
 				connects.removeobj(ci);
 				clients.add(ci);
+				statuschanged();
 
 				ci->connected = true;
+				logevent(GE_CONNECT, ci, int(getclientip(sender)), 0, ci->name);
+				if(!ci->local) admitverified(getclientip(sender));
+				if(relayupstream[0]) {
+					ci->state.state = CS_SPECTATOR;
+					if(relaywelcome.length()) relaysync(ci);
+					echo("\f1Relay viewer: \f0%s \f3(%s %s)", ci->name, getclientipstr(ci->clientnum), getclienthostname(ci->clientnum));
+					return;
+				}
 				if(mastermode>=MM_LOCKED) ci->state.state = CS_SPECTATOR;
 				if(currentmaster>=0) masterupdate = true;
 				ci->state.lasttimeplayed = lastmillis;
 
 				const char *worst = m_teammode ? chooseworstteam(text, ci) : NULL;
 				copystring(ci->team, worst ? worst : "good", MAXTEAMLEN+1);
+				bool journal = m_edit && editjournal && !editjournalfull;
+				if(journal) {
+					ci->journalwait = (welcomehasmap(ci) ? 1 : 0) + (mapdata ? 1 : 0);
+					ci->journalend = editjournalsent;
+				}
 				sendwelcome(ci);
 				if(restorescore(ci)) sendresume(ci);
 				sendinitclient(ci);
@@ -3416,19 +5281,15 @@ namespace server
 
 				if(servermotd[0]) whisper(sender, servermotd);
 
-#ifdef HAVE_GEOIP
 				const char *country = getclientcountrynul(sender);
 				if(country) {
 					message("%s is connected from \f6%s\f7", ci->name, country);
 					irc.speak(1, "\00312Connected: \00306%s\00314 from \00307%s", ci->name, country);
 					echo("\f1Connected: \f0%s \f3(%s %s) \f0from \f3%s", ci->name, getclientipstr(ci->clientnum), getclienthostname(ci->clientnum), country);
 				} else {
-#endif
 					irc.speak(1, "\00312Connected: \00306%s\00314", ci->name);
 					echo("\f1Connected: \f0%s \f3(%s %s)", ci->name, getclientipstr(ci->clientnum), getclienthostname(ci->clientnum));
-#ifdef HAVE_GEOIP
 				}
-#endif
 
 				for(int i = 0; i < clients.length(); i++) {
 					if(clients[i]->privilege == PRIV_ADMIN) {
@@ -3436,17 +5297,29 @@ namespace server
 					}
 				}
 
-				if(webhook[0]) {
+				if(webhook[0] && webhookjson) {
+					if(JSON::Writer *w = beginwebhook("connect")) {
+						w->member("name", ci->name);
+						w->member("ip", getclientipstr(sender));
+						endwebhook();
+					}
+				} else if(webhook[0]) {
 					char *ename = evhttp_encode_uri(ci->name);
 					defformatstring(url)("%s?action=connect&name=%s&ip=%s", webhook, ename, getclientipstr(sender));
 					free(ename);
-					printf("accessing \"%s\"\n", url);
+					logdebug("accessing \"%s\"", url);
 					froghttp_get(evbase, dnsbase, url, NULL, NULL);
 				}
 				
-				if(mapdata && autosend) sendfile(sender, 2, mapdata, "ri", SV_SENDMAP);
+				if(mapdata && (autosend || journal)) sendfile(sender, 2, mapdata, "ri", SV_SENDMAP);
+				if(journal && !ci->journalwait) sendeditjournal(ci);
 			}
 		}
+		else if(relayupstream[0])
+		{
+			relayparse(ci, p);
+			return;
+		}
 		else if(chan==2)
 		{
 			receivefile(sender, p.buf, p.maxlen);
@@ -3538,6 +5411,7 @@ namespace server
 				getstring(text, p);
 				int crc = getint(p);
 				if(!ci) break;
+				if(ci->journalwait > 0 && !--ci->journalwait) sendeditjournal(ci);
 				if(strcmp(text, smapname))
 				{
 					if(ci->clientmap[0])
@@ -3681,7 +5555,7 @@ namespace server
 					sel.cx = getint(p); sel.cxs = getint(p); sel.cy = getint(p), sel.cys = getint(p);
 					sel.corner = getint(p);
 
-					printf("Edit: %s\n", ci->name);
+					logdebug("Edit: %s", ci->name);
 
 					if(sel.s.x * sel.grid >= maxselspam || sel.s.y * sel.grid >= maxselspam || sel.s.z * sel.grid >= maxselspam) {
 						if(!ci->bigselwarned && totalmillis - ci->lastbigselspam > (int64_t) bigselmillis) {
@@ -3733,28 +5607,26 @@ namespace server
 						ci->lasttexturespam = totalmillis;
 					}
 
-					if(ci->recording) { //FIXME: remove the buf/sprintf and print to the file directly
-						char buf[256];
-						sprintf(buf, "%d  %d %d %d  %d %d %d  %d %d  %d %d %d %d  %d",
-							type,
-							sel.o.x - ci->playorigin.x, sel.o.y - ci->playorigin.y, sel.o.z - ci->playorigin.z,
-							sel.s.x, sel.s.y, sel.s.z,
-							sel.grid, sel.orient,
-							sel.cx, sel.cxs, sel.cy, sel.cys,
-							sel.corner);
-						if(size > 14) loopi(size - 14) {
-							char ibuf[10];
-							sprintf(ibuf, " %d", getint(p));
-							strcat(buf, ibuf);
-						}
-						strcat(buf, "\n");
-						ci->recording->putstring(buf);
+					if(ci->recording) {
+						uchar buf[5*32];
+						ucharbuf r(buf, sizeof(buf));
+						putint(r, type);
+						putint(r, sel.o.x - ci->playorigin.x); putint(r, sel.o.y - ci->playorigin.y); putint(r, sel.o.z - ci->playorigin.z);
+						putint(r, sel.s.x); putint(r, sel.s.y); putint(r, sel.s.z);
+						putint(r, sel.grid); putint(r, sel.orient);
+						putint(r, sel.cx); putint(r, sel.cxs); putint(r, sel.cy); putint(r, sel.cys);
+						putint(r, sel.corner);
+						if(size > 14) loopi(size - 14) putint(r, getint(p));
+						ci->recording->write(r.buf, r.len);
 					} else {
 						if(size > 14) loopi(size - 14) getint(p); //get the rest of the message, we don't care about the info
 						if(!ci->playing) ci->playorigin = sel.o; // only set the last edit pos if not recording, and not playing
 					}
 
-					if(ci && cq && (ci != cq || ci->state.state!=CS_SPECTATOR)) { QUEUE_AI; QUEUE_MSG; }
+					if(ci && cq && (ci != cq || ci->state.state!=CS_SPECTATOR)) {
+						journaledit(sender, &p.buf[curmsg], p.length() - curmsg);
+						QUEUE_AI; QUEUE_MSG;
+					}
 				}
 
 				break;
@@ -3766,6 +5638,7 @@ namespace server
 					if(totalmillis - ci->lastremip < (int64_t)remipmillis) {
 						sendf(sender, 1, "ris", SV_SERVMSG, "\f3Remipping too soon! \f2Blocked\f7.");
 					} else {
+						journaledit(sender, &p.buf[curmsg], p.length() - curmsg);
 						QUEUE_AI;
 						QUEUE_MSG;
 					}
@@ -3823,6 +5696,8 @@ namespace server
 				irc.speak(1, "\00306%s\00314 is now known as \00306%s", ci->name, text);
 				filtertext(ci->name, text, false, MAXNAMELEN);
 				if(!ci->name[0]) copystring(ci->name, "unnamed");
+				logevent(GE_NAME, ci, 0, 0, ci->name);
+				statuschanged();
 				QUEUE_STR(ci->name);
 				break;
 			}
@@ -3894,6 +5769,7 @@ namespace server
 				loopk(3) getint(p);
 				
 				if(!ci || ci->state.state==CS_SPECTATOR) break;
+				journaledit(sender, &p.buf[curmsg], p.length() - curmsg);
 				QUEUE_MSG;
 				bool canspawn = canspawnitem(type);
 				if(i<MAXENTS && (sents.inrange(i) || canspawnitem(type)))
@@ -3939,7 +5815,10 @@ namespace server
 					case ID_FVAR: getfloat(p); break;
 					case ID_SVAR: getstring(text, p);
 				}
-				if(ci && ci->state.state!=CS_SPECTATOR) QUEUE_MSG;
+				if(ci && ci->state.state!=CS_SPECTATOR) {
+					journaledit(sender, &p.buf[curmsg], p.length() - curmsg);
+					QUEUE_MSG;
+				}
 				break;
 			}
 
@@ -4095,6 +5974,8 @@ namespace server
 						resetitems();
 						notgotitems = false;
 						if(smode) smode->reset(true);
+						reseteditjournal();
+						journaledit(sender, &p.buf[curmsg], p.length() - curmsg);
 						QUEUE_MSG;
 						irc.speak(2, "\00306%s\00312 started a new map of size \00303%d", colorname(ci, NULL, false), min(16, max(10, size)));
 						ci->lastnewmap = totalmillis;
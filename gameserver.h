@@ -40,6 +40,7 @@ namespace server {
 	extern void adminmessage(const char *fmt, ...);
 
 	extern void writecfg(void);
+	extern void closebans(void);
 	extern void gothostname(void *info);
 
 	extern bool chainsaw, gunfinity;
@@ -1,11 +1,439 @@
-#include <stdio.h>
-
+#include "cube.h"
 #include "json.h"
 
 namespace JSON {
 
-bool Value::parse(char *str) {
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define JSON_BLOCKSIZE (64*1024) // bytes of Values per arena block
+
+static inline bool isws(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+static inline bool isdig(char c) { return c >= '0' && c <= '9'; }
+#define SKIPWS while(p < end && isws(*p)) p++
+
+static int hex4(const char *s) {
+	int v = 0;
+	loopi(4) {
+		char c = s[i];
+		v <<= 4;
+		if(c >= '0' && c <= '9') v |= c - '0';
+		else if(c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else if(c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else return -1;
+	}
+	return v;
+}
+
+static char *pututf8(char *w, uint c) {
+	if(c < 0x80) *w++ = c;
+	else if(c < 0x800) { *w++ = 0xC0 | (c >> 6); *w++ = 0x80 | (c & 0x3F); }
+	else if(c < 0x10000) { *w++ = 0xE0 | (c >> 12); *w++ = 0x80 | ((c >> 6) & 0x3F); *w++ = 0x80 | (c & 0x3F); }
+	else { *w++ = 0xF0 | (c >> 18); *w++ = 0x80 | ((c >> 12) & 0x3F); *w++ = 0x80 | ((c >> 6) & 0x3F); *w++ = 0x80 | (c & 0x3F); }
+	return w;
+}
+
+bool Parser::parse(char *buf, size_t len, Handler &h) {
+	start = p = buf;
+	end = buf + len;
+	error = NULL;
+	SKIPWS;
+	if(!value(h, 0)) return false;
+	SKIPWS;
+	return p >= end || fail("trailing characters");
+}
+
+bool Parser::value(Handler &h, int depth) {
+	if(p >= end) return fail("unexpected end");
+	switch(*p) {
+		case '{':
+			if(depth >= maxdepth) return fail("nested too deep");
+			p++;
+			if(!h.beginobject()) return fail("stopped");
+			SKIPWS;
+			if(p < end && *p == '}') { p++; return h.endobject() || fail("stopped"); }
+			for(;;) {
+				if(p >= end || *p != '"') return fail("expected a key");
+				char *s;
+				int len;
+				if(!string(s, len)) return false;
+				if(!h.key(s, len)) return fail("stopped");
+				SKIPWS;
+				if(p >= end || *p != ':') return fail("expected ':'");
+				p++;
+				SKIPWS;
+				if(!value(h, depth + 1)) return false;
+				SKIPWS;
+				if(p >= end) return fail("unexpected end");
+				if(*p == '}') { p++; return h.endobject() || fail("stopped"); }
+				if(*p != ',') return fail("expected ',' or '}'");
+				p++;
+				SKIPWS;
+			}
+
+		case '[':
+			if(depth >= maxdepth) return fail("nested too deep");
+			p++;
+			if(!h.beginarray()) return fail("stopped");
+			SKIPWS;
+			if(p < end && *p == ']') { p++; return h.endarray() || fail("stopped"); }
+			for(;;) {
+				if(!value(h, depth + 1)) return false;
+				SKIPWS;
+				if(p >= end) return fail("unexpected end");
+				if(*p == ']') { p++; return h.endarray() || fail("stopped"); }
+				if(*p != ',') return fail("expected ',' or ']'");
+				p++;
+				SKIPWS;
+			}
+
+		case '"': {
+			char *s;
+			int len;
+			if(!string(s, len)) return false;
+			return h.string(s, len) || fail("stopped");
+		}
+
+		case 't':
+			if(end - p < 4 || memcmp(p, "true", 4)) break;
+			p += 4;
+			return h.boolean(true) || fail("stopped");
+
+		case 'f':
+			if(end - p < 5 || memcmp(p, "false", 5)) break;
+			p += 5;
+			return h.boolean(false) || fail("stopped");
+
+		case 'n':
+			if(end - p < 4 || memcmp(p, "null", 4)) break;
+			p += 4;
+			return h.null() || fail("stopped");
+
+		default:
+			if(*p == '-' || isdig(*p)) {
+				double n;
+				if(!number(n)) return false;
+				return h.number(n) || fail("stopped");
+			}
+			break;
+	}
+	return fail("unexpected character");
+}
+
+// bytes before the first quote, backslash or control character, 8 at a time
+static inline size_t plainrun(const char *r, const char *end) {
+	const char *s = r;
+	while(end - r >= 8) {
+		uint64_t v;
+		memcpy(&v, r, 8);
+		uint64_t q = v ^ (ONES * '"'), b = v ^ (ONES * '\\');
+		if((((q - ONES) & ~q) | ((b - ONES) & ~b) | ((v - ONES * 0x20) & ~v)) & HIGHS) break;
+		r += 8;
+	}
+	while(r < end && *r != '"' && *r != '\\' && uchar(*r) >= 0x20) r++;
+	return r - s;
+}
+
+// p is at the opening quote. the unescaped string is written over the escaped one, which
+// is never shorter, and the closing quote's place or one before it gets the nul
+bool Parser::string(char *&s, int &len) {
+	char *r = p + 1, *w = r;
+	for(;;) {
+		size_t n = plainrun(r, end);
+		if(w != r) memmove(w, r, n);
+		w += n;
+		r += n;
+		if(r >= end) { p = r; return fail("unterminated string"); }
+		if(*r == '"') break;
+		if(*r != '\\') { p = r; return fail("control character in string"); }
+		if(end - r < 2) { p = r; return fail("unterminated string"); }
+		r += 2;
+		switch(r[-1]) {
+			case '"': *w++ = '"'; break;
+			case '\\': *w++ = '\\'; break;
+			case '/': *w++ = '/'; break;
+			case 'b': *w++ = '\b'; break;
+			case 'f': *w++ = '\f'; break;
+			case 'n': *w++ = '\n'; break;
+			case 'r': *w++ = '\r'; break;
+			case 't': *w++ = '\t'; break;
+			case 'u': {
+				int c1 = end - r >= 4 ? hex4(r) : -1;
+				if(c1 < 0) { p = r; return fail("bad \\u escape"); }
+				r += 4;
+				uint cp = c1;
+				if(c1 >= 0xD800 && c1 < 0xDC00) { // a surrogate pair
+					int c2 = end - r >= 6 && r[0] == '\\' && r[1] == 'u' ? hex4(r + 2) : -1;
+					if(c2 < 0xDC00 || c2 >= 0xE000) { p = r; return fail("bad surrogate pair"); }
+					r += 6;
+					cp = 0x10000 + ((c1 - 0xD800) << 10) + (c2 - 0xDC00);
+				} else if(c1 >= 0xDC00 && c1 < 0xE000) { p = r; return fail("bad surrogate pair"); }
+				w = pututf8(w, cp);
+				break;
+			}
+			default: p = r - 1; return fail("bad escape");
+		}
+	}
+	*w = 0;
+	s = p + 1;
+	len = w - s;
+	p = r + 1;
+	return true;
+}
+
+bool Parser::number(double &n) {
+	char *s = p;
+	bool neg = *p == '-';
+	if(neg) p++;
+	if(p >= end || !isdig(*p)) return fail("bad number");
+	uint64_t m = 0;
+	int digits = 0;
+	if(*p == '0') p++;
+	else while(p < end && isdig(*p)) { m = m*10 + (*p++ - '0'); digits++; }
+	bool simple = digits <= 18; // fits, and converts exactly
+	if(p < end && *p == '.') {
+		p++;
+		if(p >= end || !isdig(*p)) return fail("bad number");
+		while(p < end && isdig(*p)) p++;
+		simple = false;
+	}
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if(p < end && (*p == '+' || *p == '-')) p++;
+		if(p >= end || !isdig(*p)) return fail("bad number");
+		while(p < end && isdig(*p)) p++;
+		simple = false;
+	}
+	if(simple) { n = neg ? -double(m) : double(m); return true; }
+	// strtod needs a terminator, and the byte after the number belongs to something else
+	char tmp[64], *t = tmp;
+	size_t len = p - s;
+	if(len >= sizeof(tmp)) t = (char *)malloc(len + 1);
+	memcpy(t, s, len);
+	t[len] = 0;
+	n = strtod(t, NULL);
+	if(t != tmp) free(t);
+	return true;
+}
+
+Value *Value::get(const char *name) const {
+	if(type != ObjectType) return NULL;
+	for(Value *v = first; v; v = v->next) if(!strcmp(v->key, name)) return v;
+	return NULL;
+}
+
+Value *Value::at(int i) const {
+	if((type != ArrayType && type != ObjectType) || i < 0) return NULL;
+	Value *v = first;
+	while(v && i-- > 0) v = v->next;
+	return v;
+}
+
+struct Document::Block {
+	Block *next;
+	size_t used, size;
+};
+
+Document::Document() : root(NULL), error(NULL), erroroffset(0), blocks(NULL), depth(0), pendingkey(NULL) {}
+
+Document::~Document() {
+	clear();
+}
+
+void Document::clear() {
+	while(blocks) {
+		Block *b = blocks;
+		blocks = b->next;
+		free(b);
+	}
+	root = NULL;
+	error = NULL;
+	erroroffset = 0;
+	depth = 0;
+	pendingkey = NULL;
+}
+
+bool Document::parse(char *buf, size_t len) {
+	clear();
+	Parser parser(JSON_MAXDEPTH);
+	if(parser.parse(buf, len, *this)) return true;
+	error = parser.error;
+	erroroffset = parser.offset();
+	root = NULL;
 	return false;
 }
 
+Value *Document::add(Type type) {
+	if(!blocks || blocks->used + sizeof(Value) > blocks->size) {
+		Block *b = (Block *)malloc(sizeof(Block) + JSON_BLOCKSIZE);
+		b->next = blocks;
+		b->used = 0;
+		b->size = JSON_BLOCKSIZE;
+		blocks = b;
+	}
+	Value *v = (Value *)((char *)(blocks + 1) + blocks->used);
+	blocks->used += sizeof(Value);
+	v->type = type;
+	v->length = 0;
+	v->key = pendingkey;
+	v->next = NULL;
+	v->first = NULL;
+	pendingkey = NULL;
+	if(depth > 0) {
+		Value *c = open[depth-1];
+		if(last[depth-1]) last[depth-1]->next = v;
+		else c->first = v;
+		last[depth-1] = v;
+		c->length++;
+	} else root = v;
+	return v;
+}
+
+bool Document::null() { add(NullType); return true; }
+bool Document::boolean(bool b) { add(BoolType)->b = b; return true; }
+bool Document::number(double n) { add(NumberType)->n = n; return true; }
+bool Document::string(char *s, int len) { Value *v = add(StringType); v->s = s; v->length = len; return true; }
+bool Document::key(char *s, int len) { pendingkey = s; return true; }
+
+bool Document::beginobject() {
+	open[depth] = add(ObjectType);
+	last[depth++] = NULL;
+	return true;
+}
+
+bool Document::beginarray() {
+	open[depth] = add(ArrayType);
+	last[depth++] = NULL;
+	return true;
+}
+
+bool Document::endobject() { depth--; return true; }
+bool Document::endarray() { depth--; return true; }
+
+static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+
+void Writer::flush() {
+	if(used) evbuffer_add(out, buf, used);
+	used = 0;
+}
+
+void Writer::put(const void *data, size_t len) {
+	if(used + len > sizeof(buf)) {
+		flush();
+		if(len > sizeof(buf)) { evbuffer_add(out, data, len); return; }
+	}
+	memcpy(buf + used, data, len);
+	used += len;
+}
+
+void Writer::element() {
+	if(afterkey) { afterkey = false; return; }
+	if(needcomma) put(",", 1);
+	if(pretty && depth) {
+		put("\n", 1);
+		put(tabs, min(depth, int(sizeof(tabs) - 1)));
+	}
+	needcomma = true;
+}
+
+void Writer::close(char c) {
+	depth--;
+	if(pretty && needcomma) {
+		put("\n", 1);
+		put(tabs, min(depth, int(sizeof(tabs) - 1)));
+	}
+	put(&c, 1);
+	needcomma = true;
+	if(!depth) flush();
+}
+
+void Writer::beginobject() { element(); put("{", 1); depth++; needcomma = false; }
+void Writer::endobject() { close('}'); }
+void Writer::beginarray() { element(); put("[", 1); depth++; needcomma = false; }
+void Writer::endarray() { close(']'); }
+
+void Writer::key(const char *k) {
+	string(k);
+	if(pretty) put(": ", 2);
+	else put(":", 1);
+	afterkey = true;
+}
+
+// bytes in the well formed utf-8 sequence at p, or 0
+static int utf8len(const uchar *p, const uchar *end) {
+	uchar c = *p;
+	int n;
+	uchar lo = 0x80, hi = 0xBF; // the second byte's range
+	if(c >= 0xC2 && c <= 0xDF) n = 2;
+	else if(c >= 0xE0 && c <= 0xEF) { n = 3; if(c == 0xE0) lo = 0xA0; else if(c == 0xED) hi = 0x9F; }
+	else if(c >= 0xF0 && c <= 0xF4) { n = 4; if(c == 0xF0) lo = 0x90; else if(c == 0xF4) hi = 0x8F; }
+	else return 0;
+	if(end - p < n || p[1] < lo || p[1] > hi) return 0;
+	for(int i = 2; i < n; i++) if((p[i] & 0xC0) != 0x80) return 0;
+	return n;
+}
+
+void Writer::string(const char *s) {
+	string(s, strlen(s));
+}
+
+// bytes that are not utf-8, like the cube charset's, go out as \u00XX
+void Writer::string(const char *s, size_t len) {
+	element();
+	put("\"", 1);
+	const uchar *p = (const uchar *)s, *end = p + len, *run = p;
+	while(p < end) {
+		uchar c = *p;
+		if(c >= 0x20 && c < 0x80 && c != '"' && c != '\\') { p++; continue; }
+		if(c >= 0x80) {
+			int n = utf8len(p, end);
+			if(n) { p += n; continue; }
+		}
+		if(p > run) put(run, p - run);
+		switch(c) {
+			case '"': put("\\\"", 2); break;
+			case '\\': put("\\\\", 2); break;
+			case '\n': put("\\n", 2); break;
+			case '\r': put("\\r", 2); break;
+			case '\t': put("\\t", 2); break;
+			case '\b': put("\\b", 2); break;
+			case '\f': put("\\f", 2); break;
+			default: {
+				char esc[8];
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				put(esc, 6);
+				break;
+			}
+		}
+		run = ++p;
+	}
+	if(p > run) put(run, p - run);
+	put("\"", 1);
+}
+
+void Writer::number(double n) {
+	element();
+	if(n != n || n - n != 0) { put("null", 4); return; } // nan and infinities
+	char num[32];
+	snprintf(num, sizeof(num), "%.15g", n);
+	if(strtod(num, NULL) != n) snprintf(num, sizeof(num), "%.17g", n);
+	put(num, strlen(num));
+}
+
+void Writer::integer(long long n) {
+	element();
+	char num[24];
+	put(num, snprintf(num, sizeof(num), "%lld", n));
+}
+
+void Writer::boolean(bool b) {
+	element();
+	if(b) put("true", 4);
+	else put("false", 5);
+}
+
+void Writer::null() {
+	element();
+	put("null", 4);
+}
+
 }
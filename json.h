@@ -2,11 +2,16 @@
 #ifndef JSON_H_
 #define JSON_H_
 
-#include <vector>
-#include <map>
+#include <event2/buffer.h>
 
+// the parser works in place: strings are unescaped and nul terminated inside the input
+// buffer, so nothing is copied and every string handed out points into it. Parser feeds a
+// Handler as it goes; Document is a handler that builds a tree on an arena, which is freed
+// in one go. Writer streams escaped output into an evbuffer.
 namespace JSON {
 
+#define JSON_MAXDEPTH 256 // nesting the parser accepts
+
 enum Type {
 	NullType,
 	BoolType,
@@ -16,20 +21,127 @@ enum Type {
 	ObjectType
 };
 
-struct Value;
-typedef std::vector<Value> Vector;
-typedef std::map<char *, Value> Object;
+// return false from any event to stop the parse
+struct Handler {
+	virtual ~Handler() {}
+	virtual bool null() { return true; }
+	virtual bool boolean(bool b) { return true; }
+	virtual bool number(double n) { return true; }
+	virtual bool string(char *s, int len) { return true; }
+	virtual bool key(char *s, int len) { return true; }
+	virtual bool beginobject() { return true; }
+	virtual bool endobject() { return true; }
+	virtual bool beginarray() { return true; }
+	virtual bool endarray() { return true; }
+};
+
+struct Parser {
+	char *start, *p, *end;
+	const char *error; // what went wrong, at offset()
+	int maxdepth;
+
+	Parser(int maxdepth = JSON_MAXDEPTH) : start(NULL), p(NULL), end(NULL), error(NULL), maxdepth(maxdepth) {}
+
+	// buf is modified. one value, surrounded by whitespace at most
+	bool parse(char *buf, size_t len, Handler &h);
+	size_t offset() const { return p - start; }
+
+private:
+	bool value(Handler &h, int depth);
+	bool string(char *&s, int &len);
+	bool number(double &n);
+	bool fail(const char *msg) { if(!error) error = msg; return false; }
+};
 
 struct Value {
 	Type type;
+	int length; // bytes of a string, elements of an array or object
+	const char *key; // set on the members of an object
+	Value *next; // the next element of the parent
 	union {
 		bool b;
-		float f;
-		char *s;
-		Vector *v;
-		Object *o;
-	} value;
-	bool parse(char *str);
+		double n;
+		const char *s;
+		Value *first; // arrays and objects
+	};
+
+	Value *get(const char *name) const; // the member called name, or NULL
+	Value *at(int i) const; // the i-th element, or NULL
+	bool isnull() const { return type == NullType; }
+	const char *str(const char *def = "") const { return type == StringType ? s : def; }
+	double num(double def = 0) const { return type == NumberType ? n : def; }
+	int integer(int def = 0) const { return type == NumberType ? int(n) : def; }
+	bool boolean(bool def = false) const { return type == BoolType ? b : def; }
+};
+
+struct Document : Handler {
+	Value *root;
+	const char *error;
+	size_t erroroffset;
+
+	Document();
+	~Document();
+
+	// the tree points into buf, which has to outlive it
+	bool parse(char *buf, size_t len);
+	void clear();
+
+	bool null();
+	bool boolean(bool b);
+	bool number(double n);
+	bool string(char *s, int len);
+	bool key(char *s, int len);
+	bool beginobject();
+	bool endobject();
+	bool beginarray();
+	bool endarray();
+
+private:
+	struct Block;
+	Block *blocks;
+	Value *open[JSON_MAXDEPTH], *last[JSON_MAXDEPTH]; // containers being filled and their last elements
+	int depth;
+	const char *pendingkey;
+
+	Value *add(Type type);
+};
+
+// commas, quotes and escapes are taken care of; with pretty set members go on their own
+// lines, indented by tabs. output is staged in a small buffer and reaches out when a
+// top level value is finished, on flush() and when the writer goes away
+struct Writer {
+	evbuffer *out;
+	bool pretty, needcomma, afterkey;
+	int depth, used;
+	char buf[4096];
+
+	Writer(evbuffer *out, bool pretty = false) : out(out), pretty(pretty), needcomma(false), afterkey(false), depth(0), used(0) {}
+	~Writer() { flush(); }
+
+	void flush();
+
+	void beginobject();
+	void endobject();
+	void beginarray();
+	void endarray();
+	void key(const char *k);
+	void string(const char *s);
+	void string(const char *s, size_t len);
+	void number(double n);
+	void integer(long long n);
+	void boolean(bool b);
+	void null();
+
+	void member(const char *k, const char *s) { key(k); string(s); }
+	void member(const char *k, int n) { key(k); integer(n); }
+	void member(const char *k, long long n) { key(k); integer(n); }
+	void member(const char *k, double n) { key(k); number(n); }
+	void member(const char *k, bool b) { key(k); boolean(b); }
+
+private:
+	void put(const void *data, size_t len);
+	void element();
+	void close(char c);
 };
 
 }
@@ -0,0 +1,88 @@
+// throughput of the json parser and writer on a login list: make bench, or ./jsonbench [entries] [rounds]
+#include "cube.h"
+#include "json.h"
+#include <sys/time.h>
+
+static double now() {
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// counts events, to time the tokenizer without building anything
+struct counter : JSON::Handler {
+	int values;
+	counter() : values(0) {}
+	bool null() { values++; return true; }
+	bool boolean(bool b) { values++; return true; }
+	bool number(double n) { values++; return true; }
+	bool string(char *s, int len) { values++; return true; }
+};
+
+static void writelogins(evbuffer *out, int entries) {
+	JSON::Writer w(out);
+	w.beginarray();
+	loopi(entries) {
+		defformatstring(name)("player%d", i);
+		defformatstring(hash)("$pbkdf2-sha1$20000$%08x%08x%08x%08x$%08x%08x%08x%08x%08x", i, i*7919, i*31, ~i, i*17, i*13, i*11, i*7, i*5);
+		w.beginobject();
+		w.member("name", name);
+		w.member("hash", hash);
+		w.member("perms", i % 10 ? "m" : "a");
+		w.member("added", 1300000000 + i);
+		w.member("note", "line\twith \"escapes\" and \xc3\xa9");
+		w.endobject();
+	}
+	w.endarray();
+}
+
+int main(int argc, char **argv) {
+	int entries = argc > 1 ? max(atoi(argv[1]), 1) : 100000, rounds = argc > 2 ? max(atoi(argv[2]), 1) : 10;
+
+	evbuffer *out = evbuffer_new();
+	double start = now();
+	loopi(rounds) {
+		evbuffer_drain(out, evbuffer_get_length(out));
+		writelogins(out, entries);
+	}
+	double write = now() - start;
+	size_t len = evbuffer_get_length(out);
+	char *doc = (char *)malloc(len), *buf = (char *)malloc(len);
+	evbuffer_remove(out, doc, len);
+	evbuffer_free(out);
+
+	// parsing is destructive, so every round starts from a fresh copy; copying alone is
+	// the memory bandwidth to compare with
+	double copy = 0, sax = 0, dom = 0;
+	int values = 0, logins = 0;
+	loopi(rounds) {
+		double t = now();
+		memcpy(buf, doc, len);
+		copy += now() - t;
+		counter c;
+		JSON::Parser p;
+		t = now();
+		if(!p.parse(buf, len, c)) { printf("parse error at %d: %s\n", int(p.offset()), p.error); return EXIT_FAILURE; }
+		sax += now() - t;
+		values = c.values;
+
+		memcpy(buf, doc, len);
+		JSON::Document d;
+		t = now();
+		if(!d.parse(buf, len)) { printf("parse error at %d: %s\n", int(d.erroroffset), d.error); return EXIT_FAILURE; }
+		dom += now() - t;
+		logins = d.root->length;
+		defformatstring(lastname)("player%d", entries - 1);
+		if(strcmp(d.root->at(logins - 1)->get("name")->str(), lastname)) { printf("bad tree\n"); return EXIT_FAILURE; }
+	}
+
+	double mb = len * double(rounds) / (1024*1024);
+	printf("%d logins, %d values, %.1f MB\n", logins, values, len / (1024.0*1024));
+	printf("memcpy   %8.1f MB/s\n", mb / copy);
+	printf("sax      %8.1f MB/s\n", mb / sax);
+	printf("document %8.1f MB/s\n", mb / dom);
+	printf("writer   %8.1f MB/s\n", mb / write);
+	free(doc);
+	free(buf);
+	return EXIT_SUCCESS;
+}
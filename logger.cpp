@@ -0,0 +1,276 @@
+#include "cube.h"
+#include "logger.h"
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+VAR(loglevel, LL_DEBUG, LL_INFO, LL_ERROR); // lines below this level are dropped
+VAR(logflushms, 10, 200, 10000); // how long lines can sit in the ring
+VAR(logmaxsize, 0, 0, 1<<20); // KB before the file is rotated, 0 for no limit
+VAR(logrotatehours, 0, 0, 24*366); // hours before the file is rotated, 0 for never
+VAR(logkeep, 1, 5, 100); // rotated files kept as logfile.1 .. logfile.N
+
+#define LOGRING 4096 // lines, a power of two
+
+// bounded multi-producer queue: a slot is free for the producer at pos when its seq is
+// pos, and holds a finished line for the consumer when its seq is pos+1
+struct logslot {
+	uint seq;
+	int level;
+	time_t time;
+	string text;
+};
+
+static logslot ring[LOGRING];
+static uint enqueuepos = 0, dequeuepos = 0, dropped = 0;
+
+struct logwriter {
+	string name, path; // requested under the lock / open on the writer thread; "" for stdout
+	FILE *f;
+	int64_t size;
+	time_t opened;
+	bool reopen, rotate, running, quit; // requests, under the lock
+#ifndef WIN32
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+
+	logwriter() : f(NULL), size(0), opened(0), reopen(true), rotate(false), running(false), quit(false) { name[0] = path[0] = 0; }
+
+	void close() {
+		if(f && f != stdout) fclose(f);
+		f = NULL;
+	}
+
+	void open() {
+		close();
+		if(!path[0]) { f = stdout; return; }
+		f = fopen(path, "a");
+		if(!f) { fprintf(stderr, "could not open log file %s, logging to stdout\n", path); f = stdout; return; }
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		opened = time(NULL);
+	}
+
+	// logfile.N-1 -> logfile.N ... logfile -> logfile.1
+	void dorotate() {
+		if(!path[0]) return;
+		if(!f) open();
+		if(f == stdout || !size) return;
+		close();
+		for(int i = logkeep; i > 0; i--) {
+			defformatstring(to)("%s.%d", path, i);
+			if(i > 1) {
+				defformatstring(from)("%s.%d", path, i-1);
+				rename(from, to);
+			} else rename(path, to);
+		}
+		open();
+	}
+
+	void write(const char *buf, int len) {
+		if(!f) open();
+		fwrite(buf, 1, len, f);
+		fflush(f);
+		if(f == stdout) return;
+		size += len;
+		if((logmaxsize && size >= logmaxsize*1024LL) || (logrotatehours && time(NULL) - opened >= logrotatehours*3600LL)) dorotate();
+	}
+
+	// takes the requests made since the last call; with the lock held if the thread runs
+	void apply(bool &rotatenow) {
+		if(reopen) { copystring(path, name); close(); reopen = false; }
+		rotatenow = rotate;
+		rotate = false;
+	}
+};
+
+static logwriter writer;
+
+static const char * const levelnames[] = { "[debug] ", "", "[warning] ", "[error] " };
+
+static void formatline(vector<char> &buf, logslot &s) {
+	string ct;
+#ifdef WIN32
+	copystring(ct, ctime(&s.time));
+#else
+	ctime_r(&s.time, ct);
+#endif
+	int ctlen = strlen(ct);
+	if(ctlen) ct[ctlen-1] = ' '; // replace trailing newline with space
+	buf.put(ct, ctlen);
+	const char *level = levelnames[clamp(s.level, int(LL_DEBUG), int(LL_ERROR))];
+	buf.put(level, strlen(level));
+	int len = strlen(s.text);
+	while(len > 0 && s.text[len-1] == '\n') len--;
+	buf.put(s.text, len);
+	buf.add('\n');
+}
+
+// consumer side: moves every finished line into buf
+static void drainring(vector<char> &buf) {
+	for(;;) {
+		logslot &s = ring[dequeuepos & (LOGRING-1)];
+		if(__atomic_load_n(&s.seq, __ATOMIC_ACQUIRE) != dequeuepos + 1) break;
+		formatline(buf, s);
+		__atomic_store_n(&s.seq, dequeuepos + LOGRING, __ATOMIC_RELEASE);
+		__atomic_store_n(&dequeuepos, dequeuepos + 1, __ATOMIC_RELAXED); // producers read it to decide when to wake us
+	}
+	uint lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if(lost) {
+		logslot s;
+		s.level = LL_WARN;
+		s.time = time(NULL);
+		formatstring(s.text)("%u log lines dropped, the log writer fell behind", lost);
+		formatline(buf, s);
+	}
+}
+
+static bool pushline(int level, const char *fmt, va_list args) {
+	uint pos = __atomic_load_n(&enqueuepos, __ATOMIC_RELAXED);
+	logslot *s;
+	for(;;) {
+		s = &ring[pos & (LOGRING-1)];
+		int diff = int(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+		if(!diff) {
+			if(__atomic_compare_exchange_n(&enqueuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if(diff < 0) return false; // full
+		else pos = __atomic_load_n(&enqueuepos, __ATOMIC_RELAXED);
+	}
+	s->level = level;
+	s->time = time(NULL);
+	vformatstring(s->text, fmt, args);
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+#ifndef WIN32
+static void *logthread(void *arg) {
+	vector<char> buf;
+	pthread_mutex_lock(&writer.lock);
+	for(;;) {
+		bool quit = writer.quit, rotate;
+		writer.apply(rotate);
+		pthread_mutex_unlock(&writer.lock);
+		drainring(buf);
+		if(buf.length()) writer.write(buf.getbuf(), buf.length());
+		buf.setsize(0);
+		if(rotate) writer.dorotate();
+		pthread_mutex_lock(&writer.lock);
+		if(quit) break;
+		if(!writer.quit && !writer.rotate && !writer.reopen) {
+			timeval now;
+			gettimeofday(&now, NULL);
+			int64_t until = now.tv_sec * 1000000LL + now.tv_usec + logflushms * 1000LL;
+			timespec ts = { time_t(until / 1000000), long(until % 1000000) * 1000 };
+			pthread_cond_timedwait(&writer.cond, &writer.lock, &ts);
+		}
+	}
+	writer.close();
+	pthread_mutex_unlock(&writer.lock);
+	return NULL;
+}
+#endif
+
+static void startlog() {
+	static bool started = false;
+	if(started) return;
+	started = true;
+	loopi(LOGRING) ring[i].seq = i;
+#ifndef WIN32
+	pthread_mutex_init(&writer.lock, NULL);
+	pthread_cond_init(&writer.cond, NULL);
+	writer.running = !pthread_create(&writer.thread, NULL, logthread, NULL);
+	if(!writer.running) fprintf(stderr, "could not start the log writer, logging synchronously\n");
+#endif
+}
+
+static void wakewriter() {
+#ifndef WIN32
+	pthread_cond_signal(&writer.cond);
+#endif
+}
+
+void logoutfv(int level, const char *fmt, va_list args) {
+	if(level < loglevel) return;
+	startlog();
+	if(!__atomic_load_n(&writer.running, __ATOMIC_SEQ_CST)) { // not started, or already stopped
+		logslot s;
+		s.level = level;
+		s.time = time(NULL);
+		vformatstring(s.text, fmt, args);
+		vector<char> buf;
+		formatline(buf, s);
+		bool rotate;
+		writer.apply(rotate);
+		writer.write(buf.getbuf(), buf.length());
+		if(rotate) writer.dorotate();
+		return;
+	}
+	if(!pushline(level, fmt, args)) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		wakewriter();
+		return;
+	}
+	// batch up routine lines, but don't let the ring fill or errors wait
+	if(level >= LL_ERROR || __atomic_load_n(&enqueuepos, __ATOMIC_RELAXED) - __atomic_load_n(&dequeuepos, __ATOMIC_RELAXED) >= LOGRING/2) wakewriter();
+}
+
+void logoutf(int level, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	logoutfv(level, fmt, args);
+	va_end(args);
+}
+
+void setlogfile(const char *name) {
+	startlog();
+	string found = "";
+	if(name[0]) copystring(found, findfile(path(name, true), "a")); // not thread-safe, resolve here
+#ifndef WIN32
+	if(writer.running) {
+		pthread_mutex_lock(&writer.lock);
+		copystring(writer.name, found);
+		writer.reopen = true;
+		pthread_cond_signal(&writer.cond);
+		pthread_mutex_unlock(&writer.lock);
+		return;
+	}
+#endif
+	copystring(writer.name, found);
+	writer.reopen = true;
+}
+
+void stoplog() {
+#ifndef WIN32
+	if(!writer.running) return;
+	pthread_mutex_lock(&writer.lock);
+	writer.quit = true;
+	pthread_cond_signal(&writer.cond);
+	pthread_mutex_unlock(&writer.lock);
+	pthread_join(writer.thread, NULL);
+	__atomic_store_n(&writer.running, false, __ATOMIC_SEQ_CST);
+	// lines pushed after the thread's last drain; from now on logoutfv() writes directly
+	vector<char> buf;
+	drainring(buf);
+	if(buf.length()) {
+		writer.write(buf.getbuf(), buf.length());
+		writer.close();
+	}
+#endif
+}
+
+// for external rotation: mv the file away, then logrotate, or just logrotate
+ICOMMAND(logrotate, "", (), {
+#ifndef WIN32
+	if(writer.running) {
+		pthread_mutex_lock(&writer.lock);
+		writer.rotate = true;
+		pthread_cond_signal(&writer.cond);
+		pthread_mutex_unlock(&writer.lock);
+		return;
+	}
+#endif
+	writer.dorotate();
+});
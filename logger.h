@@ -0,0 +1,21 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+// the server log. lines go into a lock-free ring and a writer thread appends them in
+// batches to a file it keeps open (stdout when no file is set), so logging never waits on
+// the disk. the file is rotated by size and by age. logdebug() call sites only exist in
+// builds with DEBUGLOG defined; loglevel filters the rest at run time.
+enum { LL_DEBUG = 0, LL_INFO, LL_WARN, LL_ERROR };
+
+void logoutf(int level, const char *fmt, ...);
+void logoutfv(int level, const char *fmt, va_list args);
+void setlogfile(const char *name); // "" for stdout
+void stoplog(); // writes out what is queued and stops the writer; later lines are written directly
+
+#ifdef DEBUGLOG
+#define logdebug(...) logoutf(LL_DEBUG, __VA_ARGS__)
+#else
+#define logdebug(...) ((void)0)
+#endif
+
+#endif /* LOGGER_H_ */
@@ -0,0 +1,245 @@
+#include "cube.h"
+#include "match.h"
+
+matchset::matchset() : literals(NULL), globnames(NULL), acgoto(NULL), stamp(0), dirty(false) {
+	clear();
+}
+
+matchset::~matchset() {
+	clear();
+	DELETEP(literals);
+	DELETEP(globnames);
+}
+
+void matchset::clear() {
+	while(patterns.length()) delete[] patterns.pop();
+	trie.setsize(0);
+	trienode &root = trie.add();
+	root.child[0] = root.child[1] = 0;
+	root.data = NULL;
+	DELETEP(literals);
+	literals = new hashtable<const char *, void *>(1<<12);
+	DELETEP(globnames);
+	globnames = new hashtable<const char *, int>(1<<10);
+	globs.setsize(0);
+	acnodes.setsize(0);
+	acterms.setsize(0);
+	always.setsize(0);
+	seen.setsize(0);
+	DELETEP(acgoto);
+	dirty = false;
+}
+
+static bool parseoctet(const char *&s, uint &v) {
+	if(!isdigit(*s) || (s[0] == '0' && isdigit(s[1]))) return false; // only what ipstr() would print
+	v = 0;
+	for(int n = 0; isdigit(*s); n++, s++) {
+		if(n >= 3) return false;
+		v = v*10 + (*s - '0');
+	}
+	return v <= 255;
+}
+
+bool matchset::parseip(const char *pattern, uint &net, int &bits) {
+	const char *s = pattern;
+	net = 0;
+	bits = 0;
+	if(!strcmp(s, "*")) return true;
+	loopi(4) {
+		uint v;
+		if(!parseoctet(s, v)) return false;
+		net |= v << (24 - 8*i);
+		bits += 8;
+		if(i == 3) break;
+		if(*s++ != '.') return false;
+		if(!strcmp(s, "*")) return true; // a.b.* matches exactly the ip strings in a.b.0.0/16
+	}
+	if(!*s) return true;
+	if(*s++ != '/' || !isdigit(*s)) return false;
+	int n = strtol(s, (char **)&s, 10);
+	if(*s || n < 0 || n > 32) return false;
+	bits = n;
+	if(bits < 32) net &= bits ? ~0U << (32 - bits) : 0;
+	return true;
+}
+
+// longest run of characters every match has to contain. stops at brackets, to stay safe with classes
+static void literalrun(const char *p, const char *&best, int &bestlen, char *buf) {
+	bestlen = 0;
+	best = NULL;
+	char run[MAXSTRLEN];
+	int len = 0;
+	for(;; p++) {
+		bool lit = *p && *p != '*' && *p != '?' && *p != '[';
+		char c = *p;
+		if(lit && c == '\\') {
+			if(!p[1]) lit = false;
+			else c = *++p;
+		}
+		if(lit && len < MAXSTRLEN-1) { run[len++] = c; continue; }
+		if(len > bestlen) { memcpy(buf, run, len); buf[len] = 0; bestlen = len; best = buf; }
+		len = 0;
+		if(!*p || *p == '[') break;
+	}
+}
+
+void matchset::add(const char *pattern, void *data) {
+	char *p = newstring(pattern);
+	patterns.add(p);
+
+	uint net;
+	int bits;
+	bool ip = parseip(p, net, bits);
+	if(ip) {
+		int n = 0;
+		loopi(bits) {
+			int b = (net >> (31 - i)) & 1;
+			if(!trie[n].child[b]) {
+				trie[n].child[b] = trie.length();
+				trienode &t = trie.add();
+				t.child[0] = t.child[1] = 0;
+				t.data = NULL;
+			}
+			n = trie[n].child[b];
+		}
+		if(!trie[n].data) trie[n].data = data;
+	}
+
+	if(!strpbrk(p, "*?[\\")) { // no wildcards: fnmatch is a plain compare
+		if(!literals->access(p)) (*literals)[p] = data;
+		return;
+	}
+	if(globnames->access(p)) return;
+	(*globnames)[p] = globs.length();
+	glob &g = globs.add();
+	g.pattern = p;
+	g.data = data;
+	g.intrie = ip;
+	dirty = true;
+}
+
+int matchset::acchild(int node, uchar c) {
+	int *n = acgoto->access((node<<8) | c);
+	return n ? *n : -1;
+}
+
+void matchset::build() {
+	dirty = false;
+	acnodes.setsize(0);
+	acterms.setsize(0);
+	always.setsize(0);
+	seen.setsize(0);
+	loopv(globs) seen.add(0);
+	stamp = 0;
+
+	int size = 1<<10;
+	while(size < 4*globs.length() && size < (1<<22)) size <<= 1;
+	DELETEP(acgoto);
+	acgoto = new hashtable<int, int>(size);
+
+	acnode root = { 0, -1, -1, -1, -1, 0 };
+	acnodes.add(root);
+	loopv(globs) {
+		char buf[MAXSTRLEN];
+		const char *run;
+		int len;
+		literalrun(globs[i].pattern, run, len, buf);
+		if(!len) { always.add(i); continue; }
+		int n = 0;
+		loopj(len) {
+			uchar c = run[j];
+			int next = acchild(n, c);
+			if(next < 0) {
+				next = acnodes.length();
+				acnode a = { 0, -1, -1, -1, acnodes[n].child, c };
+				acnodes.add(a);
+				acnodes[n].child = next;
+				(*acgoto)[(n<<8) | c] = next;
+			}
+			n = next;
+		}
+		acterm t = { i, acnodes[n].term };
+		acnodes[n].term = acterms.length();
+		acterms.add(t);
+	}
+
+	// breadth first: failure links, and dictionary links to the nearest suffix that ends a literal
+	vector<int> queue;
+	for(int c = acnodes[0].child; c >= 0; c = acnodes[c].sibling) queue.add(c);
+	for(int q = 0; q < queue.length(); q++) {
+		int n = queue[q];
+		for(int c = acnodes[n].child; c >= 0; c = acnodes[c].sibling) {
+			int f = acnodes[n].fail, next;
+			while((next = acchild(f, acnodes[c].c)) < 0 && f) f = acnodes[f].fail;
+			acnodes[c].fail = next >= 0 && next != c ? next : 0;
+			int fn = acnodes[c].fail;
+			acnodes[c].dict = acnodes[fn].term >= 0 ? fn : acnodes[fn].dict;
+			queue.add(c);
+		}
+	}
+}
+
+static inline void *found(void *data, vector<void *> *all) {
+	if(all && all->find(data) < 0) all->add(data);
+	return data;
+}
+
+// with all set, collects every match instead of returning the first
+void *matchset::matchglobs(const char *str, bool ip, vector<void *> *all) {
+	if(dirty) build();
+	if(globs.empty()) return NULL;
+	void *first = NULL;
+	if(++stamp < 0) { stamp = 1; loopv(seen) seen[i] = 0; }
+	loopv(always) {
+		glob &g = globs[always[i]];
+		if(!(ip && g.intrie) && !fnmatch(g.pattern, str, 0)) {
+			if(!first) first = g.data;
+			if(!all) return first;
+			found(g.data, all);
+		}
+	}
+	int n = 0;
+	for(const uchar *s = (const uchar *)str; *s; s++) {
+		int next;
+		while((next = acchild(n, *s)) < 0 && n) n = acnodes[n].fail;
+		n = next >= 0 ? next : 0;
+		for(int d = acnodes[n].term >= 0 ? n : acnodes[n].dict; d > 0; d = acnodes[d].dict) {
+			for(int t = acnodes[d].term; t >= 0; t = acterms[t].next) {
+				int i = acterms[t].glob;
+				if(seen[i] == stamp) continue;
+				seen[i] = stamp;
+				glob &g = globs[i];
+				if(!(ip && g.intrie) && !fnmatch(g.pattern, str, 0)) {
+					if(!first) first = g.data;
+					if(!all) return first;
+					found(g.data, all);
+				}
+			}
+		}
+	}
+	return first;
+}
+
+void *matchset::match(const char *str, vector<void *> *all) {
+	if(!str) return NULL;
+	void **lit = literals->access(str);
+	if(lit && !all) return *lit;
+	void *first = lit ? found(*lit, all) : NULL;
+	void *g = matchglobs(str, false, all);
+	return first ? first : g;
+}
+
+void *matchset::matchip(uint ip, vector<void *> *all) {
+	uint host = ENET_NET_TO_HOST_32(ip);
+	void *first = NULL;
+	for(int n = 0, i = 0;; i++) {
+		if(trie[n].data) {
+			if(!first) first = trie[n].data;
+			if(!all) return first;
+			found(trie[n].data, all);
+		}
+		if(i >= 32 || !(n = trie[n].child[(host >> (31 - i)) & 1])) break;
+	}
+	void *g = matchglobs(ipstr(ip), true, all);
+	return first ? first : g;
+}
@@ -0,0 +1,49 @@
+#ifndef MATCH_H_
+#define MATCH_H_
+
+// a set of fnmatch() patterns (no flags) compiled for lookups that don't scan the whole set.
+// plain IPs, a.b.* prefixes and a.b.c.d/n ranges go into a radix trie over the address,
+// patterns without wildcards into a hash, and the remaining globs are only tried when their
+// longest literal run occurs in the subject (found with one Aho-Corasick pass).
+struct matchset {
+	struct trienode { int child[2]; void *data; };
+	struct glob { const char *pattern; void *data; bool intrie; };
+	struct acnode { int fail, dict, term, child, sibling; uchar c; };
+	struct acterm { int glob, next; };
+
+	vector<char *> patterns;
+	vector<trienode> trie;
+	hashtable<const char *, void *> *literals;
+	vector<glob> globs;
+	hashtable<const char *, int> *globnames;
+
+	// glob prefilter, rebuilt lazily after add()
+	vector<acnode> acnodes;
+	vector<acterm> acterms;
+	vector<int> always, seen;
+	hashtable<int, int> *acgoto;
+	int stamp;
+	bool dirty;
+
+	matchset();
+	~matchset();
+
+	void add(const char *pattern, void *data);
+	void clear();
+	bool empty() const { return patterns.empty(); }
+	int length() const { return patterns.length(); }
+
+	// same answer as trying fnmatch(pattern, str, 0) on every pattern. with all set, every match
+	// is appended to it once (a pattern added twice reports only the first data)
+	void *match(const char *str, vector<void *> *all = NULL);
+	void *matchip(uint ip, vector<void *> *all = NULL); // as match(ipstr(ip)), except that a.b.c.d/n patterns match their range
+
+	static bool parseip(const char *pattern, uint &net, int &bits); // ip, a.b.* or a.b.c.d/n, host order
+
+private:
+	void build();
+	int acchild(int node, uchar c);
+	void *matchglobs(const char *str, bool ip, vector<void *> *all);
+};
+
+#endif /* MATCH_H_ */
@@ -0,0 +1,134 @@
+#include "cube.h"
+#include "rdns.h"
+#include <event2/dns.h>
+
+VAR(rdnscachesize, 16, 4096, 1<<20);
+VAR(rdnsminttl, 0, 60, 86400);
+VAR(rdnsmaxttl, 60, 3600, 7*86400);
+VAR(rdnsnegttl, 0, 300, 86400);
+
+struct rdnswaiter {
+	rdnsfn fn;
+	void *arg;
+};
+
+struct rdnsentry {
+	uint ip;
+	string host;
+	int64_t expiry; // unix time
+	bool pending;
+	vector<rdnswaiter> waiters;
+	rdnsentry *prev, *next; // lru list, most recent first
+};
+
+static hashtable<uint, rdnsentry *> rdnscache;
+static rdnsentry *lruhead = NULL, *lrutail = NULL;
+static int rdnshits = 0, rdnsmisses = 0, rdnsjoined = 0;
+
+static void unlink(rdnsentry *e) {
+	if(e->prev) e->prev->next = e->next; else lruhead = e->next;
+	if(e->next) e->next->prev = e->prev; else lrutail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void pushfront(rdnsentry *e) {
+	e->prev = NULL;
+	e->next = lruhead;
+	if(lruhead) lruhead->prev = e; else lrutail = e;
+	lruhead = e;
+}
+
+static void drop(rdnsentry *e) {
+	unlink(e);
+	rdnscache.remove(e->ip);
+	delete e;
+}
+
+// pending entries have waiters and an outstanding query, so they stay
+static void evict() {
+	for(rdnsentry *e = lrutail; e && rdnscache.numelems > rdnscachesize;) {
+		rdnsentry *prev = e->prev;
+		if(!e->pending) drop(e);
+		e = prev;
+	}
+}
+
+static void rdnscb(int result, char type, int count, int ttl, void *addresses, void *arg) {
+	uint ip = (uint)(size_t)arg;
+	rdnsentry **found = rdnscache.access(ip);
+	if(!found || !(*found)->pending) return; // cleared meanwhile
+	rdnsentry *e = *found;
+	e->pending = false;
+	if(result == DNS_ERR_NONE && type == DNS_PTR && count >= 1) {
+		copystring(e->host, ((char **)addresses)[0]);
+		e->expiry = time(NULL) + clamp(ttl, rdnsminttl, rdnsmaxttl);
+	} else {
+		e->host[0] = 0;
+		e->expiry = time(NULL) + rdnsnegttl;
+	}
+	// a waiter may disconnect its client, which cancels other waiters through rdnscancel
+	while(e->waiters.length()) {
+		rdnswaiter w = e->waiters.remove(0);
+		w.fn(ip, e->host, w.arg);
+	}
+	evict();
+}
+
+bool rdnslookup(evdns_base *dns, uint ip, rdnsfn fn, void *arg) {
+	rdnsentry **found = rdnscache.access(ip), *e = found ? *found : NULL;
+	if(e && !e->pending && e->expiry > time(NULL)) {
+		unlink(e);
+		pushfront(e);
+		rdnshits++;
+		fn(ip, e->host, arg);
+		return true;
+	}
+	if(!e) {
+		e = new rdnsentry;
+		e->ip = ip;
+		e->host[0] = 0;
+		e->prev = e->next = NULL;
+		e->pending = false;
+		rdnscache[ip] = e;
+	} else unlink(e);
+	pushfront(e);
+	rdnswaiter &w = e->waiters.add();
+	w.fn = fn;
+	w.arg = arg;
+	if(e->pending) { rdnsjoined++; return false; }
+	rdnsmisses++;
+	e->pending = true;
+	in_addr addr;
+	addr.s_addr = ip;
+	if(!evdns_base_resolve_reverse(dns, &addr, 0, rdnscb, (void *)(size_t)ip)) {
+		e->pending = false;
+		e->waiters.pop();
+		drop(e);
+		fn(ip, "", arg);
+		return true;
+	}
+	evict();
+	return false;
+}
+
+void rdnscancel(uint ip, void *arg) {
+	rdnsentry **found = rdnscache.access(ip);
+	if(!found) return;
+	vector<rdnswaiter> &waiters = (*found)->waiters;
+	loopv(waiters) if(waiters[i].arg == arg) waiters.remove(i--);
+}
+
+// lookups still in flight keep their entries so their waiters get answered
+void rdnsclear() {
+	for(rdnsentry *e = lruhead; e;) {
+		rdnsentry *next = e->next;
+		if(!e->pending) drop(e);
+		e = next;
+	}
+}
+
+ICOMMAND(rdnsflush, "", (), rdnsclear());
+ICOMMAND(rdnsstats, "", (), {
+	defformatstring(s)("%d entries, %d hits, %d lookups, %d joined a lookup", rdnscache.numelems, rdnshits, rdnsmisses, rdnsjoined);
+	result(s);
+});
@@ -0,0 +1,17 @@
+#ifndef RDNS_H_
+#define RDNS_H_
+
+// reverse dns for client addresses, through a small lru cache. answers are kept for
+// their ttl (clamped to rdnsminttl..rdnsmaxttl), failures for rdnsnegttl, and clients
+// asking for an address that is already being looked up wait on the same query.
+struct evdns_base;
+
+typedef void (*rdnsfn)(uint ip, const char *host, void *arg); // host is "" when there is none
+
+// calls fn before returning when the answer is cached, and returns true. otherwise
+// fn is called when the lookup completes, unless rdnscancel() takes it back first
+bool rdnslookup(evdns_base *dns, uint ip, rdnsfn fn, void *arg);
+void rdnscancel(uint ip, void *arg);
+void rdnsclear();
+
+#endif /* RDNS_H_ */
@@ -0,0 +1,206 @@
+#include "cube.h"
+#include "registry.h"
+#ifndef WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#define REGISTRY_MAGIC 0x46524547 // "FREG"
+#define REGISTRY_VERSION 1
+#define REGISTRY_SPINS 10000 // failed reads before assuming a writer died mid-write
+
+struct segment {
+	uint magic, version; // magic is written last by the creator
+#ifndef WIN32
+	pthread_mutex_t lock;
+#endif
+	uint seq; // odd while a write is in progress
+	uint generation;
+	int count, capacity;
+	registryentry entries[1];
+};
+
+#ifdef WIN32
+bool registry::attach(const char *name, bool &created, int capacity) { conoutf("shared registry is not supported on this platform"); return false; }
+void registry::detach() {}
+bool registry::lock() { return false; }
+void registry::unlock() {}
+#else
+bool registry::attach(const char *name, bool &created, int capacity) {
+	detach();
+	created = false;
+	size = sizeof(segment) + (max(capacity, 1) - 1) * sizeof(registryentry);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd >= 0) created = true;
+	else if(errno != EEXIST || (fd = shm_open(name, O_RDWR, 0600)) < 0) {
+		conoutf("could not open shared registry %s: %s", name, strerror(errno));
+		return false;
+	}
+	if(created && ftruncate(fd, size) < 0) {
+		conoutf("could not size shared registry %s: %s", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	// another server may still be sizing it; its size is the one to use
+	struct stat st;
+	for(int tries = 0; !fstat(fd, &st) && size_t(st.st_size) < sizeof(segment); tries++) {
+		if(tries >= 100) { conoutf("shared registry %s has the wrong size", name); close(fd); return false; }
+		usleep(10000);
+	}
+	if(!created) size = st.st_size;
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) { conoutf("could not map shared registry %s: %s", name, strerror(errno)); return false; }
+	seg = (segment *)data;
+
+	if(created) {
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&seg->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		seg->seq = seg->generation = 0;
+		seg->count = 0;
+		seg->capacity = max(capacity, 1);
+		seg->version = REGISTRY_VERSION;
+		__atomic_store_n(&seg->magic, REGISTRY_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		for(int tries = 0; __atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != REGISTRY_MAGIC; tries++) {
+			if(tries >= 100) { conoutf("%s is not a shared registry", name); detach(); return false; }
+			usleep(10000);
+		}
+		if(seg->version != REGISTRY_VERSION || seg->capacity < 1 || size < sizeof(segment) + (seg->capacity - 1) * sizeof(registryentry)) {
+			conoutf("shared registry %s has an incompatible layout", name);
+			detach();
+			return false;
+		}
+	}
+	generation = created ? 0 : ~__atomic_load_n(&seg->generation, __ATOMIC_ACQUIRE); // force the first snapshot
+	return true;
+}
+
+void registry::detach() {
+	if(seg) munmap(seg, size);
+	seg = NULL;
+}
+
+// the owner died holding the lock: whatever it was writing is one entry at most, so
+// just close its write section
+bool registry::lock() {
+	int err = pthread_mutex_lock(&seg->lock);
+	if(err == EOWNERDEAD) {
+		pthread_mutex_consistent(&seg->lock);
+		if(seg->seq & 1) __atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+		seg->generation++;
+	} else if(err) return false;
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return true;
+}
+
+void registry::unlock() {
+	seg->generation++;
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&seg->lock);
+}
+#endif
+
+bool registry::full() {
+	return seg && __atomic_load_n(&seg->count, __ATOMIC_RELAXED) >= seg->capacity;
+}
+
+int registry::capacity() {
+	return seg ? seg->capacity : 0;
+}
+
+bool registry::changed() {
+	return seg && __atomic_load_n(&seg->generation, __ATOMIC_ACQUIRE) != generation;
+}
+
+bool registry::snapshot(vector<registryentry> &out) {
+	if(!seg) return false;
+	for(int tries = 0;; tries++) {
+		uint seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1) {
+			if(tries >= REGISTRY_SPINS) {
+				if(!lock()) return false; // fixes up after a dead writer
+				unlock();
+				tries = 0;
+			}
+#ifndef WIN32
+			sched_yield();
+#endif
+			continue;
+		}
+		uint gen = seg->generation;
+		int n = clamp(seg->count, 0, seg->capacity);
+		out.setsize(0);
+		out.put(seg->entries, n);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) != seq) continue;
+		generation = gen;
+		loopv(out) { // torn strings can't get through the retry, but stay safe
+			out[i].key[MAXSTRLEN-1] = out[i].value[MAXSTRLEN-1] = out[i].extra[MAXSTRLEN-1] = 0;
+		}
+		return true;
+	}
+}
+
+static void dropexpired(segment *seg) {
+	int64_t now = time(NULL);
+	for(int i = 0; i < seg->count; i++) {
+		registryentry &e = seg->entries[i];
+		if(e.expiry && e.expiry <= now) { e = seg->entries[seg->count-1]; seg->count--; i--; }
+	}
+}
+
+bool registry::put(int kind, const char *key, const char *value, const char *extra, int64_t expiry) {
+	if(!seg || !lock()) return false;
+	dropexpired(seg);
+	int i = 0;
+	while(i < seg->count && (seg->entries[i].kind != kind || strcmp(seg->entries[i].key, key))) i++;
+	bool ok = i < seg->capacity;
+	if(ok) {
+		registryentry &e = seg->entries[i];
+		e.kind = kind;
+		e.expiry = expiry;
+		copystring(e.key, key);
+		copystring(e.value, value ? value : "");
+		copystring(e.extra, extra ? extra : "");
+		if(i == seg->count) seg->count++; // after the entry is complete
+	}
+	unlock();
+	if(ok) refused = 0;
+	else if(!refused++) conoutf("shared registry is full (%d entries), raise sharedregistrysize and restart all servers", seg->capacity);
+	return ok;
+}
+
+void registry::remove(int kind, const char *key) {
+	if(!seg || !lock()) return;
+	loopi(seg->count) {
+		registryentry &e = seg->entries[i];
+		if(e.kind != kind || strcmp(e.key, key)) continue;
+		e = seg->entries[seg->count-1];
+		seg->count--;
+		break;
+	}
+	unlock();
+}
+
+void registry::clear(int kind) {
+	if(!seg || !lock()) return;
+	for(int i = 0; i < seg->count; i++) {
+		if(seg->entries[i].kind != kind) continue;
+		seg->entries[i] = seg->entries[seg->count-1];
+		seg->count--;
+		i--;
+	}
+	unlock();
+}
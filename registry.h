@@ -0,0 +1,46 @@
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+// a table of bans, notices and logins in a shared memory segment, so that all the
+// servers on one host can use the same lists. readers never lock: they copy the table
+// under a sequence counter and retry if a writer got in between. writers take a robust
+// process-shared mutex, so a server dying halfway through a write leaves the table usable.
+enum { REGISTRY_BAN = 0, REGISTRY_BLACKLIST, REGISTRY_WHITELIST, REGISTRY_LOGIN, REGISTRY_NUMKINDS };
+
+struct registryentry {
+	int kind;
+	int64_t expiry; // unix time, 0 for never
+	string key, value, extra; // ban: match, name; notice: match, reason; login: user, hash, permissions
+};
+
+struct registry {
+	struct segment *seg;
+	size_t size;
+	uint generation; // last generation copied by snapshot()
+	int refused; // puts that did not fit since the last one that did
+
+	registry() : seg(NULL), size(0), generation(0), refused(0) {}
+	~registry() { detach(); }
+
+	// created is set when this process made the segment, and should seed it. capacity
+	// only matters to the creator, the others use what it made
+	bool attach(const char *name, bool &created, int capacity);
+	void detach();
+	bool attached() const { return seg != NULL; }
+
+	bool changed(); // anything published since the last snapshot()?
+	bool full();
+	int capacity();
+	bool snapshot(vector<registryentry> &out);
+
+	// kind and key identify an entry; put replaces an existing one
+	bool put(int kind, const char *key, const char *value = NULL, const char *extra = NULL, int64_t expiry = 0);
+	void remove(int kind, const char *key);
+	void clear(int kind);
+
+private:
+	bool lock();
+	void unlock();
+};
+
+#endif /* REGISTRY_H_ */
@@ -8,6 +8,12 @@
 #include <event2/dns.h>
 
 #include "evirc.h"
+#include "worker.h"
+#include "rdns.h"
+#include "country.h"
+#include "admission.h"
+#include "logger.h"
+#include "gamelog.h"
 
 void conoutfv(int type, const char *fmt, va_list args) {
 	string sf, sp;
@@ -38,7 +44,7 @@ void fatal(const char *s, ...) {
 
 	cleanupserver();
 	defvformatstring(msg, s, s);
-	server::log("Server Error: %s", msg);
+	logoutf(LL_ERROR, "Server Error: %s", msg);
 	exit(EXIT_FAILURE);
 }
 
@@ -193,10 +199,7 @@ struct client { // server side version of "dynent" type
 	int type;
 	int num;
 	ENetPeer *peer;
-	string ipstr, hostname;
-#ifdef HAVE_GEOIP
-	string country;
-#endif
+	string ipstr, hostname, country;
 	void *info;
 };
 
@@ -207,10 +210,6 @@ size_t tx_packets = 0, rx_packets = 0, tx_bytes = 0, rx_bytes = 0;
 int laststatus = 0;
 ENetSocket pongsock = ENET_SOCKET_NULL, lansock = ENET_SOCKET_NULL;
 
-#ifdef HAVE_GEOIP
-GeoIP *geoip;
-#endif
-
 event_base *evbase;
 evdns_base *dnsbase;
 event serverhost_input_event;
@@ -224,6 +223,8 @@ IRC::Client irc;
 void cleanupserver() {
 	server::log("Cleaning up...");
 	server::writecfg();
+	server::closebans();
+	stopworker();
 
 	if(serverhost)
 		enet_host_destroy(serverhost);
@@ -234,10 +235,8 @@ void cleanupserver() {
 	if(lansock != ENET_SOCKET_NULL)
 		enet_socket_destroy(lansock);
 	pongsock = lansock = ENET_SOCKET_NULL;
-
-#ifdef HAVE_GEOIP
-	GeoIP_delete(geoip);
-#endif
+	closegamelog();
+	stoplog();
 }
 
 void cleanupsig(int sig) {
@@ -266,14 +265,12 @@ char *getclientipstr(int n) {
 char *getclienthostname(int n) {
 	return clients.inrange(n) && clients[n]->type == ST_TCPIP ? clients[n]->hostname : 0;
 }
-#ifdef HAVE_GEOIP
 const char *getclientcountrynul(int n) {
 	return clients.inrange(n) && clients[n]->type == ST_TCPIP ? (clients[n]->country[0] ? clients[n]->country : 0) : 0;
 }
 const char *getclientcountry(int n) {
 	return clients.inrange(n) && clients[n]->type == ST_TCPIP ? (clients[n]->country[0] ? clients[n]->country : "Unknown") : 0;
 }
-#endif
 
 void sendpacket(int n, int chan, ENetPacket * packet, int exclude) {
 	if(n < 0) {
@@ -422,7 +419,7 @@ void sendfile(int cn, int chan, stream * file, const char *format, ...) {
 const char *disc_reasons[] = {
 	"normal", "end of packet", "client num", "kicked/banned", "tag type",
 	"ip is banned", "server is in private mode", "server FULL (maxclients)",
-	"connection timed out"
+	"connection timed out", "too many connects from this address"
 };
 
 void disconnect_client(int n, int reason) {
@@ -433,6 +430,7 @@ void disconnect_client(int n, int reason) {
 	irc.speak(1, "\00314Client %s disconnected because: \00305%s\00315.", clients[n]->ipstr, disc_reasons[reason]);
 
 	enet_peer_disconnect(clients[n]->peer, reason);
+	rdnscancel(clients[n]->peer->address.host, clients[n]);
 	server::clientdisconnect(n, reason);
 	clients[n]->type = ST_EMPTY;
 	clients[n]->peer->data = NULL;
@@ -553,24 +551,21 @@ void update_server(int fd, short e, void *arg) {
 	server::serverupdate();
 }
 
-void rdnscb(int result, char type, int count, int ttl, void *addresses, void *arg) {
-	unsigned long ip = (unsigned long)arg;
-	if(result == DNS_ERR_NONE) {
-		if(type == DNS_PTR && count >= 1) {
-			for(int i = clients.length() - 1; i >= 0; i--) {
-				if(clients[i]->type == ST_TCPIP && clients[i]->peer->address.host == ip) {
-					copystring(clients[i]->hostname, ((char **)addresses)[0]);
-					server::gothostname(clients[i]->info);
-				}
-			}
-		}
-	}
+static void gothostname(uint ip, const char *host, void *arg) {
+	client *c = (client *)arg;
+	if(c->type != ST_TCPIP || c->peer->address.host != ip || !host[0]) return;
+	copystring(c->hostname, host);
+	server::gothostname(c->info);
 }
 
 void serverhost_process_event(ENetEvent & event) {
 	switch (event.type) {
 	  case ENET_EVENT_TYPE_CONNECT:
 		  {
+			  if(!admitconnect(event.peer->address.host)) {
+				  enet_peer_disconnect_now(event.peer, DISC_OVERFLOW);
+				  break;
+			  }
 			  client & c = addclient();
 			  c.type = ST_TCPIP;
 			  c.peer = event.peer;
@@ -578,18 +573,18 @@ void serverhost_process_event(ENetEvent & event) {
 			  char hn[1024];
 
 			  copystring(c.ipstr, (enet_address_get_host_ip(&c.peer->address, hn, sizeof(hn)) == 0) ? hn : "");
-#ifdef HAVE_GEOIP
-			  const char *country = GeoIP_country_name_by_ipnum(geoip, endianswap32(c.peer->address.host));
+			  const char *country = countryname(endianswap32(c.peer->address.host));
 			  if(country) copystring(c.country, country);
 			  else c.country[0] = 0;
-#endif
-			  c.hostname[0] = 0; // FIXME: reverse lookup
-			  evdns_base_resolve_reverse(dnsbase, (in_addr *)&c.peer->address.host, 0, rdnscb, (void *)c.peer->address.host);
+			  c.hostname[0] = 0;
 			  printf("Client connected (%s)\n", c.ipstr);
 			  int reason = server::clientconnect(c.num, c.peer->address.host);
 
-			  if(!reason)
+			  if(!reason) {
 				  nonlocalclients++;
+				  // with a warm cache this can run the hostname bans right away
+				  rdnslookup(dnsbase, c.peer->address.host, gothostname, &c);
+			  }
 			  else
 				  disconnect_client(c.num, reason);
 			  break;
@@ -613,6 +608,7 @@ void serverhost_process_event(ENetEvent & event) {
 
 			  if(!c)
 				  break;
+			  rdnscancel(c->peer->address.host, c);
 			  server::clientdisconnect(c->num);
 			  nonlocalclients--;
 			  c->type = ST_EMPTY;
@@ -735,7 +731,7 @@ int main(int argc, char *argv[]) {
 
 	for(int i = 1; i < argc; i++)
 		if(!serveroption(argv[i]) && !server::serveroption(argv[i]))
-			server::log("WARNING: Unknown command-line option: %s", argv[i]);
+			logoutf(LL_WARN, "Unknown command-line option: %s", argv[i]);
 
 	printf("Initializing server...\n");
 
@@ -756,7 +752,7 @@ int main(int argc, char *argv[]) {
 	};
 	if(*serverip) {
 		if(enet_address_set_host(&address, serverip) < 0)
-			server::log("WARNING: server ip not resolved");
+			logoutf(LL_WARN, "server ip not resolved");
 		else
 			serveraddress.host = address.host;
 	}
@@ -782,7 +778,7 @@ int main(int argc, char *argv[]) {
 		lansock = ENET_SOCKET_NULL;
 	}
 	if(lansock == ENET_SOCKET_NULL)
-		server::log("WARNING: Could not create LAN server info socket.");
+		logoutf(LL_WARN, "Could not create LAN server info socket.");
 	else
 		enet_socket_set_option(lansock, ENET_SOCKOPT_NONBLOCK, 1);
 
@@ -796,11 +792,6 @@ int main(int argc, char *argv[]) {
 	event_assign(&lansock_input_event, evbase, lansock, EV_READ | EV_PERSIST, &serverinfo_input, NULL);
 	event_add(&lansock_input_event, NULL);
 
-#ifdef HAVE_GEOIP
-	printf("Initializing GeoIP\n");
-	geoip = GeoIP_new(GEOIP_STANDARD);
-#endif
-
 	printf("Initializing game server...\n");
 	server::serverinit();
 
@@ -4,7 +4,7 @@
 
 extern int maxclients;
 
-enum { DISC_NONE = 0, DISC_EOP, DISC_CN, DISC_KICK, DISC_TAGT, DISC_IPBAN, DISC_PRIVATE, DISC_MAXCLIENTS, DISC_TIMEOUT, DISC_NUM };
+enum { DISC_NONE = 0, DISC_EOP, DISC_CN, DISC_KICK, DISC_TAGT, DISC_IPBAN, DISC_PRIVATE, DISC_MAXCLIENTS, DISC_TIMEOUT, DISC_OVERFLOW, DISC_NUM };
 extern const char *disc_reasons[];
 
 extern void *getclientinfo(int i);
@@ -16,10 +16,8 @@ extern int getnumclients();
 extern uint getclientip(int n);
 extern char *getclientipstr(int n);
 extern char *getclienthostname(int n);
-#ifdef HAVE_GEOIP
-extern const char *getclientcountrynul(int n); // returns "" if country is not found
+extern const char *getclientcountrynul(int n); // returns NULL if country is not found
 extern const char *getclientcountry(int n); // returns Unknown if country is not found
-#endif
 
 extern void putint(ucharbuf &p, int n);
 extern void putint(packetbuf &p, int n);
@@ -43,11 +41,6 @@ extern void sendserverinforeply(ucharbuf &p);
 extern bool requestmaster(const char *req);
 extern bool requestmasterf(const char *fmt, ...);
 
-#ifdef HAVE_GEOIP
-#include <GeoIP.h>
-extern GeoIP *geoip;
-#endif
-
 #include <event2/event.h>
 #include <event2/event_struct.h>
 #include <event2/dns.h>
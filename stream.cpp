@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
 
 string homedir = "";
@@ -579,6 +581,23 @@ stream *openfile(const char *filename, const char *mode)
     return openrawfile(filename, mode);
 }
 
+// moves a finished file over another in one step, so readers (and mappings) of the old file
+// never see it half written
+bool replacefile(const char *from, const char *to)
+{
+    string src, dst;
+    const char *found = findfile(from, "wb");
+    if(!found) return false;
+    copystring(src, found);
+    found = findfile(to, "wb");
+    if(!found) return false;
+    copystring(dst, found);
+#ifdef WIN32
+    remove(dst);
+#endif
+    return rename(src, dst) == 0;
+}
+
 stream *opentempfile(const char *name, const char *mode)
 {
     const char *found = findfile(name, mode);
@@ -616,3 +635,32 @@ char *loadfile(const char *fn, int *size)
     return buf;
 }
 
+// read-only view of a whole file. falls back to loadfile() where mmap is not available
+uchar *mapfile(const char *fn, int *size)
+{
+#ifdef WIN32
+    return (uchar *)loadfile(fn, size);
+#else
+    const char *found = findfile(fn, "rb");
+    if(!found) return NULL;
+    int fd = open(found, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > INT_MAX) { close(fd); return NULL; }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return NULL;
+    if(size) *size = int(st.st_size);
+    return (uchar *)data;
+#endif
+}
+
+void unmapfile(uchar *data, int size)
+{
+    if(!data) return;
+#ifdef WIN32
+    delete[] (char *)data;
+#else
+    munmap(data, size);
+#endif
+}
@@ -154,6 +154,63 @@ void getsha1(char *pwd, char *hash, int maxlen) {
 	snprintf(hash, maxlen, "%08X%08X%08X%08X%08X", message_digest[0], message_digest[1], message_digest[2], message_digest[3], message_digest[4]);
 }
 
+static void sha1digest(SHA1 &sha, uchar *out) {
+	unsigned d[5];
+	sha.Result(d);
+	loopi(5) loopj(4) out[i*4+j] = (d[i] >> (24 - 8*j)) & 0xFF;
+}
+
+static void hmacsha1(const uchar *key, int keylen, const uchar *msg, int msglen, uchar *out) {
+	uchar k[64], pad[64], inner[20];
+	memset(k, 0, sizeof(k));
+	SHA1 sha;
+	if(keylen > 64) {
+		sha.Reset();
+		sha.Input(key, keylen);
+		sha1digest(sha, k);
+	} else memcpy(k, key, keylen);
+	loopi(64) pad[i] = k[i] ^ 0x36;
+	sha.Reset();
+	sha.Input(pad, 64);
+	sha.Input(msg, msglen);
+	sha1digest(sha, inner);
+	loopi(64) pad[i] = k[i] ^ 0x5C;
+	sha.Reset();
+	sha.Input(pad, 64);
+	sha.Input(inner, 20);
+	sha1digest(sha, out);
+}
+
+// PBKDF2 with HMAC-SHA1 (RFC 2898), slow on purpose: keep it off the game loop
+void pbkdf2sha1(const char *pwd, const uchar *salt, int saltlen, int iters, uchar *out, int outlen) {
+	int pwdlen = min((int)strlen(pwd), MAXSTRLEN);
+	vector<uchar> msg;
+	msg.put(salt, saltlen);
+	for(int block = 1; outlen > 0; block++) {
+		msg.setsize(saltlen);
+		loopi(4) msg.add((block >> (24 - 8*i)) & 0xFF);
+		uchar u[20], t[20];
+		hmacsha1((const uchar *)pwd, pwdlen, msg.getbuf(), msg.length(), u);
+		memcpy(t, u, 20);
+		for(int i = 1; i < iters; i++) {
+			hmacsha1((const uchar *)pwd, pwdlen, u, 20, u);
+			loopj(20) t[j] ^= u[j];
+		}
+		int n = min(outlen, 20);
+		memcpy(out, t, n);
+		out += n;
+		outlen -= n;
+	}
+}
+
+// case-insensitive, and the time taken only depends on the lengths
+bool hashequal(const char *a, const char *b) {
+	int la = strlen(a), lb = strlen(b);
+	uint diff = la ^ lb;
+	loopi(la) diff |= uint(tolower(uchar(a[i])) ^ tolower(uchar(b[i % max(lb, 1)])));
+	return !diff;
+}
+
 #ifndef _GNU_SOURCE
 char *strndup(const char *s, size_t n) {
 	size_t l = strlen(s);
@@ -178,43 +235,172 @@ char *evbuffer_readln_nul(struct evbuffer *buffer, size_t *n_read_out, enum evbu
 	return result;
 }
 
+HttpClient httpclient;
+
+static void printdnserror(int result) {
+	printf("DNS error:");
+#define DNSERR(x) if(result == DNS_ERR_##x) printf(" DNS_ERR_" #x);
+	DNSERR(NONE); DNSERR(FORMAT); DNSERR(SERVERFAILED); DNSERR(NOTEXIST); DNSERR(NOTIMPL); DNSERR(REFUSED);
+	DNSERR(TRUNCATED); DNSERR(UNKNOWN); DNSERR(TIMEOUT); DNSERR(SHUTDOWN); DNSERR(CANCEL);
+#undef DNSERR
+	printf("\n");
+}
+
+static void froghttp_dnscb(int result, char type, int count, int ttl, void *addresses, void *arg) {
+	HttpHost *h = (HttpHost *)arg;
+	h->resolving = false;
+	bool ok = result == DNS_ERR_NONE && type == DNS_IPv4_A && count > 0;
+	if(ok) {
+		h->addr = ((in_addr *)addresses)[0];
+		h->expires = time(NULL) + clamp(ttl, httpclient.mindnsttl, httpclient.maxdnsttl);
+	} else {
+		if(result != DNS_ERR_NONE) printdnserror(result);
+		else printf("%s: type != DNS_IPv4_A\n", __func__);
+		if(h->addr.s_addr) { // keep using the old address for a while
+			h->expires = time(NULL) + httpclient.mindnsttl;
+			ok = true;
+		}
+	}
+
+	vector<HttpQuery *> waiting;
+	waiting.move(h->waiting);
+	loopv(waiting) {
+		if(ok) httpclient.send(waiting[i]);
+		else httpclient.retry(waiting[i]);
+	}
+}
+
 static void froghttp_reqcb(evhttp_request *req, void *arg) {
 	HttpQuery *q = (HttpQuery *)arg;
+	q->con->pending--;
+	q->con = NULL;
+	int code = req ? evhttp_request_get_response_code(req) : 0;
+	if(!code || code >= 500) httpclient.retry(q);
+	else httpclient.finish(q, req);
+}
+
+static void froghttp_retrycb(evutil_socket_t fd, short what, void *arg) {
+	httpclient.request((HttpQuery *)arg);
+}
+
+HttpHost *HttpClient::gethost(const char *name, int port) {
+	loopv(hosts) if(hosts[i]->port == port && !strcasecmp(hosts[i]->name, name)) return hosts[i];
+	HttpHost *h = new HttpHost(name, port);
+	if(inet_aton(name, &h->addr)) h->expires = 0;
+	hosts.add(h);
+	return h;
+}
+
+void HttpClient::request(HttpQuery *q) {
+	if(!q->host) q->host = gethost(q->url.hostname, q->url.port);
+	HttpHost *h = q->host;
+	q->attempts++;
+	if(h->expires == 0 || (h->expires > 0 && time(NULL) < h->expires)) { send(q); return; }
+	h->waiting.add(q);
+	if(h->resolving) return;
+	h->resolving = true;
+	lookups++;
+	evdns_base_resolve_ipv4(q->dnsbase, h->name, 0, froghttp_dnscb, h); // may answer right away
+}
+
+// the least busy connection to the current address, or a new one while there are fewer than maxconns
+void HttpClient::send(HttpQuery *q) {
+	HttpHost *h = q->host;
+	HttpConnection *best = NULL;
+	loopv(h->cons) {
+		HttpConnection *c = h->cons[i];
+		if(c->addr.s_addr != h->addr.s_addr) {
+			if(!c->pending) { evhttp_connection_free(c->con); delete c; h->cons.remove(i--); } // the host moved
+			continue;
+		}
+		if(!best || c->pending < best->pending) best = c;
+	}
+	if(!best || (best->pending && h->cons.length() < maxconns)) {
+		best = new HttpConnection;
+		best->addr = h->addr;
+		best->pending = 0;
+		best->con = evhttp_connection_base_new(q->base, q->dnsbase, inet_ntoa(h->addr), h->port);
+		evhttp_connection_set_timeout(best->con, timeout);
+		h->cons.add(best);
+		connections++;
+	}
+
+	evhttp_request *req = evhttp_request_new(froghttp_reqcb, q);
+	evkeyvalq *headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "Host", h->name); // fix for HTTP/1.1
+	evhttp_add_header(headers, "Connection", "keep-alive");
+	if(q->body) {
+		evhttp_add_header(headers, "Content-Type", q->contenttype);
+		evbuffer_add(evhttp_request_get_output_buffer(req), evbuffer_pullup(q->body, -1), evbuffer_get_length(q->body));
+	}
+	q->con = best;
+	best->pending++;
+	sent++;
+	if(evhttp_make_request(best->con, req, q->body ? EVHTTP_REQ_POST : EVHTTP_REQ_GET, q->url.full)) { // req is gone already
+		best->pending--;
+		q->con = NULL;
+		retry(q);
+	}
+}
+
+void HttpClient::finish(HttpQuery *q, evhttp_request *req) {
 	if(q->cb) q->cb(req, q->arg);
 	delete q;
+	pending--;
 }
 
-static void froghttp_dnscb(int result, char type, int count, int ttl, void *addresses, void *arg) {
-	HttpQuery *q = (HttpQuery *)arg;
-	if(result == DNS_ERR_NONE) {
-		if(type == DNS_IPv4_A) {
-			char *ipstr = inet_ntoa(((in_addr *)addresses)[0]);
-			evhttp_request *req = evhttp_request_new(froghttp_reqcb, arg);
-			evkeyvalq *headers = evhttp_request_get_output_headers(req);
-			evhttp_add_header(headers, "Host", q->url.hostname); // fix for HTTP/1.1
-			evhttp_connection *con = evhttp_connection_base_new(q->base, q->dnsbase, ipstr, q->url.port);
-			evhttp_make_request(con, req, EVHTTP_REQ_GET, q->url.full);
-			return;
-		} else printf("%s: type != DNS_IPv4_A\n", __func__);
-	} else {
-		printf("DNS error:");
-#define DNSERR(x) if(result == DNS_ERR_##x) printf(" DNS_ERR_" #x);
-		DNSERR(NONE); DNSERR(FORMAT); DNSERR(SERVERFAILED); DNSERR(NOTEXIST); DNSERR(NOTIMPL); DNSERR(REFUSED);
-		DNSERR(TRUNCATED); DNSERR(UNKNOWN); DNSERR(TIMEOUT); DNSERR(SHUTDOWN); DNSERR(CANCEL);
-		printf("\n");
+// again after backoffmillis, doubled with every attempt
+void HttpClient::retry(HttpQuery *q) {
+	if(q->attempts > retries) {
+		failed++;
+		printf("HTTP request to %s failed %d times, giving up\n", q->url.full, q->attempts);
+		finish(q, NULL);
+		return;
 	}
+	retried++;
+	int delay = backoffmillis;
+	for(int i = 1; i < q->attempts && delay < maxbackoffmillis; i++) delay *= 2;
+	delay = min(delay, maxbackoffmillis);
+	if(!q->retrytimer) q->retrytimer = evtimer_new(q->base, froghttp_retrycb, q);
+	timeval tv = { delay / 1000, (delay % 1000) * 1000 };
+	evtimer_add(q->retrytimer, &tv);
+}
 
-	delete q; // error case only
+int HttpClient::idle() {
+	int n = 0;
+	loopv(hosts) loopvj(hosts[i]->cons) if(!hosts[i]->cons[j]->pending) n++;
+	return n;
 }
 
-void froghttp_get(event_base *base, evdns_base *dnsbase, char *url, void(*cb)(evhttp_request *, void *), void *arg) {
+static HttpQuery *newquery(event_base *base, evdns_base *dnsbase, char *url, void(*cb)(evhttp_request *, void *), void *arg) {
+	if(httpclient.pending >= httpclient.maxpending) {
+		httpclient.dropped++;
+		printf("Too many HTTP requests pending, dropping %s\n", url);
+		if(cb) cb(NULL, arg);
+		return NULL;
+	}
 	HttpQuery *q = new HttpQuery;
 	q->base = base;
 	q->dnsbase = dnsbase;
 	q->url.parse(url);
 	q->arg = arg;
 	q->cb = cb;
-	evdns_base_resolve_ipv4(dnsbase, q->url.hostname, 0, froghttp_dnscb, q);
+	httpclient.pending++;
+	return q;
+}
+
+void froghttp_get(event_base *base, evdns_base *dnsbase, char *url, void(*cb)(evhttp_request *, void *), void *arg) {
+	HttpQuery *q = newquery(base, dnsbase, url, cb, arg);
+	if(q) httpclient.request(q);
+}
+
+void froghttp_post(event_base *base, evdns_base *dnsbase, char *url, const char *contenttype, evbuffer *body, void(*cb)(evhttp_request *, void *), void *arg) {
+	HttpQuery *q = newquery(base, dnsbase, url, cb, arg);
+	if(!q) { evbuffer_drain(body, evbuffer_get_length(body)); return; }
+	q->contenttype = contenttype;
+	q->body = evbuffer_new();
+	evbuffer_add_buffer(q->body, body);
+	httpclient.request(q);
 }
 
 void bufferevent_print_error(short what, const char *fmt, ...) {
@@ -822,6 +822,8 @@ char *timestr(int64_t time);
 char *trim(char *str);
 int strcmpf(char *s1, const char *s2fmt, ...);
 void getsha1(char *pwd, char *hash, int maxlen=MAXSTRLEN);
+void pbkdf2sha1(const char *pwd, const uchar *salt, int saltlen, int iters, uchar *out, int outlen);
+bool hashequal(const char *a, const char *b);
 #ifndef _GNU_SOURCE
 char *strndup(const char *s, size_t n);
 #endif
@@ -921,6 +923,9 @@ struct URL {
 
 };
 
+struct HttpHost;
+struct HttpConnection;
+
 struct HttpQuery {
 	event_base *base;
 	evdns_base *dnsbase;
@@ -928,9 +933,65 @@ struct HttpQuery {
 	void (*cb)(evhttp_request *req, void *arg);
 	char *filename;
 	void *arg;
+	evbuffer *body; // posted when set, kept for retries
+	const char *contenttype;
+	HttpHost *host;
+	HttpConnection *con; // carrying the request
+	int attempts;
+	event *retrytimer;
+
+	HttpQuery() : cb(NULL), filename(NULL), arg(NULL), body(NULL), contenttype(NULL), host(NULL), con(NULL), attempts(0), retrytimer(NULL) {}
+	~HttpQuery() { if(body) evbuffer_free(body); if(retrytimer) event_free(retrytimer); }
+};
+
+struct HttpConnection {
+	evhttp_connection *con;
+	in_addr addr;
+	int pending; // requests queued on it, which libevent sends one after the other
+};
+
+// one per host and port: the resolved address and the keep-alive connections to it
+struct HttpHost {
+	char *name;
+	int port;
+	in_addr addr;
+	time_t expires; // the address is looked up again after this; 0 when the name is numeric
+	bool resolving;
+	vector<HttpQuery *> waiting; // for the address
+	vector<HttpConnection *> cons;
+
+	HttpHost(const char *name, int port) : name(strdup(name)), port(port), expires(-1), resolving(false) { addr.s_addr = 0; }
+	~HttpHost() { free(name); }
+};
+
+// requests go over a few kept alive connections per host, with cached dns answers.
+// failed requests (no answer or a 5xx) are sent again after a growing pause
+struct HttpClient {
+	vector<HttpHost *> hosts;
+	int maxconns; // per host
+	int retries, backoffmillis, maxbackoffmillis;
+	int maxpending; // requests not finished yet, including retries waiting; more are dropped
+	int timeout; // seconds
+	int mindnsttl, maxdnsttl; // seconds
+	int pending;
+	long long sent, retried, failed, dropped, connections, lookups;
+
+	HttpClient() : maxconns(2), retries(3), backoffmillis(1000), maxbackoffmillis(60000), maxpending(256), timeout(10), mindnsttl(60), maxdnsttl(3600), pending(0),
+		sent(0), retried(0), failed(0), dropped(0), connections(0), lookups(0) {}
+
+	void request(HttpQuery *q);
+	HttpHost *gethost(const char *name, int port);
+	void send(HttpQuery *q);
+	void finish(HttpQuery *q, evhttp_request *req);
+	void retry(HttpQuery *q);
+	int idle(); // connections without requests
 };
 
+extern HttpClient httpclient;
+
 void froghttp_get(event_base *base, evdns_base *dnsbase, char *url, void(*cb)(evhttp_request *, void *), void *arg);
+// empties body into the request
+void froghttp_post(event_base *base, evdns_base *dnsbase, char *url, const char *contenttype, evbuffer *body, void(*cb)(evhttp_request *, void *), void *arg);
 void bufferevent_print_error(short what, const char *fmt, ...);
 void evdns_print_error(int result, const char *fmt, ...);
 void bufferevent_write_printf(struct bufferevent *be, const char *fmt, ...);
@@ -0,0 +1,114 @@
+#include "cube.h"
+#include "worker.h"
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+static vector<workjob *> pendingjobs, finishedjobs;
+static bool workerquit = false;
+
+VAR(workerthreads, 1, 2, 8); // read when the first job is queued
+
+#ifdef WIN32
+void queuejob(workjob *job) {
+	job->work();
+	finishedjobs.add(job);
+}
+
+void canceljob(workjob *job) {
+	if(!workerquit) job->cancelled = true;
+}
+
+void stopworker() {
+	workerquit = true;
+	finishedjobs.deletecontentsp();
+}
+#else
+static vector<pthread_t> workers;
+static pthread_mutex_t workerlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workercond = PTHREAD_COND_INITIALIZER;
+static bool workerstarted = false;
+static bool anyfinished = false; // peeked without the lock every tick
+
+static void *workerloop(void *arg) {
+	pthread_mutex_lock(&workerlock);
+	for(;;) {
+		while(pendingjobs.empty() && !workerquit) pthread_cond_wait(&workercond, &workerlock);
+		if(pendingjobs.empty()) break;
+		workjob *job = pendingjobs.remove(0);
+		pthread_mutex_unlock(&workerlock);
+		job->work();
+		pthread_mutex_lock(&workerlock);
+		finishedjobs.add(job);
+		__atomic_store_n(&anyfinished, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&workerlock);
+	return NULL;
+}
+
+void queuejob(workjob *job) {
+	if(!workerstarted && !workerquit) {
+		loopi(workerthreads) {
+			pthread_t t;
+			if(pthread_create(&t, NULL, workerloop, NULL)) break;
+			workers.add(t);
+		}
+		if(workers.empty()) conoutf("could not start the worker threads, working synchronously");
+		else workerstarted = true;
+	}
+	if(!workerstarted) {
+		job->work();
+		pthread_mutex_lock(&workerlock);
+		finishedjobs.add(job);
+		anyfinished = true;
+		pthread_mutex_unlock(&workerlock);
+		return;
+	}
+	pthread_mutex_lock(&workerlock);
+	pendingjobs.add(job);
+	pthread_cond_signal(&workercond);
+	pthread_mutex_unlock(&workerlock);
+}
+
+void canceljob(workjob *job) {
+	if(workerquit) return; // stopworker() has deleted it
+	pthread_mutex_lock(&workerlock);
+	job->cancelled = true;
+	int queued = pendingjobs.find(job);
+	if(queued >= 0) pendingjobs.remove(queued);
+	pthread_mutex_unlock(&workerlock);
+	if(queued >= 0) delete job;
+}
+
+void stopworker() {
+	if(workerstarted) {
+		pthread_mutex_lock(&workerlock);
+		workerquit = true;
+		pthread_cond_broadcast(&workercond);
+		pthread_mutex_unlock(&workerlock);
+		loopv(workers) pthread_join(workers[i], NULL);
+		workers.setsize(0);
+		workerstarted = false;
+	}
+	workerquit = true;
+	finishedjobs.deletecontentsp();
+}
+#endif
+
+void finishjobs() {
+#ifndef WIN32
+	if(!__atomic_load_n(&anyfinished, __ATOMIC_ACQUIRE)) return;
+	vector<workjob *> jobs;
+	pthread_mutex_lock(&workerlock);
+	jobs.move(finishedjobs);
+	anyfinished = false;
+	pthread_mutex_unlock(&workerlock);
+#else
+	vector<workjob *> jobs;
+	jobs.move(finishedjobs);
+#endif
+	loopv(jobs) {
+		if(!jobs[i]->cancelled) jobs[i]->done();
+		delete jobs[i];
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef WORKER_H_
+#define WORKER_H_
+
+// jobs too slow for the game loop. work() runs on one of the worker threads and must not
+// touch game state; done() runs on the main thread at the next server tick, then the job is deleted.
+struct workjob {
+	bool cancelled;
+
+	workjob() : cancelled(false) {}
+	virtual ~workjob() {}
+	virtual void work() = 0;
+	virtual void done() = 0;
+};
+
+void queuejob(workjob *job);
+// the job is deleted without done() being called: at once if no thread has picked it up,
+// otherwise when its work() returns. main thread only, and only before done() has run
+void canceljob(workjob *job);
+void finishjobs(); // call from the main loop
+void stopworker(); // runs out the queue, then drops the results without calling done()
+
+#endif /* WORKER_H_ */